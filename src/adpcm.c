@@ -0,0 +1,121 @@
+/***
+ * AUTHOR:  Christopher Stones
+ * EMAIL:   chris.stones _AT_ zoho.com / chris.stones _AT_ gmail.com
+ * LICENSE: GPL-v3
+ *
+ * IMA-ADPCM block coder.
+ *	Block layout: the first sample ( int16, native ), step index, reserved byte,
+ *	then ADPCM_BLOCK_FRAMES - 1 4 bit codes for the rest, low nibble first
+ *	( the last nibble is unused ), as in WAV IMA-ADPCM.
+ */
+
+#include "adpcm.h"
+
+#include <string.h>
+
+static const int16_t _step_table[89] = {
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+	50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+	253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+	1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+	3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+	12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int8_t _index_table[16] = {
+	-1, -1, -1, -1, 2, 4, 6, 8,
+	-1, -1, -1, -1, 2, 4, 6, 8
+};
+
+// Apply one code to the decoders state - shared by both sides, so they never drift.
+static inline void _step(int * predictor, int * index, int code) {
+
+	int step  = _step_table[*index];
+	int delta = step >> 3;
+
+	if(code & 4) delta += step;
+	if(code & 2) delta += step >> 1;
+	if(code & 1) delta += step >> 2;
+
+	*predictor += (code & 8) ? -delta : delta;
+
+	if(*predictor >  32767) *predictor =  32767;
+	if(*predictor < -32768) *predictor = -32768;
+
+	*index += _index_table[code];
+
+	if(*index <  0) *index =  0;
+	if(*index > 88) *index = 88;
+}
+
+static inline int _encode(int predictor, int index, int sample) {
+
+	int step = _step_table[index];
+	int diff = sample - predictor;
+	int code = 0;
+
+	if(diff < 0) {
+		code = 8;
+		diff = -diff;
+	}
+
+	if(diff >= step)        { code |= 4; diff -= step; }
+	if(diff >= (step >> 1)) { code |= 2; diff -= step >> 1; }
+	if(diff >= (step >> 2)) { code |= 1; }
+
+	return code;
+}
+
+void adpcm_encode_block(uint8_t * dst, const int16_t * src, size_t count, int * index) {
+
+	int predictor;
+	int16_t p16;
+	size_t i;
+
+	if(count > ADPCM_BLOCK_FRAMES)
+		count = ADPCM_BLOCK_FRAMES;
+
+	// the first sample goes in verbatim, so the block decodes on its own.
+	predictor = count ? src[0] : 0;
+
+	p16 = predictor;
+	memcpy(dst, &p16, sizeof p16);
+	dst[2] = *index;
+	dst[3] = 0;
+	dst += 4;
+
+	memset(dst, 0, ADPCM_BLOCK_FRAMES / 2);
+
+	for(i=1;i<ADPCM_BLOCK_FRAMES;i++) {
+
+		// pad with the last sample - it's never seen.
+		int sample = count ? src[ i < count ? i : count - 1 ] : 0;
+		int code;
+
+		code = _encode(predictor, *index, sample);
+		_step(&predictor, index, code);
+
+		dst[(i - 1) >> 1] |= code << (((i - 1) & 1) * 4);
+	}
+}
+
+void adpcm_decode_block(int16_t * dst, const uint8_t * src) {
+
+	int predictor;
+	int index;
+	int16_t p16;
+	size_t i;
+
+	memcpy(&p16, src, sizeof p16);
+	predictor = p16;
+	index = src[2] > 88 ? 88 : src[2];
+	src += 4;
+
+	dst[0] = predictor;
+
+	for(i=1;i<ADPCM_BLOCK_FRAMES;i++) {
+
+		_step(&predictor, &index, (src[(i - 1) >> 1] >> (((i - 1) & 1) * 4)) & 0x0f);
+		dst[i] = predictor;
+	}
+}
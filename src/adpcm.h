@@ -0,0 +1,20 @@
+#pragma once
+
+/*
+ * IMA-ADPCM - 4 bits per native signed 16 bit sample.
+ *	Audio is coded in blocks that start with the decoders state ( the first sample,
+ *	stored as is ), so decoding can start at any block.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ADPCM_BLOCK_FRAMES 1024
+#define ADPCM_BLOCK_BYTES  (4 + ADPCM_BLOCK_FRAMES / 2) // state, then two codes per byte ( one spare ).
+
+// Encode up to ADPCM_BLOCK_FRAMES samples ( short blocks are padded ).
+//	'index' carries the step size over from the previous block, start it at 0.
+void adpcm_encode_block(uint8_t * dst, const int16_t * src, size_t count, int * index);
+
+// Decode a whole block ( ADPCM_BLOCK_FRAMES samples ).
+void adpcm_decode_block(int16_t * dst, const uint8_t * src);
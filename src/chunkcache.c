@@ -0,0 +1,308 @@
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "chunkcache.h"
+
+#define NO_CHUNK ((size_t)-1)
+
+struct chunk_cache_slot {
+
+	uint8_t * data;
+	size_t chunk; // chunk held by this slot, or NO_CHUNK.
+	int loading;  // being filled, with the cache unlocked.
+
+	// LRU list - most recently used at the head.
+	int prev;
+	int next;
+};
+
+struct chunk_cache {
+
+	mem_chunk_pager_t pager; // MUST BE FIRST.
+
+	pthread_mutex_t lock;
+	pthread_cond_t  cond; // signalled when a slot finishes loading.
+
+	chunk_cache_fill_fn fill;
+	void * user;
+
+	ef_file_t file; // if filled from a file.
+	size_t size;
+	size_t chunk_size;
+
+	int * slot_of; // chunk -> slot, or -1 if not resident.
+	size_t nchunks;
+
+	struct chunk_cache_slot * slots;
+	uint8_t * memory; // every slots data, in one page aligned block.
+	size_t memory_size;
+	int nslots;
+	int head;
+	int tail;
+};
+
+static void _unlink_slot(chunk_cache_t * cache, int s) {
+
+	struct chunk_cache_slot * slot = cache->slots + s;
+
+	if(slot->prev != -1) cache->slots[slot->prev].next = slot->next; else cache->head = slot->next;
+	if(slot->next != -1) cache->slots[slot->next].prev = slot->prev; else cache->tail = slot->prev;
+}
+
+static void _push_head(chunk_cache_t * cache, int s) {
+
+	struct chunk_cache_slot * slot = cache->slots + s;
+
+	slot->prev = -1;
+	slot->next = cache->head;
+
+	if(cache->head != -1)
+		cache->slots[cache->head].prev = s;
+	cache->head = s;
+
+	if(cache->tail == -1)
+		cache->tail = s;
+}
+
+static void _push_tail(chunk_cache_t * cache, int s) {
+
+	struct chunk_cache_slot * slot = cache->slots + s;
+
+	slot->prev = cache->tail;
+	slot->next = -1;
+
+	if(cache->tail != -1)
+		cache->slots[cache->tail].next = s;
+	cache->tail = s;
+
+	if(cache->head == -1)
+		cache->head = s;
+}
+
+static int _read_chunk(void * user, size_t chunk, uint8_t * dst) {
+
+	chunk_cache_t * cache = (chunk_cache_t *)user;
+	off_t  offset = chunk * cache->chunk_size;
+	size_t count  = cache->size - offset;
+
+	if(count > cache->chunk_size)
+		count = cache->chunk_size;
+
+	// positioned, so concurrent fills don't share the files cursor.
+	if( ef_file_pread(cache->file, dst, count, offset) != (ssize_t)count )
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Find ( or fill ) the slot holding 'chunk'.
+ *	Call with cache->lock held - it is dropped while filling. The slot is marked loading
+ *	meanwhile, so threads that want the same chunk wait for it, and it isn't recycled.
+ */
+static uint8_t * _fault_locked(chunk_cache_t * cache, size_t chunk) {
+
+	int err;
+	int s;
+
+	for(;;) {
+
+		if((s = cache->slot_of[chunk]) != -1) {
+
+			if(cache->slots[s].loading) {
+				pthread_cond_wait(&cache->cond, &cache->lock); // another thread is filling it.
+				continue;
+			}
+
+			_unlink_slot(cache, s);
+			_push_head(cache, s);
+
+			return cache->slots[s].data;
+		}
+
+		// miss - recycle the least recently used slot that isn't being filled.
+		for(s = cache->tail; (s != -1) && cache->slots[s].loading; s = cache->slots[s].prev)
+			;
+
+		if(s != -1)
+			break;
+
+		pthread_cond_wait(&cache->cond, &cache->lock); // every slot is being filled.
+	}
+
+	if(cache->slots[s].chunk != NO_CHUNK)
+		cache->slot_of[ cache->slots[s].chunk ] = -1;
+
+	cache->slots[s].chunk   = chunk;
+	cache->slots[s].loading = 1;
+	cache->slot_of[chunk]   = s;
+
+	_unlink_slot(cache, s);
+	_push_head(cache, s);
+
+	pthread_mutex_unlock(&cache->lock);
+	err = cache->fill(cache->user, chunk, cache->slots[s].data);
+	pthread_mutex_lock(&cache->lock);
+
+	cache->slots[s].loading = 0;
+
+	if(err != 0) {
+		// forget it, and recycle the slot first.
+		cache->slot_of[chunk] = -1;
+		cache->slots[s].chunk = NO_CHUNK;
+		_unlink_slot(cache, s);
+		_push_tail(cache, s);
+	}
+
+	pthread_cond_broadcast(&cache->cond);
+
+	return err ? NULL : cache->slots[s].data;
+}
+
+static uint8_t * _fault(mem_chunk_pager_t * pager, size_t chunk) {
+
+	chunk_cache_t * cache = (chunk_cache_t *)pager;
+	uint8_t * data;
+
+	if(chunk >= cache->nchunks)
+		return NULL;
+
+	pthread_mutex_lock(&cache->lock);
+	data = _fault_locked(cache, chunk);
+	pthread_mutex_unlock(&cache->lock);
+
+	return data;
+}
+
+// copy out under the lock, so another thread can't recycle the slot mid-copy ( the fill itself is unlocked ).
+static int _read(mem_chunk_pager_t * pager, size_t chunk, size_t offset, void * dst, size_t count) {
+
+	chunk_cache_t * cache = (chunk_cache_t *)pager;
+	uint8_t * data;
+
+	if((chunk >= cache->nchunks) || (offset + count > cache->chunk_size))
+		return -1;
+
+	pthread_mutex_lock(&cache->lock);
+
+	if((data = _fault_locked(cache, chunk)) != NULL)
+		memcpy(dst, data + offset, count);
+
+	pthread_mutex_unlock(&cache->lock);
+
+	return data ? 0 : -1;
+}
+
+int chunk_cache_create(chunk_cache_t ** cache, ef_file_t file, size_t file_size, size_t chunk_size, size_t budget) {
+
+	if(!file)
+		return -1;
+
+	if( chunk_cache_create_fill(cache, &_read_chunk, NULL, file_size, chunk_size, budget) != 0 )
+		return -1;
+
+	(*cache)->file = file;
+	(*cache)->user = *cache;
+
+	return 0;
+}
+
+int chunk_cache_create_fill(chunk_cache_t ** cache, chunk_cache_fill_fn fill, void * user, size_t size, size_t chunk_size, size_t budget) {
+
+	size_t c;
+	int i;
+
+	if(!cache || !fill || !chunk_size)
+		return -1;
+
+	if((*cache = calloc(1, sizeof(chunk_cache_t))) == NULL)
+		return -1;
+
+	(*cache)->pager.fault = &_fault;
+	(*cache)->pager.read  = &_read;
+	(*cache)->fill        = fill;
+	(*cache)->user        = user;
+	(*cache)->size        = size;
+	(*cache)->chunk_size  = chunk_size;
+	(*cache)->nchunks     = (size + (chunk_size-1)) / chunk_size;
+	(*cache)->head        = -1;
+	(*cache)->tail        = -1;
+
+	// need at least two slots, so a read spanning a chunk boundary can make progress.
+	(*cache)->nslots = budget / chunk_size;
+	if((*cache)->nslots < 2)
+		(*cache)->nslots = 2;
+
+	if(pthread_mutex_init(&(*cache)->lock, NULL) != 0) {
+		free(*cache);
+		*cache = NULL;
+		return -1;
+	}
+
+	if(pthread_cond_init(&(*cache)->cond, NULL) != 0) {
+		pthread_mutex_destroy(&(*cache)->lock);
+		free(*cache);
+		*cache = NULL;
+		return -1;
+	}
+
+	if(((*cache)->slot_of = malloc(((*cache)->nchunks ? (*cache)->nchunks : 1) * sizeof(int))) == NULL)
+		goto bad;
+
+	if(((*cache)->slots = calloc((*cache)->nslots, sizeof(struct chunk_cache_slot))) == NULL)
+		goto bad;
+
+	for(c=0;c<(*cache)->nchunks;c++)
+		(*cache)->slot_of[c] = -1;
+
+	(*cache)->memory_size = ((*cache)->nslots * chunk_size + (ALLOC_ARENA_ALIGNMENT-1)) & ~((size_t)ALLOC_ARENA_ALIGNMENT-1);
+
+	if(posix_memalign((void **)&(*cache)->memory, ALLOC_ARENA_ALIGNMENT, (*cache)->memory_size) != 0) {
+		(*cache)->memory = NULL;
+		goto bad;
+	}
+
+	for(i=0;i<(*cache)->nslots;i++) {
+
+		(*cache)->slots[i].chunk = NO_CHUNK;
+		(*cache)->slots[i].data  = (*cache)->memory + i * chunk_size;
+
+		_push_head(*cache, i);
+	}
+
+	return 0;
+
+bad:
+	chunk_cache_destroy(*cache);
+	*cache = NULL;
+	return -1;
+}
+
+void chunk_cache_destroy(chunk_cache_t * cache) {
+
+	if(cache) {
+
+		free(cache->memory);
+		free(cache->slots);
+		free(cache->slot_of);
+		pthread_cond_destroy(&cache->cond);
+		pthread_mutex_destroy(&cache->lock);
+		free(cache);
+	}
+}
+
+mem_chunk_pager_t * chunk_cache_pager(chunk_cache_t * cache) {
+
+	return cache ? &cache->pager : NULL;
+}
+
+uint8_t * chunk_cache_memory(chunk_cache_t * cache, size_t * len) {
+
+	*len = cache ? cache->memory_size : 0;
+
+	return cache ? cache->memory : NULL;
+}
@@ -0,0 +1,35 @@
+
+#pragma once
+
+/*
+ * A fixed size, least-recently-used cache of file chunks.
+ *	Serves as a mem_chunk pager, so a mem_chunk_ctx can address a whole file
+ *	while only 'budget' bytes of it are resident.
+ *	Chunks are faulted in through ef_file_pread ( or a fill function ) on first access,
+ *	without the cache lock held - threads faulting other chunks aren't held up, and a
+ *	fill function may be called from several threads at once.
+ *	Thread-safe, but a returned chunk is only valid until enough other chunks
+ *	have been faulted in to evict it. Reads through the pagers 'read' copy under
+ *	the cache lock, so are safe however many threads share the cache.
+ */
+
+#include "embedded_file.h"
+#include "memchunk.h"
+
+struct chunk_cache;
+typedef struct chunk_cache chunk_cache_t;
+
+// Fill 'dst' ( chunk_size bytes ) with a chunk. 0 on success.
+typedef int (*chunk_cache_fill_fn)(void * user, size_t chunk, uint8_t * dst);
+
+int  chunk_cache_create (chunk_cache_t ** cache, ef_file_t file, size_t file_size, size_t chunk_size, size_t budget);
+
+// A cache of chunks made by 'fill' ( eg, decoded ), rather than read from a file.
+int  chunk_cache_create_fill(chunk_cache_t ** cache, chunk_cache_fill_fn fill, void * user, size_t size, size_t chunk_size, size_t budget);
+void chunk_cache_destroy(chunk_cache_t * cache);
+
+mem_chunk_pager_t * chunk_cache_pager(chunk_cache_t * cache);
+
+// The buffer holding every slot ( page aligned, whole pages ), eg to lock it into memory.
+uint8_t * chunk_cache_memory(chunk_cache_t * cache, size_t * len);
+
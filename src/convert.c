@@ -0,0 +1,330 @@
+/***
+ * AUTHOR:  Christopher Stones
+ * EMAIL:   chris.stones _AT_ zoho.com / chris.stones _AT_ gmail.com
+ * LICENSE: GPL-v3
+ *
+ * Sample format conversion to native signed 16 bit, or float.
+ *	Everything is widened / swapped to s16 first, float is converted from that.
+ *	Kernels are picked once, at first use ( AVX2 / SSE2 / NEON / C ).
+ */
+
+#include "libesprom.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define CONVERT_X86
+	#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	#define CONVERT_NEON
+	#include <arm_neon.h>
+#endif
+
+// float conversions go through s16 this many samples at a time.
+#define CONVERT_STEP 1024
+
+typedef void (*convert_fn)(int16_t * dst, const uint8_t * src, size_t count);
+typedef void (*to_float_fn)(float * dst, const int16_t * src, size_t count);
+
+static struct {
+	convert_fn swap16; // s16, other byte order.
+	convert_fn s8;
+	convert_fn u8;
+	to_float_fn to_float;
+} _kernels;
+
+static pthread_once_t _kernels_once = PTHREAD_ONCE_INIT;
+
+/*** C ***/
+
+static void _swap16_c(int16_t * dst, const uint8_t * src, size_t count) {
+
+	size_t i;
+	for(i=0;i<count;i++) {
+		uint16_t v;
+		memcpy(&v, src + 2*i, sizeof v);
+		dst[i] = (int16_t)((v << 8) | (v >> 8));
+	}
+}
+
+static void _s8_c(int16_t * dst, const uint8_t * src, size_t count) {
+
+	size_t i;
+	for(i=0;i<count;i++)
+		dst[i] = (int16_t)(((int8_t)src[i]) * 256);
+}
+
+static void _u8_c(int16_t * dst, const uint8_t * src, size_t count) {
+
+	size_t i;
+	for(i=0;i<count;i++)
+		dst[i] = (int16_t)((src[i] - 128) * 256);
+}
+
+static void _to_float_c(float * dst, const int16_t * src, size_t count) {
+
+	size_t i;
+	for(i=0;i<count;i++)
+		dst[i] = src[i] * (1.0f / 32768.0f);
+}
+
+/*** SSE2 / AVX2 ***/
+
+#ifdef CONVERT_X86
+
+__attribute__((target("sse2")))
+static void _swap16_sse2(int16_t * dst, const uint8_t * src, size_t count) {
+
+	size_t i = 0;
+	for(;(i+8)<=count;i+=8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + 2*i));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+	}
+	_swap16_c(dst + i, src + 2*i, count - i);
+}
+
+__attribute__((target("sse2")))
+static void _s8_sse2(int16_t * dst, const uint8_t * src, size_t count) {
+
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for(;(i+16)<=count;i+=16) {
+		// the byte lands in the high half, which is * 256.
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_storeu_si128((__m128i *)(dst + i + 0), _mm_unpacklo_epi8(zero, v));
+		_mm_storeu_si128((__m128i *)(dst + i + 8), _mm_unpackhi_epi8(zero, v));
+	}
+	_s8_c(dst + i, src + i, count - i);
+}
+
+__attribute__((target("sse2")))
+static void _u8_sse2(int16_t * dst, const uint8_t * src, size_t count) {
+
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i bias = _mm_set1_epi8((char)0x80);
+	size_t i = 0;
+	for(;(i+16)<=count;i+=16) {
+		__m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(src + i)), bias);
+		_mm_storeu_si128((__m128i *)(dst + i + 0), _mm_unpacklo_epi8(zero, v));
+		_mm_storeu_si128((__m128i *)(dst + i + 8), _mm_unpackhi_epi8(zero, v));
+	}
+	_u8_c(dst + i, src + i, count - i);
+}
+
+__attribute__((target("sse2")))
+static void _to_float_sse2(float * dst, const int16_t * src, size_t count) {
+
+	const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+	size_t i = 0;
+	for(;(i+8)<=count;i+=8) {
+		__m128i v  = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+		_mm_storeu_ps(dst + i + 0, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+		_mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+	}
+	_to_float_c(dst + i, src + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void _swap16_avx2(int16_t * dst, const uint8_t * src, size_t count) {
+
+	size_t i = 0;
+	for(;(i+16)<=count;i+=16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + 2*i));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8)));
+	}
+	_swap16_sse2(dst + i, src + 2*i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void _s8_avx2(int16_t * dst, const uint8_t * src, size_t count) {
+
+	size_t i = 0;
+	for(;(i+16)<=count;i+=16) {
+		__m256i v = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(src + i)));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_slli_epi16(v, 8));
+	}
+	_s8_c(dst + i, src + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void _u8_avx2(int16_t * dst, const uint8_t * src, size_t count) {
+
+	const __m128i bias = _mm_set1_epi8((char)0x80);
+	size_t i = 0;
+	for(;(i+16)<=count;i+=16) {
+		__m256i v = _mm256_cvtepi8_epi16(_mm_xor_si128(_mm_loadu_si128((const __m128i *)(src + i)), bias));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_slli_epi16(v, 8));
+	}
+	_u8_c(dst + i, src + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void _to_float_avx2(float * dst, const int16_t * src, size_t count) {
+
+	const __m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
+	size_t i = 0;
+	for(;(i+8)<=count;i+=8) {
+		__m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(src + i)));
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+	}
+	_to_float_c(dst + i, src + i, count - i);
+}
+
+#endif // CONVERT_X86
+
+/*** NEON ***/
+
+#ifdef CONVERT_NEON
+
+static void _swap16_neon(int16_t * dst, const uint8_t * src, size_t count) {
+
+	size_t i = 0;
+	for(;(i+8)<=count;i+=8)
+		vst1q_s16(dst + i, vreinterpretq_s16_u8(vrev16q_u8(vld1q_u8(src + 2*i))));
+	_swap16_c(dst + i, src + 2*i, count - i);
+}
+
+static void _s8_neon(int16_t * dst, const uint8_t * src, size_t count) {
+
+	size_t i = 0;
+	for(;(i+8)<=count;i+=8)
+		vst1q_s16(dst + i, vshlq_n_s16(vmovl_s8(vld1_s8((const int8_t *)(src + i))), 8));
+	_s8_c(dst + i, src + i, count - i);
+}
+
+static void _u8_neon(int16_t * dst, const uint8_t * src, size_t count) {
+
+	size_t i = 0;
+	for(;(i+8)<=count;i+=8)
+		vst1q_s16(dst + i, vshlq_n_s16(vmovl_s8(vreinterpret_s8_u8(veor_u8(vld1_u8(src + i), vdup_n_u8(0x80)))), 8));
+	_u8_c(dst + i, src + i, count - i);
+}
+
+static void _to_float_neon(float * dst, const int16_t * src, size_t count) {
+
+	size_t i = 0;
+	for(;(i+8)<=count;i+=8) {
+		int16x8_t v = vld1q_s16(src + i);
+		vst1q_f32(dst + i + 0, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16 (v))), 1.0f / 32768.0f));
+		vst1q_f32(dst + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), 1.0f / 32768.0f));
+	}
+	_to_float_c(dst + i, src + i, count - i);
+}
+
+#endif // CONVERT_NEON
+
+static void _pick_kernels(void) {
+
+	_kernels.swap16   = &_swap16_c;
+	_kernels.s8       = &_s8_c;
+	_kernels.u8       = &_u8_c;
+	_kernels.to_float = &_to_float_c;
+
+#if defined(CONVERT_X86)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		_kernels.swap16   = &_swap16_avx2;
+		_kernels.s8       = &_s8_avx2;
+		_kernels.u8       = &_u8_avx2;
+		_kernels.to_float = &_to_float_avx2;
+	}
+	else if(__builtin_cpu_supports("sse2")) {
+		_kernels.swap16   = &_swap16_sse2;
+		_kernels.s8       = &_s8_sse2;
+		_kernels.u8       = &_u8_sse2;
+		_kernels.to_float = &_to_float_sse2;
+	}
+#elif defined(CONVERT_NEON)
+	_kernels.swap16   = &_swap16_neon;
+	_kernels.s8       = &_s8_neon;
+	_kernels.u8       = &_u8_neon;
+	_kernels.to_float = &_to_float_neon;
+#endif
+}
+
+// EXPORTED SYMBOL
+size_t esprom_format_bytes( esprom_format_t format ) {
+
+	switch(format) {
+	case ESPROM_FORMAT_S8:
+	case ESPROM_FORMAT_U8:
+		return 1;
+	case ESPROM_FORMAT_S16LE:
+	case ESPROM_FORMAT_S16BE:
+		return 2;
+	case ESPROM_FORMAT_F32:
+		return 4;
+	default:
+		return 0;
+	}
+}
+
+// Any format to native s16.
+static int _to_s16(int16_t * dst, const uint8_t * src, esprom_format_t format, size_t count) {
+
+	if(format == ESPROM_FORMAT_S16) {
+		memmove(dst, src, count * 2);
+		return 0;
+	}
+
+	switch(format) {
+	case ESPROM_FORMAT_S8:
+		_kernels.s8(dst, src, count);
+		return 0;
+	case ESPROM_FORMAT_U8:
+		_kernels.u8(dst, src, count);
+		return 0;
+	case ESPROM_FORMAT_S16LE:
+	case ESPROM_FORMAT_S16BE:
+		_kernels.swap16(dst, src, count); // the other byte order.
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+// EXPORTED SYMBOL
+int esprom_convert( void * dst, esprom_format_t dst_format, const void * src, esprom_format_t src_format, size_t count ) {
+
+	if((!dst || !src) && count)
+		return -1;
+
+	pthread_once(&_kernels_once, &_pick_kernels);
+
+	if(dst_format == ESPROM_FORMAT_S16)
+		return _to_s16((int16_t *)dst, (const uint8_t *)src, src_format, count);
+
+	if(dst_format == ESPROM_FORMAT_F32) {
+
+		int16_t tmp[CONVERT_STEP];
+		size_t bytes = esprom_format_bytes(src_format);
+
+		if(src_format == ESPROM_FORMAT_F32) {
+			memmove(dst, src, count * sizeof(float));
+			return 0;
+		}
+
+		while(count) {
+			size_t n = count < CONVERT_STEP ? count : CONVERT_STEP;
+
+			if(_to_s16(tmp, (const uint8_t *)src, src_format, n) != 0)
+				return -1;
+
+			_kernels.to_float((float *)dst, tmp, n);
+
+			dst    = ((float *)dst) + n;
+			src    = ((const uint8_t *)src) + n * bytes;
+			count -= n;
+		}
+		return 0;
+	}
+
+	return -1; // only native formats are produced.
+}
@@ -4,31 +4,45 @@
  * LICENCE: GPL-v3.
  *
  * Library for random file access on embedded Linux systems ( requires O_DIRECT ).
- * Each buffer 'ef_buffer_t' is 4k in size.
- * Buffers can be shared between multiple files 'ef_file' as-long as files are not
- * 	accesses concurrently ( do your own locking! ).
+ * Each buffer 'ef_buffer_t' is a cache of one or more 4k blocks.
+ * Buffers can be shared between multiple files 'ef_file', and between threads
+ *	( blocks are locked, and the reference count is atomic, so files on one buffer
+ *	may be opened, used and closed from different threads ).
+ *	A single 'ef_file' has one cursor, so must not be accessed concurrently,
+ *	except through ef_file_pread.
  **************************************************************************************/
 
-// TODO:
-//
-//		 3) implement buffered_write.
-
 #define _GNU_SOURCE
 
 #include "embedded_file.h"
+#include "embedded_file_aio.h"
 
 #include <stdlib.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <time.h>
 #include <unistd.h>
 
 
-#define EF_ALIGNMENT 512
 #define EF_BLOCKSIZE 4096 //MUST BE A MULTIPLE OF EF_ALIGNMENT
+#define EF_PREAD_MAX (EF_BLOCKSIZE * 16) //MUST BE A MULTIPLE OF EF_ALIGNMENT
+#define EF_CACHE_WAYS 4 // blocks per set in a cache.
+#define EF_DIRECT_MIN (EF_BLOCKSIZE * 16) // smaller reads are left to the cache ( and its read-ahead ).
+#define EF_WRITEV_MAX 64 // blocks per vectored write-back.
+#define EF_COPY_BLOCKSIZE (1024*1024) // default ef_copy pipeline block.
+#define EF_COPY_DEPTH_MAX 3
+
+// get_block options.
+#define EF_GET_WRITE  0x01 // caller will modify the block.
+#define EF_GET_NOFILL 0x02 // caller will overwrite the whole block, don't read it.
 
 //#define DEBUG_PRINTF(...) do { printf(__VA_ARGS__); } while(0)
 //#include <stdio.h>
@@ -37,20 +51,49 @@
 
 typedef enum {
 
-	EF_BUFFER_FLAG_DIRTY = 0x01,
+	EF_BUFFER_FLAG_DIRTY   = 0x01,
+	EF_BUFFER_FLAG_PENDING = 0x02, // read-ahead in flight.
+	EF_BUFFER_FLAG_WRITING = 0x04, // write-back in flight.
 
 } ef_buffer_flags_t;
 
-struct ef_buffer {
+struct ef_block {
 
+	struct ef_buffer * cache;
 	void * buffer;
+	ef_file_t owner; // file whose data this block holds, or NULL if unused.
 	size_t file_uid;
 
-	off_t   file_offset;
+	off_t   file_offset; // multiple of EF_BLOCKSIZE.
 	ssize_t data_length;
 
 	int flags;
 
+	unsigned long last_used; // for LRU replacement within a set.
+};
+
+struct ef_buffer {
+
+	struct ef_block * blocks;
+	size_t sets;
+	size_t ways;
+
+	unsigned long clock;
+
+	pthread_mutex_t lock;
+	pthread_cond_t  cond; // signalled when a read-ahead or write-back completes.
+
+	ef_aio_t * aio; // read-ahead backend, or NULL.
+	size_t readahead;
+
+	// background write-back.
+	pthread_t flusher;
+	pthread_cond_t flusher_cond;
+	int flusher_running;
+	int flusher_stop;
+	size_t dirty;
+	size_t dirty_limit;
+
 	size_t refcount;
 };
 
@@ -62,43 +105,549 @@ struct ef_file {
 	size_t file_size;
 	int flags;
 
+	off_t last_block; // for sequential access detection.
+
+	int error; // a write-back failed ( its blocks are still dirty ), reported by the next flush.
+
 	ef_buffer_t buffer;
 };
 
 
+int ef_buffer_create_cache(ef_buffer_t * buffer, size_t blocks) {
+
+	size_t i;
+
+	if(!buffer)
+		return -1;
+
+	if(blocks < 1)
+		blocks = 1;
+
+	if((*buffer = calloc(1, sizeof(struct ef_buffer))) == NULL)
+		return -1;
+
+	(*buffer)->ways = blocks < EF_CACHE_WAYS ? blocks : EF_CACHE_WAYS;
+	(*buffer)->sets = (blocks + (*buffer)->ways - 1) / (*buffer)->ways;
+
+	if(pthread_mutex_init(&(*buffer)->lock, NULL) != 0)
+		goto bad;
+	if(pthread_cond_init(&(*buffer)->cond, NULL) != 0)
+		goto bad_lock;
+	if(pthread_cond_init(&(*buffer)->flusher_cond, NULL) != 0)
+		goto bad_cond;
+
+	if(((*buffer)->blocks = calloc((*buffer)->sets * (*buffer)->ways, sizeof(struct ef_block))) == NULL)
+		goto bad_flusher_cond;
+
+	for(i=0;i< ((*buffer)->sets * (*buffer)->ways); i++) {
+		(*buffer)->blocks[i].cache = *buffer;
+		if( posix_memalign(&((*buffer)->blocks[i].buffer),EF_ALIGNMENT,EF_BLOCKSIZE) != 0)
+			goto bad_blocks;
+	}
+
+	(*buffer)->refcount = 1;
+	return 0;
+
+bad_blocks:
+	for(i=0;i< ((*buffer)->sets * (*buffer)->ways); i++)
+		free((*buffer)->blocks[i].buffer);
+	free((*buffer)->blocks);
+bad_flusher_cond:
+	pthread_cond_destroy(&(*buffer)->flusher_cond);
+bad_cond:
+	pthread_cond_destroy(&(*buffer)->cond);
+bad_lock:
+	pthread_mutex_destroy(&(*buffer)->lock);
+bad:
+	free(*buffer);
+	*buffer = NULL;
+	return -1;
+}
+
 int ef_buffer_create (ef_buffer_t * buffer) {
 
-	if(buffer) {
-		*buffer = calloc(1, sizeof(struct ef_buffer));
-		if(*buffer) {
+	return ef_buffer_create_cache(buffer, 1);
+}
 
-			if( posix_memalign(&((*buffer)->buffer),EF_ALIGNMENT,EF_BLOCKSIZE) == 0) {
+int ef_buffer_destroy(ef_buffer_t   buffer) {
 
-				(*buffer)->refcount = 1;
-				return 0;
+	if(buffer && (__sync_sub_and_fetch(&buffer->refcount, 1) == 0)) {
+
+		size_t i;
+		ef_buffer_set_writeback(buffer, 0); // every file is closed, so nothing is dirty.
+		ef_aio_destroy(buffer->aio); // wait for read-ahead to land.
+		for(i=0;i< (buffer->sets * buffer->ways); i++)
+			free(buffer->blocks[i].buffer);
+		free(buffer->blocks);
+		pthread_cond_destroy(&buffer->flusher_cond);
+		pthread_cond_destroy(&buffer->cond);
+		pthread_mutex_destroy(&buffer->lock);
+		free(buffer);
+	}
+
+	return 0;
+}
+
+int ef_buffer_set_readahead(ef_buffer_t buffer, size_t blocks) {
+
+	if(!buffer)
+		return -1;
+
+	// leave at least half the cache for blocks being read.
+	if(blocks > ((buffer->sets * buffer->ways) / 2))
+		blocks = (buffer->sets * buffer->ways) / 2;
+
+	pthread_mutex_lock(&buffer->lock);
+	if(blocks && !buffer->aio && (ef_aio_create(&buffer->aio, 2 * blocks) != 0))
+		blocks = 0;
+	buffer->readahead = blocks;
+	pthread_mutex_unlock(&buffer->lock);
+
+	return blocks ? 0 : -1;
+}
+
+static size_t file_guid = 0;
+
+static void _mark_dirty(struct ef_block * block) {
+
+	ef_buffer_t cache = block->cache;
+
+	if( !(block->flags & EF_BUFFER_FLAG_DIRTY) ) {
+
+		block->flags |= EF_BUFFER_FLAG_DIRTY;
+
+		if( (++cache->dirty > cache->dirty_limit) && cache->flusher_running )
+			pthread_cond_signal(&cache->flusher_cond);
+	}
+}
+
+static void _mark_clean(struct ef_block * block) {
+
+	if( block->flags & EF_BUFFER_FLAG_DIRTY ) {
+		block->flags &= (~EF_BUFFER_FLAG_DIRTY);
+		block->cache->dirty--;
+	}
+}
+
+/*
+ * Write back one block, if dirty. It is claimed ( EF_BUFFER_FLAG_WRITING ) for the write,
+ *	so it can't be changed or recycled, and a failure is recorded on its file.
+ *	Call with the cache locked, and the block not already in flight - the lock is dropped while writing.
+ */
+static int _flush_block(struct ef_block * block) {
+
+	ef_buffer_t cache = block->cache;
+	ef_file_t owner = block->owner;
+	ssize_t wbytes;
+
+	if( !(block->flags & EF_BUFFER_FLAG_DIRTY) )
+		return 0;
+
+	block->flags |= EF_BUFFER_FLAG_WRITING;
+
+	pthread_mutex_unlock(&cache->lock);
+
+	while(((wbytes = pwrite( owner->fd, block->buffer, EF_BLOCKSIZE, block->file_offset )) < 0) && (errno == EINTR))
+		;
+
+	pthread_mutex_lock(&cache->lock);
+
+	block->flags &= (~EF_BUFFER_FLAG_WRITING);
+
+	if( wbytes == EF_BLOCKSIZE )
+		_mark_clean( block );
+	else
+		owner->error = -1;
+
+	pthread_cond_broadcast(&cache->cond);
+
+	return wbytes == EF_BLOCKSIZE ? 0 : -1;
+}
+
+static int _block_cmp(const void * a, const void * b) {
+
+	const struct ef_block * ba = *(const struct ef_block * const *)a;
+	const struct ef_block * bb = *(const struct ef_block * const *)b;
+
+	if( ba->file_uid != bb->file_uid )
+		return ba->file_uid < bb->file_uid ? -1 : 1;
+	if( ba->file_offset != bb->file_offset )
+		return ba->file_offset < bb->file_offset ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Write back the dirty blocks of one file ( or of every file if NULL ).
+ *	Blocks that are contiguous in a file go out in a single vectored write.
+ *	Blocks that fail stay dirty, to be retried, and the failure is recorded on the file.
+ *	Call with the cache locked - it is dropped while writing.
+ *	Returns the number of blocks written back.
+ */
+static size_t _writeback(ef_buffer_t cache, ef_file_t file) {
+
+	size_t nblocks = cache->sets * cache->ways;
+	struct ef_block ** list;
+	size_t done = 0;
+	size_t n = 0;
+	size_t i;
+
+	if((list = malloc(nblocks * sizeof(struct ef_block *))) == NULL) {
+
+		// no memory to sort - write them back one at a time.
+		for(i=0;i<nblocks;i++) {
+			struct ef_block * block = cache->blocks + i;
+			if( block->owner && (!file || (block->file_uid == file->uid)) &&
+				!(block->flags & EF_BUFFER_FLAG_WRITING) && (block->flags & EF_BUFFER_FLAG_DIRTY) ) {
+				if( _flush_block( block ) == 0 )
+					n++;
 			}
-			free(*buffer);
 		}
-		*buffer = NULL;
+		return n;
 	}
-	return -1;
+
+	for(i=0;i<nblocks;i++) {
+		struct ef_block * block = cache->blocks + i;
+		if( block->owner && (!file || (block->file_uid == file->uid)) &&
+			!(block->flags & EF_BUFFER_FLAG_WRITING) && (block->flags & EF_BUFFER_FLAG_DIRTY) )
+			list[n++] = block;
+	}
+
+	qsort(list, n, sizeof(struct ef_block *), &_block_cmp);
+
+	// claim everything first - writers wait for these, and they can't be recycled.
+	for(i=0;i<n;i++)
+		list[i]->flags |= EF_BUFFER_FLAG_WRITING;
+
+	for(i=0;i<n;) {
+
+		struct iovec iov[EF_WRITEV_MAX];
+		size_t written;
+		ef_file_t owner = list[i]->owner;
+		off_t offset = list[i]->file_offset;
+		size_t j = i;
+		int iovcnt = 0;
+		ssize_t wbytes;
+
+		// merge blocks that follow on in the same file.
+		do {
+			iov[iovcnt].iov_base = list[j]->buffer;
+			iov[iovcnt].iov_len  = EF_BLOCKSIZE;
+			iovcnt++;
+			j++;
+		} while( (j < n) && (iovcnt < EF_WRITEV_MAX) && (list[j]->file_uid == list[i]->file_uid) &&
+				(list[j]->file_offset == (list[j-1]->file_offset + EF_BLOCKSIZE)) );
+
+		pthread_mutex_unlock(&cache->lock);
+
+		while(((wbytes = pwritev( owner->fd, iov, iovcnt, offset )) < 0) && (errno == EINTR))
+			;
+
+		pthread_mutex_lock(&cache->lock);
+
+		if( wbytes != (iovcnt * EF_BLOCKSIZE) )
+			owner->error = -1; // tell the owner when it next flushes.
+
+		// only blocks that reached the file are clean - the rest are retried by a later write-back.
+		written = wbytes > 0 ? (size_t)wbytes / EF_BLOCKSIZE : 0;
+
+		for(;i<j;i++) {
+			list[i]->flags &= (~EF_BUFFER_FLAG_WRITING);
+			if( written ) {
+				_mark_clean( list[i] );
+				written--;
+				done++;
+			}
+		}
+
+		pthread_cond_broadcast(&cache->cond);
+	}
+
+	free(list);
+
+	return done;
 }
 
-int ef_buffer_destroy(ef_buffer_t   buffer) {
+static void * _flusher_thread(void * arg) {
+
+	ef_buffer_t cache = (ef_buffer_t)arg;
+
+	pthread_mutex_lock(&cache->lock);
+
+	while( !cache->flusher_stop ) {
+
+		if( (cache->dirty <= cache->dirty_limit) || (_writeback( cache, NULL ) == 0) )
+			pthread_cond_wait(&cache->flusher_cond, &cache->lock);
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+
+	return NULL;
+}
+
+int ef_buffer_set_writeback(ef_buffer_t buffer, size_t dirty_blocks) {
+
+	int err = 0;
+
+	if(!buffer)
+		return -1;
+
+	pthread_mutex_lock(&buffer->lock);
+
+	buffer->dirty_limit = dirty_blocks;
+
+	if( dirty_blocks && !buffer->flusher_running ) {
+
+		buffer->flusher_stop = 0;
+		if( pthread_create(&buffer->flusher, NULL, &_flusher_thread, buffer) == 0 )
+			buffer->flusher_running = 1;
+		else
+			err = -1;
+	}
+	else if( !dirty_blocks && buffer->flusher_running ) {
+
+		buffer->flusher_stop = 1;
+		pthread_cond_signal(&buffer->flusher_cond);
+		pthread_mutex_unlock(&buffer->lock);
+
+		pthread_join(buffer->flusher, NULL);
+
+		pthread_mutex_lock(&buffer->lock);
+		buffer->flusher_running = 0;
+	}
+
+	pthread_mutex_unlock(&buffer->lock);
+
+	return err;
+}
+
+/*
+ * Look up the block holding 'block_offset' of 'file' in its set.
+ *	On a miss, 'victim' is the block to recycle for it - unused, otherwise least recently used.
+ *	Blocks with a read or write in flight are never offered as the victim.
+ *	Call with the cache locked.
+ */
+static struct ef_block * _find_block(ef_buffer_t cache, ef_file_t file, off_t block_offset, struct ef_block ** victim) {
+
+	size_t set = ((file->uid * 2654435761u) + (block_offset / EF_BLOCKSIZE)) % cache->sets;
+	struct ef_block * ways = cache->blocks + (set * cache->ways);
+	size_t i;
+
+	*victim = NULL;
+
+	for(i=0;i<cache->ways;i++) {
+
+		struct ef_block * block = ways + i;
+
+		if( block->owner && (block->file_uid == file->uid) && (block->file_offset == block_offset) )
+			return block; // hit.
+
+		if( block->flags & (EF_BUFFER_FLAG_PENDING | EF_BUFFER_FLAG_WRITING) )
+			continue;
+
+		if( !*victim || ((*victim)->owner && (!block->owner || (block->last_used < (*victim)->last_used))) )
+			*victim = block;
+	}
+
+	return NULL;
+}
 
-	if(buffer && (buffer->refcount > 0)) {
+/*
+ * Find the block holding 'block_offset' of 'file', reading it in if needed ( see EF_GET_* ).
+ *	Call with the cache locked - it is dropped while writing back a victim or reading the block,
+ *	which is held pending meanwhile so other threads wait for it rather than read it again.
+ */
+static struct ef_block * _get_block(ef_buffer_t cache, ef_file_t file, off_t block_offset, int get) {
 
-		buffer->refcount--;
-		if(buffer->refcount == 0) {
-			free(buffer->buffer);
-			free(buffer);
+	struct ef_block * block;
+	struct ef_block * victim;
+
+	for(;;) {
+
+		block = _find_block( cache, file, block_offset, &victim );
+
+		if( block && (block->flags & EF_BUFFER_FLAG_PENDING) ) {
+			pthread_cond_wait(&cache->cond, &cache->lock); // read-ahead has it in flight.
+			continue;
+		}
+
+		if( block && (get & EF_GET_WRITE) && (block->flags & EF_BUFFER_FLAG_WRITING) ) {
+			pthread_cond_wait(&cache->cond, &cache->lock); // being written back, don't change it under the write.
+			continue;
+		}
+
+		if( block ) {
+			block->last_used = ++cache->clock;
+			return block;
+		}
+
+		if( victim && (victim->flags & EF_BUFFER_FLAG_DIRTY) ) {
+			// write it back, then look again - the set may have changed while unlocked.
+			if( _flush_block( victim ) != 0 )
+				return NULL;
+			continue;
 		}
+
+		if( victim )
+			break;
+
+		pthread_cond_wait(&cache->cond, &cache->lock); // every way in the set is being read.
 	}
 
+	victim->owner       = file;
+	victim->file_uid    = file->uid;
+	victim->file_offset = block_offset;
+	victim->data_length = 0;
+	victim->flags       = 0;
+	victim->last_used   = ++cache->clock;
+
+	if( !(get & EF_GET_NOFILL) ) {
+
+		ssize_t rbytes;
+
+		victim->flags = EF_BUFFER_FLAG_PENDING;
+
+		pthread_mutex_unlock(&cache->lock);
+
+		while(((rbytes = pread( file->fd, victim->buffer, EF_BLOCKSIZE, block_offset )) < 0) && (errno == EINTR))
+			;
+
+		pthread_mutex_lock(&cache->lock);
+
+		victim->flags &= (~EF_BUFFER_FLAG_PENDING);
+
+		if( rbytes < 0 )
+			victim->owner = NULL; // forget it - the next demand read retries.
+		else
+			victim->data_length = rbytes;
+
+		pthread_cond_broadcast(&cache->cond);
+
+		if( rbytes < 0 )
+			return NULL;
+	}
+
+	return victim;
+}
+
+static void _readahead_done(void * user, ssize_t result) {
+
+	struct ef_block * block = (struct ef_block *)user;
+	ef_buffer_t cache = block->cache;
+
+	pthread_mutex_lock(&cache->lock);
+
+	if( result < 0 )
+		block->owner = NULL; // failed, forget it - a demand read will retry.
+	else
+		block->data_length = result;
+
+	block->flags &= (~EF_BUFFER_FLAG_PENDING);
+
+	pthread_cond_broadcast(&cache->cond);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * If 'file' is being read sequentially, queue reads of the blocks after 'block_offset'.
+ *	Best effort - stops at the first block that can't be queued.
+ *	Call with the cache locked.
+ */
+static void _readahead(ef_buffer_t cache, ef_file_t file, off_t block_offset) {
+
+	int sequential = (block_offset == (file->last_block + EF_BLOCKSIZE));
+	size_t i;
+
+	file->last_block = block_offset;
+
+	if( !cache->aio || !sequential )
+		return;
+
+	for(i=1;i<=cache->readahead;i++) {
+
+		off_t offset = block_offset + (i * EF_BLOCKSIZE);
+		struct ef_block * victim;
+
+		if( offset >= file->file_size )
+			break;
+
+		if( _find_block( cache, file, offset, &victim ) )
+			continue; // already cached, or on its way.
+
+		// don't hold up the reader writing back a dirty victim - leave that to the next demand read.
+		if( !victim || (victim->flags & EF_BUFFER_FLAG_DIRTY) )
+			break;
+
+		victim->owner       = file;
+		victim->file_uid    = file->uid;
+		victim->file_offset = offset;
+		victim->data_length = 0;
+		victim->flags       = EF_BUFFER_FLAG_PENDING;
+		victim->last_used   = ++cache->clock;
+
+		if( ef_aio_read( cache->aio, file->fd, victim->buffer, EF_BLOCKSIZE, offset, &_readahead_done, victim ) != 0 ) {
+			victim->owner = NULL;
+			victim->flags = 0;
+			break;
+		}
+	}
+}
+
+// Does a file have a read-ahead or write-back in flight? Call with the cache locked.
+static int _file_busy(ef_buffer_t cache, ef_file_t file) {
+
+	size_t i;
+
+	for(i=0;i< (cache->sets * cache->ways); i++) {
+
+		struct ef_block * block = cache->blocks + i;
+
+		if( block->owner && (block->file_uid == file->uid) &&
+			(block->flags & (EF_BUFFER_FLAG_PENDING | EF_BUFFER_FLAG_WRITING)) )
+			return 1;
+	}
 	return 0;
 }
 
-static size_t file_guid = 0;
+/*
+ * Write back ( and optionally forget ) every cached block of a file.
+ */
+static int _ef_file_flush(ef_file_t file, ef_buffer_t cache, int invalidate) {
+
+	size_t i;
+	int err;
+
+	pthread_mutex_lock(&cache->lock);
+
+	// earlier failures left their blocks dirty - whether this retry gets them out is what counts.
+	file->error = 0;
+
+	_writeback( cache, file );
+
+	// wait out anything still in flight for this file.
+	while( _file_busy( cache, file ) )
+		pthread_cond_wait(&cache->cond, &cache->lock);
+
+	err = file->error;
+	file->error = 0;
+
+	if( invalidate ) {
+		for(i=0;i< (cache->sets * cache->ways); i++) {
+
+			struct ef_block * block = cache->blocks + i;
+
+			if( block->owner && (block->file_uid == file->uid) ) {
+				if( _flush_block( block ) != 0 )
+					err = -1;
+				_mark_clean( block );
+				block->owner = NULL;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+
+	return err;
+}
 
 int ef_file_open (ef_file_t *file, ef_buffer_t shared_buffer, const char * path, int flags, mode_t mode) {
 
@@ -122,8 +671,6 @@ int ef_file_open (ef_file_t *file, ef_buffer_t shared_buffer, const char * path,
 		if(*file) {
 
 			struct stat _stat;
-			if(stat(path, &_stat) == 0)
-				(*file)->file_size = _stat.st_size;
 
 			// set O_DIRECT if user forgot to... otherwise this is all pointless!
 			flags |= O_DIRECT;
@@ -132,10 +679,15 @@ int ef_file_open (ef_file_t *file, ef_buffer_t shared_buffer, const char * path,
 
 			if(((*file)->fd = open( path, flags, mode )) != -1) {
 
+				// after open, so O_TRUNC / O_CREAT are accounted for.
+				if(fstat((*file)->fd, &_stat) == 0)
+					(*file)->file_size = _stat.st_size;
+
 				(*file)->uid = __sync_fetch_and_add( &file_guid, 1 );
+				(*file)->last_block = -EF_BLOCKSIZE;
 
 				if(buff == shared_buffer)
-					buff->refcount++; // sharing buffer, bump reference.
+					__sync_fetch_and_add( &buff->refcount, 1 ); // sharing buffer, bump reference.
 
 				(*file)->buffer = buff;
 
@@ -144,6 +696,8 @@ int ef_file_open (ef_file_t *file, ef_buffer_t shared_buffer, const char * path,
 
 			free(*file);
 		}
+		if(buff != shared_buffer)
+			ef_buffer_destroy( buff );
 		*file = NULL;
 	}
 	return -1;
@@ -154,12 +708,16 @@ int ef_file_close(ef_file_t  file) {
 	int err = 0;
 	if(file) {
 
+		// write back, and release our blocks - they can't outlive the file.
+		err = _ef_file_flush( file, file->buffer, 1 );
+
 		ef_buffer_destroy( file->buffer );
 
 		if( file->fd != -1) {
 			// writes that extend the file will round its size up to a multiple of EF_BLOCKSIZE.
 			//	Trim the fat here.
-			err = ftruncate(file->fd, file->file_size );
+			if( (file->flags & O_ACCMODE) != O_RDONLY )
+				err |= ftruncate(file->fd, file->file_size );
 			close(file->fd);
 		}
 		free(file);
@@ -192,89 +750,164 @@ off_t ef_file_seek( ef_file_t file, off_t offset, int whence ) {
 	return file->file_offset;
 }
 
-static int _need_to_refill_buffer(ef_file_t file, ef_buffer_t io_buffer) {
+/*
+ * Can ( part of ) a read skip the cache and go straight to the callers memory?
+ *	Returns the number of bytes to read directly, or 0.
+ */
+static size_t _direct_size( const void * dst_buffer, off_t offset, size_t count ) {
 
-	if(io_buffer->data_length <= 0)
-		return 1; // no-data.
+	if( !dst_buffer || (count < EF_DIRECT_MIN) )
+		return 0;
 
-	if(file->uid != io_buffer->file_uid)
-		return 1; // wrong file buffered.
+	if( (((uintptr_t)dst_buffer) % EF_ALIGNMENT) || (offset % EF_ALIGNMENT) )
+		return 0;
 
-	if( file->file_offset >= ( io_buffer->file_offset + io_buffer->data_length ) )
-		return 1; // wrong part of file buffered.
+	return count - (count % EF_ALIGNMENT);
+}
 
-	if( file->file_offset < io_buffer->file_offset )
-		return 1; // wrong part of file buffered.
+/*
+ * Write back any dirty blocks of 'file' that overlap a range, so a read that
+ *	bypasses the cache sees them.
+ */
+static int _flush_range( ef_file_t file, ef_buffer_t cache, off_t offset, size_t count ) {
 
-	return 0;
-}
+	size_t i;
 
-static size_t _refill_io_buffer(ef_file_t file, ef_buffer_t io_buffer) {
+	// a read-only file never has dirty blocks - don't scan the cache under its lock.
+	if( (file->flags & O_ACCMODE) == O_RDONLY )
+		return 0;
 
-	off_t aligned_file_offset;
+	pthread_mutex_lock(&cache->lock);
+	for(i=0;i< (cache->sets * cache->ways); i++) {
 
-	aligned_file_offset = file->file_offset - ( file->file_offset % EF_ALIGNMENT );
+		struct ef_block * block = cache->blocks + i;
 
-	if( lseek( file->fd, aligned_file_offset, SEEK_SET ) != aligned_file_offset )
-		return -1;
+		if( block->owner && (block->file_uid == file->uid) &&
+			(block->file_offset < (offset + (off_t)count)) && ((block->file_offset + EF_BLOCKSIZE) > offset) ) {
+
+			if( block->flags & EF_BUFFER_FLAG_WRITING ) {
+				// background write-back has it, wait for it to reach the disk and look again.
+				pthread_cond_wait(&cache->cond, &cache->lock);
+				i = (size_t)-1;
+				continue;
+			}
 
-	io_buffer->file_uid = file->uid;
-	io_buffer->file_offset = aligned_file_offset;
+			if( block->flags & EF_BUFFER_FLAG_DIRTY ) {
 
-	io_buffer->data_length = read( file->fd, io_buffer->buffer, EF_BLOCKSIZE );
+				if( _flush_block( block ) != 0 ) {
+					pthread_mutex_unlock(&cache->lock);
+					return -1;
+				}
+
+				// the cache was unlocked for the write, look again.
+				i = (size_t)-1;
+				continue;
+			}
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
 
-	return io_buffer->data_length;
+	return 0;
 }
 
-static int _ef_file_flush(ef_file_t file, ef_buffer_t io_buffer) {
+/*
+ * Read straight into the callers ( aligned ) memory.
+ */
+static ssize_t _direct_readv( ef_file_t file, ef_buffer_t cache, const struct iovec * iov, int iovcnt, off_t offset ) {
 
-	if( io_buffer->flags & EF_BUFFER_FLAG_DIRTY) {
+	size_t count = 0;
+	ssize_t rbytes;
+	int i;
 
-		if( file->uid != io_buffer->file_uid )
-			return -1; // buffer is dirty with a different files data!
+	for(i=0;i<iovcnt;i++)
+		count += iov[i].iov_len;
 
-		if( lseek( file->fd, io_buffer->file_offset, SEEK_SET ) != io_buffer->file_offset )
-			return -1;
+	if( _flush_range( file, cache, offset, count ) != 0 )
+		return -1;
 
-		if( write( file->fd, io_buffer->buffer, EF_BLOCKSIZE ) != EF_BLOCKSIZE)
-			return -1;
+	while(((rbytes = preadv( file->fd, iov, iovcnt, offset )) < 0) && (errno == EINTR))
+		;
 
-		io_buffer->flags &= (~EF_BUFFER_FLAG_DIRTY);
-	}
+	return rbytes;
+}
 
-	return 0;
+static ssize_t _direct_read( ef_file_t file, ef_buffer_t cache, void * dst_buffer, size_t count, off_t offset ) {
+
+	struct iovec iov;
+
+	iov.iov_base = dst_buffer;
+	iov.iov_len  = count;
+
+	return _direct_readv( file, cache, &iov, 1, offset );
 }
 
-static size_t _buffered_read( ef_file_t file, ef_buffer_t io_buffer,uint8_t * dst_buffer, size_t count ) {
+static ssize_t _buffered_read( ef_file_t file, ef_buffer_t cache, uint8_t * dst_buffer, size_t count ) {
 
 	size_t total = 0;
-	while(count > 0) {
 
-		if(_need_to_refill_buffer( file, io_buffer )) {
+	// blocks past the end of a file we have written to are padded, don't read the padding.
+	if( file->file_offset >= file->file_size )
+		return 0;
+	if( count > (file->file_size - file->file_offset) )
+		count = file->file_size - file->file_offset;
 
-			ssize_t read;
+	while(count > 0) {
 
-			if( _ef_file_flush( file, io_buffer ) != 0)
-				return -1;
+		off_t block_offset = file->file_offset - ( file->file_offset % EF_BLOCKSIZE );
+		struct ef_block * block;
+		size_t direct;
 
-			read = _refill_io_buffer( file, io_buffer );
+		// large aligned reads bypass the cache - no bounce, no memcpy.
+		if( (direct = _direct_size( dst_buffer, file->file_offset, count )) ) {
 
-			if( read == 0 )
-				return total; // EOF
-			if( read == -1)
+			ssize_t rbytes = _direct_read( file, cache, dst_buffer, direct, file->file_offset );
+
+			if( rbytes < 0 )
 				return -1; // ERROR
+			if( rbytes == 0 )
+				return total; // EOF
+
+			dst_buffer        += rbytes;
+			file->file_offset += rbytes;
+			count             -= rbytes;
+			total             += rbytes;
+
+			// leave the sequential detector on the last block we read.
+			file->last_block = (file->file_offset - 1) - ((file->file_offset - 1) % EF_BLOCKSIZE);
+			continue;
+		}
+
+		pthread_mutex_lock(&cache->lock);
+
+		if((block = _get_block( cache, file, block_offset, 0 )) == NULL) {
+			pthread_mutex_unlock(&cache->lock);
+			return -1; // ERROR
 		}
 
 		{
-			off_t  io_offset = file->file_offset - io_buffer->file_offset;
-			size_t io_size = io_buffer->data_length - io_offset;
-			size_t actual_sz = io_size < count ? io_size : count;
+			off_t  io_offset = file->file_offset - block_offset;
+			size_t io_size;
+			size_t actual_sz;
+
+			if( block->data_length <= io_offset ) {
+				pthread_mutex_unlock(&cache->lock);
+				return total; // EOF
+			}
+
+			io_size = block->data_length - io_offset;
+			actual_sz = io_size < count ? io_size : count;
 
 			if(dst_buffer) {
-				memcpy(dst_buffer, ((char*)io_buffer->buffer) + io_offset, actual_sz );
+				memcpy(dst_buffer, ((char*)block->buffer) + io_offset, actual_sz );
 				dst_buffer        += actual_sz;
 			}
 
+			// only on entering a block, so a block read in pieces doesn't look random.
+			if( block_offset != file->last_block )
+				_readahead( cache, file, block_offset );
+
+			pthread_mutex_unlock(&cache->lock);
+
 			file->file_offset += actual_sz;
 			count             -= actual_sz;
 			total             += actual_sz;
@@ -283,41 +916,48 @@ static size_t _buffered_read( ef_file_t file, ef_buffer_t io_buffer,uint8_t * ds
 	return total;
 }
 
-static ssize_t _buffered_write(ef_file_t file, ef_buffer_t io_buffer, const void * src_buffer, size_t count) {
+static ssize_t _buffered_write(ef_file_t file, ef_buffer_t cache, const uint8_t * src_buffer, size_t count) {
 
 	size_t total = 0;
 	while(count > 0) {
 
-		if(_need_to_refill_buffer( file, io_buffer )) {
+		off_t block_offset = file->file_offset - ( file->file_offset % EF_BLOCKSIZE );
+		int get = EF_GET_WRITE;
+		struct ef_block * block;
 
-			ssize_t read;
-
-			if( _ef_file_flush( file, io_buffer ) != 0)
-				return -1;
+		// don't read in a block we are about to overwrite, or one past the end of the file.
+		if( ((file->file_offset == block_offset) && (count >= EF_BLOCKSIZE)) || (block_offset >= file->file_size) )
+			get |= EF_GET_NOFILL;
 
-			read = _refill_io_buffer( file, io_buffer );
+		pthread_mutex_lock(&cache->lock);
 
-			if( read == -1)
-				return -1; // ERROR
-
-			// zero unread bytes due to EOF.
-			if( read < EF_BLOCKSIZE )
-				memset(((char*)(io_buffer->buffer)) + read, 0, EF_BLOCKSIZE - read );
+		if((block = _get_block( cache, file, block_offset, get )) == NULL) {
+			pthread_mutex_unlock(&cache->lock);
+			return -1; // ERROR
 		}
 
+		// zero unread bytes due to EOF.
+		if( block->data_length < EF_BLOCKSIZE )
+			memset(((char*)(block->buffer)) + block->data_length, 0, EF_BLOCKSIZE - block->data_length );
+
 		{
-			off_t  io_offset = file->file_offset - io_buffer->file_offset;
-			size_t io_size = io_buffer->data_length - io_offset;
+			off_t  io_offset = file->file_offset - block_offset;
+			size_t io_size = EF_BLOCKSIZE - io_offset;
 			size_t actual_sz = io_size < count ? io_size : count;
 
 			if( actual_sz )
-				io_buffer->flags |= EF_BUFFER_FLAG_DIRTY;
+				_mark_dirty( block );
 
 			if(src_buffer) {
-				memcpy(((char*)io_buffer->buffer) + io_offset, src_buffer, actual_sz );
+				memcpy(((char*)block->buffer) + io_offset, src_buffer, actual_sz );
 				src_buffer        += actual_sz;
 			}
 
+			if( block->data_length < (io_offset + actual_sz) )
+				block->data_length = io_offset + actual_sz;
+
+			pthread_mutex_unlock(&cache->lock);
+
 			file->file_offset += actual_sz;
 			count             -= actual_sz;
 			total             += actual_sz;
@@ -338,12 +978,190 @@ ssize_t ef_file_read( ef_file_t file,void * dst_buffer, size_t count) {
 	return _buffered_read( file, file->buffer, (uint8_t*)dst_buffer, count );
 }
 
+ssize_t ef_file_pread( ef_file_t file, void * dst_buffer, size_t count, off_t offset) {
+
+	void * bounce = NULL;
+	size_t total = 0;
+
+	if( !file || (file->fd == -1) || (offset < 0))
+		return -1;
+
+	if( offset >= file->file_size )
+		return 0;
+
+	if( count > (file->file_size - offset) )
+		count = file->file_size - offset;
+
+	while( count > 0 ) {
+
+		uint8_t * dst = ((uint8_t *)dst_buffer) + total;
+
+		// aligned span covering ( part of ) the request.
+		off_t  aligned_offset = offset - ( offset % EF_ALIGNMENT );
+		size_t head = offset - aligned_offset;
+		size_t span = head + count;
+		size_t actual_sz;
+		ssize_t rbytes;
+
+		// large aligned reads go straight to the callers memory.
+		if((actual_sz = _direct_size( dst, offset, count ))) {
+
+			if((rbytes = _direct_read( file, file->buffer, dst, actual_sz, offset )) <= 0)
+				break; // EOF or ERROR
+
+			offset += rbytes;
+			count  -= rbytes;
+			total  += rbytes;
+			continue;
+		}
+
+		// callers memory lines up with the file - only bounce up to the next aligned offset.
+		if( ((((uintptr_t)dst) % EF_ALIGNMENT) == head) && (count >= (EF_DIRECT_MIN + EF_ALIGNMENT)) )
+			span = EF_ALIGNMENT;
+
+		if( span > EF_PREAD_MAX )
+			span = EF_PREAD_MAX;
+
+		span += (EF_ALIGNMENT-1);
+		span -= span % EF_ALIGNMENT;
+
+		if( !bounce && (posix_memalign(&bounce, EF_ALIGNMENT, EF_PREAD_MAX) != 0) )
+			return -1;
+
+		if( _flush_range( file, file->buffer, aligned_offset, span ) != 0 )
+			break;
+
+		if((rbytes = pread( file->fd, bounce, span, aligned_offset )) <= (ssize_t)head)
+			break; // EOF or ERROR
+
+		actual_sz = rbytes - head;
+		if( actual_sz > count )
+			actual_sz = count;
+
+		memcpy( dst, ((uint8_t *)bounce) + head, actual_sz );
+
+		offset += actual_sz;
+		count  -= actual_sz;
+		total  += actual_sz;
+	}
+
+	free(bounce);
+
+	return (count == 0) ? total : -1;
+}
+
+ssize_t ef_file_preadv_direct( ef_file_t file, const struct iovec * iov, int iovcnt, off_t offset ) {
+
+	int i;
+
+	if( !file || (file->fd == -1) || !iov || (iovcnt <= 0) || (offset < 0) )
+		return -1;
+
+	// straight to the callers memory, so everything has to suit O_DIRECT.
+	if( offset % EF_ALIGNMENT )
+		return -1;
+
+	for(i=0;i<iovcnt;i++)
+		if( (((uintptr_t)iov[i].iov_base) % EF_ALIGNMENT) || (iov[i].iov_len % EF_ALIGNMENT) )
+			return -1;
+
+	return _direct_readv( file, file->buffer, iov, iovcnt, offset );
+}
+
+ssize_t ef_file_pread_direct( ef_file_t file, void * dst_buffer, size_t count, off_t offset ) {
+
+	struct iovec iov;
+
+	iov.iov_base = dst_buffer;
+	iov.iov_len  = count;
+
+	return ef_file_preadv_direct( file, &iov, 1, offset );
+}
+
+int ef_file_aio_read( ef_file_t file, ef_aio_t * aio, void * dst_buffer, size_t count, off_t offset, ef_aio_done_fn done, void * user ) {
+
+	if( !file || (file->fd == -1) || !aio || (offset < 0) )
+		return -1;
+
+	// straight to the callers memory, so everything has to suit O_DIRECT.
+	if( (((uintptr_t)dst_buffer) % EF_ALIGNMENT) || (count % EF_ALIGNMENT) || (offset % EF_ALIGNMENT) )
+		return -1;
+
+	// don't read around buffered writes.
+	if( _flush_range( file, file->buffer, offset, count ) != 0 )
+		return -1;
+
+	return ef_aio_read( aio, file->fd, dst_buffer, count, offset, done, user );
+}
+
+ssize_t ef_file_readv( ef_file_t file, const struct iovec * iov, int iovcnt) {
+
+	ssize_t total = 0;
+	int direct = 1;
+	int i;
+
+	if( !file || (file->fd == -1) || (iovcnt < 0))
+		return -1;
+
+	// one vectored read if everything is aligned, and within the file.
+	for(i=0;i<iovcnt;i++) {
+		direct &= !( ((uintptr_t)iov[i].iov_base) % EF_ALIGNMENT );
+		direct &= !( iov[i].iov_len % EF_ALIGNMENT );
+		total  += iov[i].iov_len;
+	}
+	direct &= !( file->file_offset % EF_ALIGNMENT );
+	direct &= ( (file->file_offset + total) <= file->file_size );
+	direct &= ( total >= EF_DIRECT_MIN );
+
+	if( direct && total ) {
+
+		if((total = _direct_readv( file, file->buffer, iov, iovcnt, file->file_offset )) > 0) {
+			file->file_offset += total;
+			file->last_block = (file->file_offset - 1) - ((file->file_offset - 1) % EF_BLOCKSIZE);
+		}
+		return total;
+	}
+
+	for(total=0, i=0;i<iovcnt;i++) {
+
+		ssize_t rbytes = _buffered_read( file, file->buffer, (uint8_t*)iov[i].iov_base, iov[i].iov_len );
+
+		if( rbytes < 0 )
+			return -1;
+
+		total += rbytes;
+
+		if( rbytes < iov[i].iov_len )
+			break; // EOF
+	}
+
+	return total;
+}
+
 int ef_file_flush(ef_file_t file) {
 
 	if(!file || (file->fd == -1))
 		return -1;
 
-	return _ef_file_flush( file, file->buffer );
+	return _ef_file_flush( file, file->buffer, 0 );
+}
+
+int ef_file_sync(ef_file_t file) {
+
+	int err;
+
+	if(!file || (file->fd == -1))
+		return -1;
+
+	err = _ef_file_flush( file, file->buffer, 0 );
+
+	if( (file->flags & O_ACCMODE) != O_RDONLY ) {
+		// trim the block padding now, rather than at close.
+		err |= ftruncate( file->fd, file->file_size );
+		err |= fdatasync( file->fd );
+	}
+
+	return err;
 }
 
 ssize_t ef_file_write(ef_file_t file, const void * src_buffer, size_t count) {
@@ -351,26 +1169,242 @@ ssize_t ef_file_write(ef_file_t file, const void * src_buffer, size_t count) {
 	if( !file || (file->fd == -1))
 		return -1;
 
-	return _buffered_write( file, file->buffer, src_buffer, count);
+	return _buffered_write( file, file->buffer, (const uint8_t*)src_buffer, count);
 }
 
-int ef_copy(const char * from, const char * to, int mode) {
+/*
+ * Let the kernel copy ( copy_file_range may even reflink ) - falls back to sendfile.
+ *	Returns 0 when everything was copied, 1 if the kernel can't copy between these
+ *	files ( *copied bytes were, the rest is up to the caller ), or -1 on error.
+ */
+static int _copy_offload(int src, int dst, off_t size, int * method, off_t * copied) {
+
+	int use_sendfile = 0;
+
+	while( *copied < size ) {
+
+		size_t  want = ((size - *copied) > (off_t)0x40000000) ? 0x40000000 : (size_t)(size - *copied);
+		ssize_t n;
+
+		if( !use_sendfile ) {
+			loff_t in  = *copied;
+			loff_t out = *copied;
+			n = copy_file_range( src, &in, dst, &out, want, 0 );
+		}
+		else {
+			off_t in = *copied;
+			if( lseek( dst, *copied, SEEK_SET ) != *copied )
+				return -1;
+			n = sendfile( dst, src, &in, want );
+		}
+
+		if( n > 0 ) {
+			*method = use_sendfile ? EF_COPY_SENDFILE : EF_COPY_RANGE;
+			*copied += n;
+			continue;
+		}
+
+		if( n == 0 ) {
+			if( *copied )
+				return -1; // source shrank under us.
+			errno = EOPNOTSUPP; // procfs, sysfs and some FUSE filesystems copy nothing, rather than fail.
+		}
+		else if( errno == EINTR )
+			continue;
+
+		if( (errno == ENOSYS) || (errno == EXDEV) || (errno == EINVAL) || (errno == EOPNOTSUPP) ) {
+			if( !use_sendfile ) {
+				use_sendfile = 1;
+				continue;
+			}
+			return 1;
+		}
+
+		return -1;
+	}
+
+	return 0;
+}
+
+// bypass the page cache, if the filesystem allows it.
+static int _set_direct(int fd) {
+
+	int flags;
+
+	if((flags = fcntl( fd, F_GETFL )) == -1)
+		return -1;
+
+	return fcntl( fd, F_SETFL, flags | O_DIRECT );
+}
+
+struct copy_slot {
+	struct copy_pipe * pipe;
+	void * buffer;
+	off_t offset;
+	ssize_t result;
+	int busy; // read in flight.
+};
+
+struct copy_pipe {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void _copy_read_done(void * user, ssize_t result) {
+
+	struct copy_slot * slot = (struct copy_slot *)user;
+
+	pthread_mutex_lock(&slot->pipe->lock);
+	slot->result = result;
+	slot->busy = 0;
+	pthread_cond_broadcast(&slot->pipe->cond);
+	pthread_mutex_unlock(&slot->pipe->lock);
+}
+
+static int _copy_queue(ef_aio_t * aio, int src, struct copy_slot * slot, size_t block_size, off_t offset) {
+
+	slot->offset = offset;
+
+	if( !aio ) {
+		// no asynchronous reads - read it now.
+		while(((slot->result = pread( src, slot->buffer, block_size, offset )) < 0) && (errno == EINTR))
+			;
+		return 0;
+	}
+
+	slot->busy = 1;
+	if( ef_aio_read( aio, src, slot->buffer, block_size, offset, &_copy_read_done, slot ) != 0 ) {
+		slot->busy = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Copy through user space with reads running ahead of the writes.
+ *	'depth' aligned buffers rotate between the read queue and the writer.
+ */
+static int _copy_pipeline(int src, int dst, off_t offset, off_t size, size_t block_size, int depth) {
+
+	struct copy_slot slots[EF_COPY_DEPTH_MAX];
+	struct copy_pipe pipe;
+	ef_aio_t * aio = NULL;
+	off_t next;
+	int err = -1;
+	int i;
+
+	memset(slots, 0, sizeof slots);
+
+	if(pthread_mutex_init(&pipe.lock, NULL) != 0)
+		return -1;
+	if(pthread_cond_init(&pipe.cond, NULL) != 0) {
+		pthread_mutex_destroy(&pipe.lock);
+		return -1;
+	}
+
+	for(i=0;i<depth;i++) {
+		slots[i].pipe = &pipe;
+		if( posix_memalign(&slots[i].buffer, EF_ALIGNMENT, block_size) != 0 )
+			goto bad;
+	}
+
+	// a slot can be queued again before ef_aio has retired its last read, so allow twice the depth.
+	if( (depth > 1) && (ef_aio_create( &aio, depth * 2 ) != 0) )
+		aio = NULL; // carry on synchronously.
+
+	// prime the pipeline.
+	next = offset;
+	for(i=0;(i<depth) && (next < size);i++, next += block_size)
+		if( _copy_queue( aio, src, slots + i, block_size, next ) != 0 )
+			goto bad;
+
+	for(i=0; offset < size; i = (i+1) % depth) {
+
+		struct copy_slot * slot = slots + i;
+		size_t wbytes;
+		ssize_t result;
+
+		pthread_mutex_lock(&pipe.lock);
+		while( slot->busy )
+			pthread_cond_wait(&pipe.cond, &pipe.lock);
+		result = slot->result;
+		pthread_mutex_unlock(&pipe.lock);
+
+		if( result <= 0 )
+			goto bad; // ERROR, or source shrank.
+
+		if( (off_t)result < (size - offset) && ((size_t)result < block_size) )
+			goto bad; // short read mid-file.
+
+		// O_DIRECT wants whole sectors - pad the tail, ftruncate trims it later.
+		wbytes  = result + (EF_ALIGNMENT-1);
+		wbytes -= wbytes % EF_ALIGNMENT;
+		memset(((char*)slot->buffer) + result, 0, wbytes - result);
+
+		{
+			size_t done = 0;
+			while( done < wbytes ) {
+				ssize_t w = pwrite( dst, ((char*)slot->buffer) + done, wbytes - done, offset + done );
+				if( w < 0 && errno == EINTR )
+					continue;
+				if( w <= 0 )
+					goto bad; // disk full ???
+				done += w;
+			}
+		}
+
+		offset += result;
+
+		if( next < size ) {
+			if( _copy_queue( aio, src, slot, block_size, next ) != 0 )
+				goto bad;
+			next += block_size;
+		}
+	}
+
+	err = 0;
+
+bad:
+	ef_aio_destroy(aio); // waits for reads in flight.
+	for(i=0;i<depth;i++)
+		free(slots[i].buffer);
+	pthread_cond_destroy(&pipe.cond);
+	pthread_mutex_destroy(&pipe.lock);
+	return err;
+}
+
+int ef_copy_ex(const char * from, const char * to, int mode, const ef_copy_opts_t * opts, ef_copy_stats_t * stats) {
 
-	void * buffer = NULL;
 	struct stat _stat;
+	struct timespec t0;
+	struct timespec t1;
 	int src   = -1;
 	int dst   = -1;
-	int blocksize = 4096;
+	int method = EF_COPY_PIPELINE;
+	int direct = 0;
+	off_t copied = 0;
+	size_t block_size = EF_COPY_BLOCKSIZE;
+	int depth = 2;
+	int flags = 0;
+
+	if(opts) {
+		if(opts->block_size)
+			block_size = opts->block_size;
+		if(opts->depth)
+			depth = opts->depth;
+		flags = opts->flags;
+	}
 
-	if( stat( from, &_stat ) != 0)
-		goto bad;
+	block_size += (EF_ALIGNMENT-1);
+	block_size -= block_size % EF_ALIGNMENT;
+	if( depth < 1 )
+		depth = 1;
+	if( depth > EF_COPY_DEPTH_MAX )
+		depth = EF_COPY_DEPTH_MAX;
 
-	if( _stat.st_size < blocksize) {
-		blocksize  = _stat.st_size + (EF_ALIGNMENT-1);
-		blocksize -= blocksize % EF_ALIGNMENT;
-	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
 
-	if( posix_memalign(&buffer,EF_ALIGNMENT,blocksize) != 0)
+	if( stat( from, &_stat ) != 0)
 		goto bad;
 
 	if((src = open( from, O_RDONLY )) == -1)
@@ -379,35 +1413,50 @@ int ef_copy(const char * from, const char * to, int mode) {
 	if((dst = open(   to, O_WRONLY | O_CREAT, mode)) == -1)
 		goto bad;
 
-	for(;;) {
-		size_t rbytes = read ( src, buffer, blocksize );
-		size_t wbytes = 0;
+	if( !(flags & EF_COPY_NO_OFFLOAD) ) {
+
+		if( _copy_offload( src, dst, _stat.st_size, &method, &copied ) < 0 )
+			goto bad;
+	}
 
-		if( rbytes > 0 ) {
-			rbytes += (EF_ALIGNMENT-1);
-			rbytes -= rbytes % EF_ALIGNMENT;
-			wbytes = write( dst, buffer, rbytes);
+	if( copied < _stat.st_size ) {
 
-			if( rbytes != wbytes )
-				goto bad; // disk full ???
-		}
+		// no page cache for bulk copies where the filesystems allow it ( and the kernel stopped on
+		//	a sector ). Best effort - the pipeline works either way, stats say which it got.
+		if( (copied % EF_ALIGNMENT) == 0 )
+			direct = (_set_direct( src ) == 0) & (_set_direct( dst ) == 0);
 
-		if( rbytes == 0)
-			break; // EOF;
+		if( _copy_pipeline( src, dst, copied, _stat.st_size, block_size, depth ) != 0 )
+			goto bad;
 
-		if( rbytes < 0)
-			goto bad; // ERROR
+		method = EF_COPY_PIPELINE;
 	}
 
-	free(buffer);
 	close(src);
-	ftruncate(dst, _stat.st_size);
+	if( ftruncate(dst, _stat.st_size) != 0 ) {
+		src = -1;
+		goto bad;
+	}
 	close(dst);
+
+	if(stats) {
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		stats->bytes   = _stat.st_size;
+		stats->seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+		stats->bytes_per_second = (stats->seconds > 0) ? (stats->bytes / stats->seconds) : 0;
+		stats->method  = method;
+		stats->direct  = direct;
+	}
+
 	return 0;
 
 bad:
 	if(src != -1) close(src);
 	if(dst != -1) close(dst);
-	free(buffer);
 	return -1;
 }
+
+int ef_copy(const char * from, const char * to, int mode) {
+
+	return ef_copy_ex( from, to, mode, NULL, NULL );
+}
@@ -4,20 +4,29 @@
  * LICENCE: GPL-v3.
  *
  * Library for random file access on embedded Linux systems ( requires O_DIRECT ).
- * Each buffer 'ef_buffer_t' is 4k in size.
- * Buffers can be shared between multiple files 'ef_file' as-long as files are not
- * 	accesses concurrently ( do your own locking! ).
+ * Each buffer 'ef_buffer_t' is a cache of one or more 4k blocks.
+ * Buffers can be shared between multiple files 'ef_file', and between threads
+ *	( blocks are locked, and the reference count is atomic, so files on one buffer
+ *	may be opened, used and closed from different threads ).
+ *	A single 'ef_file' has one cursor, so must not be accessed concurrently,
+ *	except through ef_file_pread.
  **************************************************************************************/
 
 #pragma once
 
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/uio.h>
+
+#include "embedded_file_aio.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// Reads with an offset, length and destination aligned to this skip the buffer.
+#define EF_ALIGNMENT 512
+
 struct ef_buffer;
 typedef struct ef_buffer * ef_buffer_t;
 
@@ -25,19 +34,73 @@ struct ef_file;
 typedef struct ef_file * ef_file_t;
 
 int ef_buffer_create (ef_buffer_t * buffer);
+int ef_buffer_create_cache(ef_buffer_t * buffer, size_t blocks); // set-associative, LRU replacement.
 int ef_buffer_destroy(ef_buffer_t   buffer);
 
+// Read up to 'blocks' ahead of files that are read sequentially, in the background
+//	( io_uring where available, otherwise a thread pool ). 0 disables read-ahead.
+int ef_buffer_set_readahead(ef_buffer_t buffer, size_t blocks);
+
+// Write dirty blocks back on a background thread once more than 'dirty_blocks' are dirty,
+//	merging blocks that are contiguous in a file into one write. 0 disables it.
+int ef_buffer_set_writeback(ef_buffer_t buffer, size_t dirty_blocks);
+
 int ef_file_open (ef_file_t *file, ef_buffer_t shared_buffer, const char * path, int flags, mode_t mode);
 int ef_file_close(ef_file_t  file);
 
 off_t   ef_file_seek( ef_file_t file, off_t offset, int whence );
 ssize_t ef_file_read( ef_file_t file, void * dst_buffer, size_t count);
 
+// Scatter read. Goes straight to the callers memory in one syscall if every buffer,
+//	length and the file offset are aligned to EF_ALIGNMENT.
+ssize_t ef_file_readv( ef_file_t file, const struct iovec * iov, int iovcnt);
+
+// Positional read - uses neither the files offset nor its buffer, so may be
+//	called concurrently on one file. Buffered writes in the range are flushed first.
+ssize_t ef_file_pread( ef_file_t file, void * dst_buffer, size_t count, off_t offset);
+
+// Positional reads straight into the callers memory, with no bounce buffer. The buffers, their
+//	lengths and 'offset' must be aligned to EF_ALIGNMENT. Reads past the end of the file return short.
+ssize_t ef_file_pread_direct( ef_file_t file, void * dst_buffer, size_t count, off_t offset);
+ssize_t ef_file_preadv_direct( ef_file_t file, const struct iovec * iov, int iovcnt, off_t offset);
+
+// Queue a positional read on 'aio', straight into the callers memory. The buffer, 'count' and
+//	'offset' must be aligned to EF_ALIGNMENT. Reads past the end of the file complete short.
+int ef_file_aio_read( ef_file_t file, ef_aio_t * aio, void * dst_buffer, size_t count, off_t offset, ef_aio_done_fn done, void * user );
+
 int ef_file_flush(ef_file_t file);
+int ef_file_sync (ef_file_t file); // flush, wait for background write-back, and fdatasync.
 ssize_t ef_file_write(ef_file_t file, const void * src_buffer, size_t count);
 
 int ef_copy(const char * from, const char * to, int mode);
 
+// ef_copy_ex methods.
+enum {
+	EF_COPY_RANGE    = 1, // copy_file_range ( may reflink ).
+	EF_COPY_SENDFILE = 2,
+	EF_COPY_PIPELINE = 3, // aligned buffers, reads overlapping writes.
+};
+
+// ef_copy_ex flags.
+#define EF_COPY_NO_OFFLOAD 0x01 // always copy through the pipeline.
+
+typedef struct {
+	size_t block_size; // pipeline block size, rounded up to EF_ALIGNMENT. 0 for 1MiB.
+	int depth;         // pipeline buffers ( 1 to 3 ). 0 for 2.
+	int flags;         // EF_COPY_*
+} ef_copy_opts_t;
+
+typedef struct {
+	off_t  bytes;
+	double seconds;
+	double bytes_per_second;
+	int    method;     // EF_COPY_RANGE, EF_COPY_SENDFILE or EF_COPY_PIPELINE.
+	int    direct;     // the pipeline bypassed the page cache ( O_DIRECT on both files ).
+} ef_copy_stats_t;
+
+// ef_copy, letting the kernel do the copy where it can. 'opts' and 'stats' may be NULL.
+int ef_copy_ex(const char * from, const char * to, int mode, const ef_copy_opts_t * opts, ef_copy_stats_t * stats);
+
 #ifdef __cplusplus
 } // extern "C" {
 #endif
@@ -0,0 +1,534 @@
+
+/***************************************************************************************
+ * AUTHOR: Chris Stones ( chris.stones _AT_ zoho.com / chris.stones _AT_ gmail.com )
+ * LICENCE: GPL-v3.
+ *
+ * Asynchronous positional reads for embedded_file.
+ * Uses io_uring where the kernel supports it, otherwise a small pool of threads
+ *	issuing preadv. 'done' is called from a completion thread with the result
+ *	of the read ( bytes read, or -errno ).
+ **************************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "embedded_file_aio.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define EF_HAVE_IO_URING
+#endif
+#endif
+
+#define EF_AIO_POOL_THREADS 2
+
+// how often a broken ring is polled for the reads it still has in flight.
+#define EF_AIO_POLL_NS (1000*1000)
+
+struct ef_aio_request {
+
+	struct iovec iov;
+	int fd;
+	off_t offset;
+
+	ef_aio_done_fn done;
+	void * user;
+
+	struct ef_aio_request * next;
+};
+
+#ifdef EF_HAVE_IO_URING
+struct ef_uring {
+
+	int fd;
+
+	// the ring's thread sleeps in poll, not io_uring_enter - so waking it can't fail.
+	int event_fd; // signalled by the kernel as reads complete ( IORING_REGISTER_EVENTFD ).
+	int wake_fd;  // signalled by ef_aio_destroy.
+
+	void * sq_ptr;
+	size_t sq_len;
+	void * cq_ptr;
+	size_t cq_len;
+
+	unsigned * sq_head;
+	unsigned * sq_tail;
+	unsigned * sq_mask;
+	unsigned * sq_array;
+	struct io_uring_sqe * sqes;
+	size_t sqes_len;
+
+	unsigned * cq_head;
+	unsigned * cq_tail;
+	unsigned * cq_mask;
+	struct io_uring_cqe * cqes;
+};
+#endif
+
+struct ef_aio {
+
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+
+	unsigned depth;
+	unsigned inflight;
+	int shutdown;
+
+	// 'depth' requests, allocated up front - so queueing a read never allocates.
+	struct ef_aio_request * requests;
+	struct ef_aio_request * free_requests;
+
+	// thread pool backend - requests waiting for a thread.
+	struct ef_aio_request * queue_head;
+	struct ef_aio_request * queue_tail;
+
+	pthread_t threads[1 + EF_AIO_POOL_THREADS]; // the ring's thread ( if any ) first.
+	int nthreads;
+	int npool;
+
+#ifdef EF_HAVE_IO_URING
+	struct ef_uring * uring;
+	unsigned uring_inflight;
+	int uring_broken; // io_uring_enter failed - reads go to the pool from now on.
+#endif
+};
+
+static void * _pool_thread(void * arg);
+
+// Start the pool of blocking readers - call with aio->lock held. Returns the number running.
+static int _pool_start(ef_aio_t * aio) {
+
+	while(aio->npool < EF_AIO_POOL_THREADS) {
+		if(pthread_create(aio->threads + aio->nthreads, NULL, &_pool_thread, aio) != 0)
+			break;
+		aio->nthreads++;
+		aio->npool++;
+	}
+
+	return aio->npool;
+}
+
+static void _complete(ef_aio_t * aio, struct ef_aio_request * req, ssize_t result) {
+
+	req->done( req->user, result );
+
+	pthread_mutex_lock(&aio->lock);
+	req->next = aio->free_requests;
+	aio->free_requests = req;
+	aio->inflight--;
+	pthread_cond_broadcast(&aio->cond);
+	pthread_mutex_unlock(&aio->lock);
+}
+
+/*** io_uring backend ***/
+
+#ifdef EF_HAVE_IO_URING
+
+static void _uring_destroy(struct ef_uring * ring) {
+
+	if(ring) {
+		if(ring->sqes && (ring->sqes != MAP_FAILED))
+			munmap(ring->sqes, ring->sqes_len);
+		if(ring->cq_ptr && (ring->cq_ptr != MAP_FAILED) && (ring->cq_ptr != ring->sq_ptr))
+			munmap(ring->cq_ptr, ring->cq_len);
+		if(ring->sq_ptr && (ring->sq_ptr != MAP_FAILED))
+			munmap(ring->sq_ptr, ring->sq_len);
+		if(ring->fd != -1)
+			close(ring->fd);
+		if(ring->event_fd != -1)
+			close(ring->event_fd);
+		if(ring->wake_fd != -1)
+			close(ring->wake_fd);
+		free(ring);
+	}
+}
+
+static struct ef_uring * _uring_create(unsigned depth) {
+
+	struct io_uring_params p;
+	struct ef_uring * ring;
+
+	if((ring = calloc(1, sizeof(struct ef_uring))) == NULL)
+		return NULL;
+
+	ring->event_fd = -1;
+	ring->wake_fd  = -1;
+
+	memset(&p, 0, sizeof p);
+
+	if((ring->fd = syscall(__NR_io_uring_setup, depth, &p)) < 0) {
+		ring->fd = -1;
+		goto bad; // no kernel support ( or not permitted ).
+	}
+
+	if((ring->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+		goto bad;
+	if((ring->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+		goto bad;
+
+	if(syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_EVENTFD, &ring->event_fd, 1) < 0)
+		goto bad;
+
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_len = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(ring->cq_len > ring->sq_len)
+			ring->sq_len = ring->cq_len;
+		ring->cq_len = ring->sq_len;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if(ring->sq_ptr == MAP_FAILED)
+		goto bad;
+
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ptr = ring->sq_ptr;
+	else if((ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+		goto bad;
+
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if(ring->sqes == MAP_FAILED)
+		goto bad;
+
+	ring->sq_head  = (unsigned *)((char *)ring->sq_ptr + p.sq_off.head);
+	ring->sq_tail  = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+	ring->sq_mask  = (unsigned *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+
+	ring->cq_head  = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+	ring->cq_tail  = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+	ring->cq_mask  = (unsigned *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+	ring->cqes     = (struct io_uring_cqe *)((char *)ring->cq_ptr + p.cq_off.cqes);
+
+	return ring;
+
+bad:
+	_uring_destroy(ring);
+	return NULL;
+}
+
+// submit one read - call with aio->lock held.
+//	Only the caller submits ( no SQPOLL ), so a failed entry can be withdrawn.
+static int _uring_submit(struct ef_uring * ring, struct ef_aio_request * req) {
+
+	unsigned tail = *ring->sq_tail;
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe * sqe = ring->sqes + index;
+
+	memset(sqe, 0, sizeof *sqe);
+
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd     = req->fd;
+	sqe->addr   = (unsigned long)&req->iov;
+	sqe->len    = 1;
+	sqe->off    = req->offset;
+
+	sqe->user_data = (unsigned long)req;
+
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	while(syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0) < 0) {
+		if(errno != EINTR) {
+			// not consumed - take it back, so a later enter can't submit a request the caller has freed.
+			__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void * _uring_thread(void * arg) {
+
+	ef_aio_t * aio = (ef_aio_t *)arg;
+	struct ef_uring * ring = aio->uring;
+	int broken = 0;
+
+	for(;;) {
+
+		unsigned head;
+		unsigned tail;
+		int stop = 0;
+
+		if(broken) {
+
+			// wait for the ring's last reads to turn up, polling the completion queue.
+			struct timespec ts = { 0, EF_AIO_POLL_NS };
+			unsigned left;
+
+			pthread_mutex_lock(&aio->lock);
+			left = aio->uring_inflight;
+			pthread_mutex_unlock(&aio->lock);
+
+			if(!left)
+				break;
+
+			nanosleep(&ts, NULL);
+		}
+		else {
+
+			struct pollfd fds[2];
+			uint64_t count;
+
+			fds[0].fd     = ring->event_fd;
+			fds[0].events = POLLIN;
+			fds[1].fd     = ring->wake_fd;
+			fds[1].events = POLLIN;
+
+			if((poll(fds, 2, -1) < 0) && (errno != EINTR)) {
+
+				// waiting failed - send new reads to the pool. Reads already in the kernel still
+				//	complete, they're reaped by polling the completion queue.
+				pthread_mutex_lock(&aio->lock);
+				aio->uring_broken = 1;
+				_pool_start(aio);
+				pthread_mutex_unlock(&aio->lock);
+				broken = 1;
+			}
+			else {
+				// reset before reaping, so a completion after this signals again.
+				if(fds[0].revents & POLLIN)
+					while((read(ring->event_fd, &count, sizeof count) < 0) && (errno == EINTR))
+						;
+				if(fds[1].revents & POLLIN)
+					stop = 1; // ef_aio_destroy - nothing is in flight.
+			}
+		}
+
+		head = *ring->cq_head;
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+		while(head != tail) {
+
+			struct io_uring_cqe * cqe = ring->cqes + (head & *ring->cq_mask);
+			struct ef_aio_request * req = (struct ef_aio_request *)(unsigned long)cqe->user_data;
+			ssize_t result = cqe->res;
+
+			__atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+
+			pthread_mutex_lock(&aio->lock);
+			aio->uring_inflight--;
+			pthread_mutex_unlock(&aio->lock);
+			_complete(aio, req, result);
+		}
+
+		if(stop)
+			break;
+	}
+
+	return NULL;
+}
+
+#endif // EF_HAVE_IO_URING
+
+/*** thread pool backend ***/
+
+static void * _pool_thread(void * arg) {
+
+	ef_aio_t * aio = (ef_aio_t *)arg;
+
+	for(;;) {
+
+		struct ef_aio_request * req;
+		ssize_t result;
+
+		pthread_mutex_lock(&aio->lock);
+		while(!aio->queue_head && !aio->shutdown)
+			pthread_cond_wait(&aio->cond, &aio->lock);
+
+		if((req = aio->queue_head) == NULL) {
+			pthread_mutex_unlock(&aio->lock);
+			break; // shutdown, and nothing left to do.
+		}
+
+		if((aio->queue_head = req->next) == NULL)
+			aio->queue_tail = NULL;
+		pthread_mutex_unlock(&aio->lock);
+
+		while(((result = preadv(req->fd, &req->iov, 1, req->offset)) < 0) && (errno == EINTR))
+			;
+
+		_complete(aio, req, result < 0 ? -errno : result);
+	}
+
+	return NULL;
+}
+
+int ef_aio_create(ef_aio_t ** aio, unsigned depth) {
+
+	unsigned i;
+
+	if(!aio || !depth)
+		return -1;
+
+	if((*aio = calloc(1, sizeof(ef_aio_t))) == NULL)
+		return -1;
+
+	(*aio)->depth = depth;
+
+	if(((*aio)->requests = calloc(depth, sizeof(struct ef_aio_request))) == NULL)
+		goto bad;
+
+	for(i=0;i<depth;i++) {
+		(*aio)->requests[i].next = (*aio)->free_requests;
+		(*aio)->free_requests = (*aio)->requests + i;
+	}
+
+	if(pthread_mutex_init(&(*aio)->lock, NULL) != 0)
+		goto bad;
+	if(pthread_cond_init(&(*aio)->cond, NULL) != 0)
+		goto bad_lock;
+
+#ifdef EF_HAVE_IO_URING
+	if(((*aio)->uring = _uring_create(depth)) != NULL) {
+
+		// claim the first slot before the thread can break the ring and start the pool.
+		pthread_mutex_lock(&(*aio)->lock);
+		(*aio)->nthreads = 1;
+
+		if(pthread_create((*aio)->threads, NULL, &_uring_thread, *aio) == 0) {
+			pthread_mutex_unlock(&(*aio)->lock);
+			return 0;
+		}
+
+		(*aio)->nthreads = 0;
+		pthread_mutex_unlock(&(*aio)->lock);
+
+		_uring_destroy((*aio)->uring);
+		(*aio)->uring = NULL;
+	}
+#endif
+
+	// fall back to a pool of blocking readers.
+	if(_pool_start(*aio))
+		return 0;
+
+	pthread_cond_destroy(&(*aio)->cond);
+bad_lock:
+	pthread_mutex_destroy(&(*aio)->lock);
+bad:
+	free((*aio)->requests);
+	free(*aio);
+	*aio = NULL;
+	return -1;
+}
+
+void ef_aio_destroy(ef_aio_t * aio) {
+
+	int i;
+
+	if(!aio)
+		return;
+
+	pthread_mutex_lock(&aio->lock);
+
+	while(aio->inflight)
+		pthread_cond_wait(&aio->cond, &aio->lock);
+
+	aio->shutdown = 1;
+
+	pthread_cond_broadcast(&aio->cond);
+	pthread_mutex_unlock(&aio->lock);
+
+#ifdef EF_HAVE_IO_URING
+	// wake the ring's thread ( if it's broken it leaves on its own ). Only fails if the
+	//	counter would overflow - and then it's already signalled.
+	if(aio->uring) {
+		uint64_t one = 1;
+		while((write(aio->uring->wake_fd, &one, sizeof one) < 0) && (errno == EINTR))
+			;
+	}
+#endif
+
+#ifdef EF_HAVE_IO_URING
+	// the ring's thread may still start the pool, so it goes first.
+	if(aio->uring)
+		pthread_join(aio->threads[0], NULL);
+	for(i=aio->uring ? 1 : 0;i<aio->nthreads;i++)
+#else
+	for(i=0;i<aio->nthreads;i++)
+#endif
+		pthread_join(aio->threads[i], NULL);
+
+#ifdef EF_HAVE_IO_URING
+	_uring_destroy(aio->uring);
+#endif
+
+	pthread_cond_destroy(&aio->cond);
+	pthread_mutex_destroy(&aio->lock);
+	free(aio->requests);
+	free(aio);
+}
+
+int ef_aio_read(ef_aio_t * aio, int fd, void * buffer, size_t count, off_t offset, ef_aio_done_fn done, void * user) {
+
+	struct ef_aio_request * req;
+	int err = 0;
+
+	if(!aio || !done)
+		return -1;
+
+	pthread_mutex_lock(&aio->lock);
+
+	if(aio->shutdown || (aio->inflight >= aio->depth)) {
+		pthread_mutex_unlock(&aio->lock);
+		return -1; // queue is full.
+	}
+
+	// fewer than 'depth' in flight, so there's a free request.
+	req = aio->free_requests;
+	aio->free_requests = req->next;
+
+	req->iov.iov_base = buffer;
+	req->iov.iov_len  = count;
+	req->fd           = fd;
+	req->offset       = offset;
+	req->done         = done;
+	req->user         = user;
+	req->next         = NULL;
+
+#ifdef EF_HAVE_IO_URING
+	if(aio->uring && !aio->uring_broken && (_uring_submit(aio->uring, req) == 0)) {
+		aio->inflight++;
+		aio->uring_inflight++;
+	}
+	else
+#endif
+	if(_pool_start(aio) == 0) {
+		err = -1; // the ring refused it ( or there is none ), and there are no threads to take it.
+	}
+	else {
+		if(aio->queue_tail)
+			aio->queue_tail->next = req;
+		else
+			aio->queue_head = req;
+		aio->queue_tail = req;
+		aio->inflight++;
+		pthread_cond_broadcast(&aio->cond);
+	}
+
+	if(err) {
+		req->next = aio->free_requests;
+		aio->free_requests = req;
+	}
+
+	pthread_mutex_unlock(&aio->lock);
+
+	return err;
+}
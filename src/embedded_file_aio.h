@@ -0,0 +1,34 @@
+
+/***************************************************************************************
+ * AUTHOR: Chris Stones ( chris.stones _AT_ zoho.com / chris.stones _AT_ gmail.com )
+ * LICENCE: GPL-v3.
+ *
+ * Asynchronous positional reads for embedded_file.
+ * Uses io_uring where the kernel supports it, otherwise a small pool of threads
+ *	issuing preadv. 'done' is called from a completion thread with the result
+ *	of the read ( bytes read, or -errno ).
+ **************************************************************************************/
+
+#pragma once
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct ef_aio;
+typedef struct ef_aio ef_aio_t;
+
+typedef void (*ef_aio_done_fn)(void * user, ssize_t result);
+
+int  ef_aio_create (ef_aio_t ** aio, unsigned depth);
+void ef_aio_destroy(ef_aio_t * aio); // waits for reads in flight.
+
+// Queue a read. Fails ( -1 ) if 'depth' reads are already in flight.
+int  ef_aio_read(ef_aio_t * aio, int fd, void * buffer, size_t count, off_t offset, ef_aio_done_fn done, void * user);
+
+#ifdef __cplusplus
+} // extern "C" {
+#endif
+
@@ -5,6 +5,8 @@
  * LICENSE: GPL-v3
  */
 
+#define _GNU_SOURCE
+
 #include "libesprom.h"
 #include "embedded_file.h"
 
@@ -16,11 +18,17 @@
 #include <byteswap.h>
 #include <stdint.h>
 #include <stdarg.h>
+#include <limits.h>
+#include <unistd.h>
 #include <linux/limits.h>
 #include <linux/fs.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "memchunk.h"
+#include "chunkcache.h"
+#include "adpcm.h"
 
 #if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
 #define RH_BIG_ENDIAN
@@ -49,138 +57,453 @@ struct sample_header_struct {
 };
 typedef struct sample_header_struct sample_header_t;
 
+struct prom_loader_struct;
+typedef struct prom_loader_struct prom_loader_t;
+
+struct prom_stream_info_struct;
+typedef struct prom_stream_info_struct prom_stream_info_t;
+
+struct prom_stream;
+
 struct esprom_struct {
 
 	mem_chunk_ctx_t mem_chunk_ctx;
 
 	sample_header_t * sample_headers;
 
+	// read-only mapping of the prom file ( esprom_alloc_mmap ), or NULL.
+	void * map;
+	size_t map_size;
+
+	// demand paged sample data ( esprom_alloc_lazy ), or NULL.
+	ef_file_t file;
+	chunk_cache_t * cache;
+
+	// compressed sample blocks, decoded on demand by each sample handle ( esprom_compress_samples ), or NULL.
+	uint8_t * adpcm;
+	size_t adpcm_size;
+
+	// decode buffers for the handles on a compressed prom, allocated with the blocks and handed out through a free list.
+	mem_chunk_pager_t decode_pager; // the proms own, for copies that aren't through a handle ( esprom_export ).
+	struct prom_decoder * decode_pool;
+	uint8_t * decode_buffers;
+	size_t decode_buffers_size;
+	uint32_t * decode_next;
+	uint64_t decode_head;
+	int decode_max;
+
+	// samples streamed from 'file' ( esprom_alloc_streaming ), or NULL.
+	prom_stream_info_t * streams;
+	ef_aio_t * stream_aio;
+
+	// buffers for the streamed handles, allocated at load time and handed out through a free list.
+	struct prom_stream * stream_pool;
+	uint8_t * stream_buffers;
+	uint32_t * stream_next;
+	uint64_t stream_head;
+	int stream_max;
+
+	// background loader ( esprom_alloc_async ), or NULL once everything is loaded synchronously.
+	prom_loader_t * loader;
+
+	// samples live in one contiguous arena ( esprom_alloc_arena ).
+	int arena;
+
+	// ESPROM_MEM_* flags the arena was allocated with, and ESPROM_MEM_LOCK once esprom_pin has locked the memory.
+	int mem_flags;
+
+	// per sample esprom_format_t, or NULL if none have been set.
+	unsigned char * formats;
+
+	// references held through esprom_open, or 0 if the prom isn't shared.
+	int shared_refs;
+	dev_t shared_dev;
+	ino_t shared_ino;
+	struct timespec shared_mtime;
+	struct esprom_struct * shared_next;
+
 	short samples;
 };
 
 typedef struct esprom_struct prom_context_t;
 
-// EXPORTED SYMBOL
-int esprom_alloc( const char * const fn, esprom_handle * ph ) {
+// streamed and compressed samples are at the end of the file.
+static void _stream_pool_free(prom_context_t * prom);
+static int  _decode_pool_alloc(prom_context_t * prom, int max);
+static void _decode_pool_free(prom_context_t * prom);
 
-//	FILE * file = NULL;
+// sequential loads read through a small block cache with read-ahead.
+#define PROM_LOAD_CACHE_BLOCKS 32
+#define PROM_LOAD_READAHEAD    16
 
-	ef_file_t   ef_file = NULL;
+// chunks per vectored read.
+#define PROM_LOAD_IOV 64
 
-	size_t highest_address = 0;
-	size_t lowest_address = -1;
+// runs at least this long are lined up with the file so they can be read directly.
+//	Shorter runs go through the files buffer anyway, so aren't padded.
+#define PROM_LOAD_DIRECT_MIN (64*1024)
 
-	if(!ph || !fn)
-		goto bad;
+// arena layout - every run starts on a cache line ( and SIMD vector ), and is
+//	followed by zeros so vector loops may read a little past the end of a sample.
+#define PROM_ARENA_ALIGN 64
+#define PROM_ARENA_GUARD 64
 
-	*ph = NULL;
+static int _open_for_loading(const char * const fn, ef_file_t * ef_file) {
 
-	if( ef_file_open(&ef_file, NULL, fn, O_RDONLY, 0))
+	ef_buffer_t cache = NULL;
+	int err;
+
+	if( ef_buffer_create_cache(&cache, PROM_LOAD_CACHE_BLOCKS) != 0 )
+		return -1;
+
+	// best effort - without it we just read synchronously.
+	ef_buffer_set_readahead(cache, PROM_LOAD_READAHEAD);
+
+	err = ef_file_open(ef_file, cache, fn, O_RDONLY, 0);
+
+	// the file holds its own reference.
+	ef_buffer_destroy(cache);
+
+	return err;
+}
+
+// A samples location in the prom file ( inclusive ).
+struct sample_range_struct {
+
+	size_t start;
+	size_t end;
+	int    id;
+};
+typedef struct sample_range_struct sample_range_t;
+
+static int _sample_range_cmp(const void * a, const void * b) {
+
+	const sample_range_t * ra = (const sample_range_t *)a;
+	const sample_range_t * rb = (const sample_range_t *)b;
+
+	if(ra->start != rb->start)
+		return ra->start < rb->start ? -1 : 1;
+	if(ra->end != rb->end)
+		return ra->end < rb->end ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Read the prom header and the whole sample table ( one read each ).
+ * Returns the sample ranges sorted by file offset, or NULL.
+ */
+static sample_range_t * _read_sample_table(ef_file_t ef_file, short * samples) {
+
+	uint8_t header[18];
+	uint8_t * table = NULL;
+	sample_range_t * ranges = NULL;
+	int i;
+
+	if( ef_file_seek(ef_file, 0, SEEK_SET) != 0 )
 		goto bad;
 
-	if( ef_file_seek(ef_file, 14, SEEK_SET) != 14 )
+	if( ef_file_read(ef_file, header, sizeof header) != sizeof header )
 		goto bad;
 
-	if((*ph = calloc(1, sizeof(prom_context_t) )) == NULL)
+	memcpy(samples, header + 14, 2);
+
+	BE_TO_CPU_16_INPLACE(*samples);
+
+	if(*samples <= 0)
 		goto bad;
 
-	if(ef_file_read(ef_file, &((*ph)->samples) ,2) != 2)
+	if((table = malloc( 10 * (*samples) )) == NULL)
 		goto bad;
 
-	BE_TO_CPU_16_INPLACE((*ph)->samples);
+	if((ranges = calloc( *samples, sizeof(sample_range_t) )) == NULL)
+		goto bad;
 
-	(*ph)->sample_headers = (sample_header_t *)calloc( (*ph)->samples, sizeof(sample_header_t));
-	if(!((*ph)->sample_headers))
+	if( ef_file_read(ef_file, table, 10 * (*samples)) != (10 * (*samples)) )
 		goto bad;
 
-	{
-		// First pass - determine amount of memory we need to allocate.
-		int i;
-		for(i=0;i< (*ph)->samples; i++) {
+	for(i=0;i< *samples; i++) {
 
-			int data[2];
+		int data[2];
 
-			if( ef_file_seek(ef_file, 18 + 10 * i, SEEK_SET) != (18 + 10 * i) )
-				goto bad;
+		memcpy(data, table + 10 * i, sizeof data);
 
-			if(ef_file_read(ef_file, data ,sizeof data) != sizeof data)
-				goto bad;
+		BE_TO_CPU_32_INPLACE(data[0]);
+		BE_TO_CPU_32_INPLACE(data[1]);
 
-			BE_TO_CPU_32_INPLACE(data[0]);
-			BE_TO_CPU_32_INPLACE(data[1]);
+		if( (data[0] < 0) || (data[1] < data[0]) )
+			goto bad;
+
+		ranges[i].start = data[0];
+		ranges[i].end   = data[1];
+		ranges[i].id    = i;
+	}
+
+	qsort(ranges, *samples, sizeof(sample_range_t), &_sample_range_cmp);
+
+	free(table);
+	return ranges;
+
+bad:
+	free(table);
+	free(ranges);
+	return NULL;
+}
+
+// Overlapping or adjacent sample ranges, merged so they can be read with a single seek.
+struct sample_run_struct {
+
+	size_t start;     // first byte in the file.
+	size_t end;       // last byte in the file.
+	size_t mem_start; // where the first byte lives in the proms memory.
+	int    first;     // sorted sample ranges covered by this run are [first, last).
+	int    last;
+};
+typedef struct sample_run_struct sample_run_t;
+
+/*
+ * Merge sorted sample ranges into runs, so each byte of the file that any
+ *	sample refers to is stored once. Ranges are merged if they overlap, or if
+ *	'touch' and they are adjacent. Only start, end, first and last are set.
+ */
+static int _merge_sample_ranges(const sample_range_t * ranges, int samples, int touch, sample_run_t * runs) {
+
+	int nruns = 0;
+	int i = 0;
 
-			if( data[1] > highest_address)
-				highest_address = data[1];
-			if( data[0] < lowest_address)
-				lowest_address = data[0];
+	while( i < samples ) {
+
+		sample_run_t * run = runs + nruns++;
+
+		run->start = ranges[i].start;
+		run->end   = ranges[i].end;
+		run->first = i;
+
+		// extend the run over every range that overlaps ( or touches ) it.
+		for(i++;(i< samples) && (ranges[i].start <= (run->end + (touch ? 1 : 0))); i++)
+			if( ranges[i].end > run->end )
+				run->end = ranges[i].end;
+
+		run->last = i;
+	}
+
+	return nruns;
+}
+
+/*
+ * Merge sorted sample ranges into runs, allocate the proms memory,
+ * 	and map every sample into it. Returns the runs, or NULL.
+ *	Gaps between runs aren't stored, and aliased samples share memory.
+ *	Arena proms only merge overlapping ranges, so each sample that doesn't
+ *	alias another starts on its own cache line.
+ */
+static sample_run_t * _plan_sample_runs(prom_context_t * prom, const sample_range_t * ranges, int * nruns) {
+
+	sample_run_t * runs;
+	size_t size = 0;
+	int i;
+
+	if((runs = calloc( prom->samples, sizeof(sample_run_t) )) == NULL)
+		return NULL;
+
+	*nruns = _merge_sample_ranges(ranges, prom->samples, !prom->arena, runs);
+
+	for(i=0;i< *nruns; i++) {
+
+		sample_run_t * run = runs + i;
+		size_t len = 1 + (run->end - run->start);
+
+		if( prom->arena )
+			size += (PROM_ARENA_ALIGN - (size % PROM_ARENA_ALIGN)) % PROM_ARENA_ALIGN;
+		else if( len >= PROM_LOAD_DIRECT_MIN )
+			// line the run up with the file, so whole chunks can be read directly into place.
+			size += (run->start - size) % EF_ALIGNMENT;
+
+		run->mem_start = size;
+
+		size += len;
+
+		if( prom->arena )
+			size += PROM_ARENA_GUARD;
+	}
+
+	if( prom->arena ) {
+
+		if( ((prom->mem_flags & ESPROM_MEM_HUGE_PAGES)
+				? mem_chunk_alloc_arena_huge(&prom->mem_chunk_ctx, size)
+				: mem_chunk_alloc_arena(&prom->mem_chunk_ctx, size)) != 0 ) {
+			free(runs);
+			return NULL;
 		}
 
-		// allocate the memory!
-		(*ph)->mem_chunk_ctx.size = 1+(highest_address - lowest_address);
-		if(!(*ph)->mem_chunk_ctx.size)
-			goto bad;
-		(*ph)->mem_chunk_ctx.thiz =
-		(*ph)->mem_chunk_ctx.base = alloc_chunks((*ph)->mem_chunk_ctx.size);
-		if(!(*ph)->mem_chunk_ctx.base)
-			goto bad;
+		// zero the guards ( and alignment padding ) between runs.
+		for(i=0;i< *nruns; i++) {
+			size_t gap_start = runs[i].mem_start + 1 + (runs[i].end - runs[i].start);
+			size_t gap_end   = (i+1 < *nruns) ? runs[i+1].mem_start : size;
+			memset(prom->mem_chunk_ctx.chunks[0] + gap_start, 0, gap_end - gap_start);
+		}
+	}
+	else if( mem_chunk_alloc(&prom->mem_chunk_ctx, size) != 0 ) {
+		free(runs);
+		return NULL;
+	}
 
-		// second pass - load prom into memory!
-		for(i=0;i< (*ph)->samples; i++) {
+	// map the samples into memory.
+	for(i=0;i< *nruns; i++) {
 
-			int data[2];
+		int j;
+		for(j=runs[i].first;j<runs[i].last;j++) {
+			prom->sample_headers[ ranges[j].id ].start = runs[i].mem_start + (ranges[j].start - runs[i].start);
+			prom->sample_headers[ ranges[j].id ].end   = runs[i].mem_start + (ranges[j].end   - runs[i].start);
+		}
+	}
 
-			if( ef_file_seek(ef_file, 18 + 10 * i, SEEK_SET) != (18 + 10 * i) )
-				goto bad;
+	return runs;
+}
 
-			if(ef_file_read(ef_file, data ,sizeof data) != sizeof data)
-				goto bad;
+/*
+ * Read one run into the proms memory chunks.
+ *	Uses its own cursor, the proms context is left untouched.
+ *	Whole, aligned chunks are batched into one vectored read straight into place,
+ *	unaligned heads and tails go through the files buffer.
+ */
+static int _load_sample_run(prom_context_t * prom, ef_file_t ef_file, const sample_run_t * run) {
 
-			BE_TO_CPU_32_INPLACE(data[0]);
-			BE_TO_CPU_32_INPLACE(data[1]);
+	mem_chunk_ctx_t ctx = prom->mem_chunk_ctx;
+	size_t remaining = 1 + (run->end - run->start);
 
-			if( ef_file_seek(ef_file, data[0], SEEK_SET) != data[0] )
-				goto bad;
+	if( mem_chunk_seek(&ctx, run->mem_start, SEEK_SET) != 0 )
+		return -1;
 
-			{
-				size_t remaining = 1 + (data[1] - data[0]);
-				void * buffer;
-				size_t bufferlen = 0;
+	if( ef_file_seek(ef_file, run->start, SEEK_SET) != run->start )
+		return -1;
 
-				(*ph)->sample_headers[i].start = (*ph)->mem_chunk_ctx.cur_pos;
-				(*ph)->sample_headers[i].end   = (*ph)->mem_chunk_ctx.cur_pos + remaining - 1;
+	while( remaining ) {
 
-				while( remaining ) {
+		struct iovec iov[PROM_LOAD_IOV];
+		size_t batch = 0;
+		int iovcnt = 0;
 
-					size_t readsize = remaining;
+		while( remaining && (iovcnt < PROM_LOAD_IOV) ) {
 
-					mem_chunk_getbuffer( &(*ph)->mem_chunk_ctx, &buffer, &bufferlen );
+			void * buffer;
+			size_t bufferlen = 0;
+			size_t readsize = remaining;
+			int aligned;
 
-					if(bufferlen < readsize)
-						readsize = bufferlen;
+			if( mem_chunk_getbuffer( &ctx, &buffer, &bufferlen ) != 0 )
+				return -1;
 
-					if(ef_file_read(ef_file, buffer , readsize) != readsize)
-						goto bad;
+			if(bufferlen < readsize)
+				readsize = bufferlen;
 
-					if( mem_chunk_seek(&(*ph)->mem_chunk_ctx, readsize, SEEK_CUR) != 0 )
-						goto bad;
+			aligned = !(((uintptr_t)buffer) % EF_ALIGNMENT);
 
-					remaining -= readsize;
-				}
-			}
+			if( aligned && (readsize >= EF_ALIGNMENT) )
+				readsize -= readsize % EF_ALIGNMENT;
+			else if( iovcnt )
+				break; // unaligned piece - read it on its own.
+			else
+				aligned = 0;
+
+			iov[iovcnt].iov_base = buffer;
+			iov[iovcnt].iov_len  = readsize;
+			iovcnt++;
+
+			if( mem_chunk_seek(&ctx, readsize, SEEK_CUR) != 0 )
+				return -1;
+
+			remaining -= readsize;
+			batch     += readsize;
+
+			if( !aligned )
+				break;
+		}
+
+		if( ef_file_readv(ef_file, iov, iovcnt) != batch )
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Load sorted sample ranges into the proms memory chunks.
+ *	Overlapping and adjacent ranges are merged into a single run,
+ *	each run costs one seek, and is read sequentially.
+ */
+static int _load_sample_ranges(prom_context_t * prom, ef_file_t ef_file, const sample_range_t * ranges) {
+
+	sample_run_t * runs;
+	int nruns;
+	int i;
+
+	if((runs = _plan_sample_runs(prom, ranges, &nruns)) == NULL)
+		return -1;
+
+	for(i=0;i<nruns;i++) {
+		if( _load_sample_run(prom, ef_file, runs + i) != 0 ) {
+			free(runs);
+			return -1;
 		}
 	}
 
+	free(runs);
+	return 0;
+}
+
+static int _alloc_loaded( const char * const fn, int arena, int mem_flags, esprom_handle * ph ) {
+
+	ef_file_t   ef_file = NULL;
+	sample_range_t * ranges = NULL;
+
+	if(!ph || !fn)
+		goto bad;
+
+	*ph = NULL;
+
+	if( _open_for_loading(fn, &ef_file) )
+		goto bad;
+
+	if((*ph = calloc(1, sizeof(prom_context_t) )) == NULL)
+		goto bad;
+
+	(*ph)->arena = arena;
+	(*ph)->mem_flags = mem_flags & ESPROM_MEM_HUGE_PAGES;
+
+	if((ranges = _read_sample_table(ef_file, &((*ph)->samples))) == NULL)
+		goto bad;
+
+	(*ph)->sample_headers = (sample_header_t *)calloc( (*ph)->samples, sizeof(sample_header_t));
+	if(!((*ph)->sample_headers))
+		goto bad;
+
+	if( _load_sample_ranges(*ph, ef_file, ranges) != 0 )
+		goto bad;
+
+	free(ranges);
+	ranges = NULL;
 	ef_file_close(ef_file);
+	ef_file = NULL;
+
+	if( (mem_flags & (ESPROM_MEM_LOCK | ESPROM_MEM_PREFAULT)) && (esprom_pin(*ph, mem_flags) != 0) ) {
+		// a whole prom by now - release it the way esprom_free does.
+		esprom_free(*ph);
+		*ph = NULL;
+		goto bad;
+	}
 
 	return 0;
 
 bad:
 
+	free(ranges);
+
 	if(ph) {
 		if(*ph) {
 			free( (*ph)->sample_headers );
-			free_chunks( (*ph)->mem_chunk_ctx.thiz );
+			mem_chunk_free( &(*ph)->mem_chunk_ctx );
 			free(*ph);
+			*ph = NULL;
 		}
 		if(ef_file)
 			ef_file_close(ef_file);
@@ -190,121 +513,2962 @@ bad:
 }
 
 // EXPORTED SYMBOL
-void esprom_free(esprom_handle ph) {
+int esprom_alloc( const char * const fn, esprom_handle * ph ) {
 
-	if(ph) {
-		free( ph->sample_headers );
-		free_chunks( ph->mem_chunk_ctx.base );
-		free(ph);
-	}
+	return _alloc_loaded( fn, 0, 0, ph );
 }
 
-struct esprom_sample_struct {
-
-	esprom_handle prom;
-	mem_chunk_ctx_t mem_chunk_ctx;
-	size_t start;
-	size_t end;
-
-};
-typedef struct esprom_sample_struct sample_t;
+// EXPORTED SYMBOL
+int esprom_alloc_arena( const char * const fn, esprom_handle * ph ) {
 
+	return _alloc_loaded( fn, 1, 0, ph );
+}
 
 // EXPORTED SYMBOL
-int esprom_sample_alloc( esprom_handle prom, int sample_id, esprom_sample_handle * sample ) {
+int esprom_alloc_arena_ex( const char * const fn, int flags, esprom_handle * ph ) {
 
-	if(!prom || !sample)
+	if( flags & ~(ESPROM_MEM_HUGE_PAGES | ESPROM_MEM_LOCK | ESPROM_MEM_PREFAULT) )
 		return -1;
 
-	if(sample_id >= prom->samples)
-		return -1;
+	return _alloc_loaded( fn, 1, flags, ph );
+}
 
-	if((*sample = calloc(1, sizeof(sample_t))) == NULL)
+// One worker's share of a parallel load - [mem_start, mem_end) of the proms memory.
+struct load_slice_struct {
+
+	prom_context_t * prom;
+	ef_file_t file;
+	const sample_run_t * runs;
+	int nruns;
+	size_t mem_start;
+	size_t mem_end;
+	int err;
+};
+typedef struct load_slice_struct load_slice_t;
+
+/*
+ * Load one slice. Whole, aligned pieces of chunks are gathered into one vectored read straight
+ *	into place ( runs are lined up with the file, so this is most of them ). Unaligned pieces are
+ *	read through a bounce buffer, allocated once per worker.
+ */
+static void * _load_slice_thread(void * arg) {
+
+	load_slice_t * slice = (load_slice_t *)arg;
+	mem_chunk_ctx_t ctx = slice->prom->mem_chunk_ctx;
+	uint8_t * bounce = NULL;
+	int r;
+
+	// an unaligned piece is at most a chunk, plus alignment either side.
+	if( posix_memalign((void **)&bounce, EF_ALIGNMENT, ALLOC_DATA_SIZE + 2 * EF_ALIGNMENT) != 0 ) {
+		bounce = NULL;
 		goto bad;
+	}
 
-	(*sample)->prom = prom;
+	for(r=0;r<slice->nruns;r++) {
 
-	// COPY THE PROM'S memory chunk context.
-	(*sample)->mem_chunk_ctx = prom->mem_chunk_ctx;
+		const sample_run_t * run = slice->runs + r;
+		size_t run_mem_end = run->mem_start + 1 + (run->end - run->start);
+		size_t pos = run->mem_start > slice->mem_start ? run->mem_start : slice->mem_start;
+		size_t end = run_mem_end < slice->mem_end ? run_mem_end : slice->mem_end;
 
-	// SEEK to this samples start address.
-	mem_chunk_seek(&(*sample)->mem_chunk_ctx, prom->sample_headers[sample_id].start ,SEEK_SET);
+		while( pos < end ) {
 
-	// OPTIMISATION: re-base this context for faster rewind's
-	(*sample)->mem_chunk_ctx.base    = (*sample)->mem_chunk_ctx.thiz;
-	(*sample)->mem_chunk_ctx.cur_pos = (*sample)->mem_chunk_ctx.thiz_offset;
+			struct iovec iov[PROM_LOAD_IOV];
+			off_t offset = run->start + (pos - run->mem_start);
+			size_t batch = 0;
+			int iovcnt = 0;
+			void * buffer;
+			size_t bufferlen;
+			size_t head;
+			size_t span;
 
-	// re-calculate size - actual sample size + previous samples at the start of this chunk.
-	(*sample)->mem_chunk_ctx.size    = 1 + (*sample)->mem_chunk_ctx.cur_pos
-			+ (prom->sample_headers[sample_id].end - prom->sample_headers[sample_id].start);
+			while( ((pos + batch) < end) && (iovcnt < PROM_LOAD_IOV) ) {
 
-	// re-calculate sample start / end.
-	(*sample)->start = (*sample)->mem_chunk_ctx.cur_pos;
-	(*sample)->end   = (*sample)->start
-			+ (prom->sample_headers[sample_id].end - prom->sample_headers[sample_id].start);
+				if( mem_chunk_seek(&ctx, pos + batch, SEEK_SET) != 0 )
+					goto bad;
 
-	return 0;
+				if( mem_chunk_getbuffer(&ctx, &buffer, &bufferlen) != 0 )
+					goto bad;
 
-bad:
+				if( bufferlen > (end - (pos + batch)) )
+					bufferlen = end - (pos + batch);
 
-	free(*sample);
+				bufferlen -= bufferlen % EF_ALIGNMENT;
 
-	return -1;
-}
+				if( !bufferlen || (((uintptr_t)buffer) % EF_ALIGNMENT) || ((offset + batch) % EF_ALIGNMENT) )
+					break;
 
-static int esprom_sample_seek( esprom_sample_handle sample, long offset, int whence ) {
+				iov[iovcnt].iov_base = buffer;
+				iov[iovcnt].iov_len  = bufferlen;
+				iovcnt++;
 
-	if(!sample)
-		return -1;
+				batch += bufferlen;
+			}
 
-	// adjust for previous samples data at head of memory chunk.
-	switch(whence) {
-	case SEEK_SET:
-		offset += sample->start;
-		break;
-	case SEEK_CUR:
-		break;
-	case SEEK_END:
-		break;
-	}
+			if( iovcnt ) {
 
-	return mem_chunk_seek(&sample->mem_chunk_ctx, offset, whence);
-}
+				if( ef_file_preadv_direct(slice->file, iov, iovcnt, offset) != (ssize_t)batch )
+					goto bad;
 
-// EXPORTED SYMBOL
-int esprom_sample_rewind( esprom_sample_handle sample ) {
+				pos += batch;
+				continue;
+			}
 
-	return esprom_sample_seek(sample, 0, SEEK_SET);
-}
+			// unaligned piece - bounce the aligned span around it.
+			if( mem_chunk_seek(&ctx, pos, SEEK_SET) != 0 )
+				goto bad;
 
-// EXPORTED SYMBOL
-int esprom_sample_getbuffer(esprom_sample_handle sample, void ** buffer, size_t * bufferlen ) {
+			if( mem_chunk_getbuffer(&ctx, &buffer, &bufferlen) != 0 )
+				goto bad;
 
-	int err;
+			if( bufferlen > (end - pos) )
+				bufferlen = end - pos;
 
-	*buffer = NULL;
-	*bufferlen = 0;
+			head = offset % EF_ALIGNMENT;
 
-	if(!sample)
-		return -1;
+			// memory lines up with the file - only bounce up to the next aligned offset.
+			if( head && ((((uintptr_t)buffer) % EF_ALIGNMENT) == head) && (bufferlen > (EF_ALIGNMENT - head)) )
+				bufferlen = EF_ALIGNMENT - head;
 
-	if((err = mem_chunk_getbuffer( &sample->mem_chunk_ctx, buffer, bufferlen)) == 0)
-	{
-		size_t size = 1 + (sample->end - sample->mem_chunk_ctx.cur_pos);
-		if( *bufferlen > size)
-			*bufferlen = size;
+			span  = head + bufferlen;
+			span += (EF_ALIGNMENT - (span % EF_ALIGNMENT)) % EF_ALIGNMENT;
 
-		err = esprom_sample_seek( sample, *bufferlen, SEEK_CUR );
+			if( ef_file_pread_direct(slice->file, bounce, span, offset - head) < (ssize_t)(head + bufferlen) )
+				goto bad;
+
+			memcpy(buffer, bounce + head, bufferlen);
+
+			pos += bufferlen;
+		}
 	}
 
-	return err;
+	free(bounce);
+	return NULL;
+
+bad:
+	free(bounce);
+	slice->err = -1;
+	return NULL;
 }
 
 // EXPORTED SYMBOL
-void esprom_sample_free( esprom_sample_handle sample ) {
+int esprom_alloc_parallel( const char * const fn, int threads, esprom_handle * ph ) {
+
+	ef_file_t ef_file = NULL;
+	sample_range_t * ranges = NULL;
+	sample_run_t * runs = NULL;
+	load_slice_t * slices = NULL;
+	pthread_t * tids = NULL;
+	int nruns = 0;
+	int started = 0;
+	int err = 0;
+	size_t per_thread;
+	int i;
+
+	if(!ph || !fn)
+		goto bad;
+
+	*ph = NULL;
+
+	if(threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if(threads <= 0)
+		threads = 1;
+
+	if( ef_file_open(&ef_file, NULL, fn, O_RDONLY, 0))
+		goto bad;
+
+	if((*ph = calloc(1, sizeof(prom_context_t) )) == NULL)
+		goto bad;
+
+	if((ranges = _read_sample_table(ef_file, &((*ph)->samples))) == NULL)
+		goto bad;
+
+	(*ph)->sample_headers = (sample_header_t *)calloc( (*ph)->samples, sizeof(sample_header_t));
+	if(!((*ph)->sample_headers))
+		goto bad;
+
+	if((runs = _plan_sample_runs(*ph, ranges, &nruns)) == NULL)
+		goto bad;
+
+	// split the memory into equal, chunk aligned slices.
+	per_thread  = ((*ph)->mem_chunk_ctx.size + threads - 1) / threads;
+	per_thread += ALLOC_DATA_SIZE - 1;
+	per_thread -= per_thread % ALLOC_DATA_SIZE;
+
+	if((slices = calloc(threads, sizeof(load_slice_t))) == NULL)
+		goto bad;
+	if((tids = calloc(threads, sizeof(pthread_t))) == NULL)
+		goto bad;
+
+	for(i=0;i<threads;i++) {
+
+		slices[i].prom      = *ph;
+		slices[i].file      = ef_file;
+		slices[i].runs      = runs;
+		slices[i].nruns     = nruns;
+		slices[i].mem_start = i * per_thread;
+		slices[i].mem_end   = slices[i].mem_start + per_thread;
+
+		if( slices[i].mem_start >= (*ph)->mem_chunk_ctx.size )
+			break;
+		if( slices[i].mem_end > (*ph)->mem_chunk_ctx.size )
+			slices[i].mem_end = (*ph)->mem_chunk_ctx.size;
+
+		if( pthread_create(tids + i, NULL, &_load_slice_thread, slices + i) != 0 ) {
+			err = -1;
+			break;
+		}
+		started++;
+	}
 
-	if(sample)
-		free(sample);
+	for(i=0;i<started;i++) {
+		pthread_join(tids[i], NULL);
+		err |= slices[i].err;
+	}
+
+	if(err)
+		goto bad;
+
+	free(tids);
+	free(slices);
+	free(runs);
+	free(ranges);
+	ef_file_close(ef_file);
+
+	return 0;
+
+bad:
+
+	free(tids);
+	free(slices);
+	free(runs);
+	free(ranges);
+
+	if(ph && *ph) {
+		esprom_free(*ph);
+		*ph = NULL;
+	}
+	if(ef_file)
+		ef_file_close(ef_file);
+
+	return -1;
+}
+
+// EXPORTED SYMBOL
+int esprom_alloc_mmap( const char * const fn, esprom_handle * ph ) {
+
+	int fd = -1;
+	struct stat _stat;
+	uint8_t * map = MAP_FAILED;
+
+	if(!ph || !fn)
+		goto bad;
+
+	*ph = NULL;
+
+	if((fd = open(fn, O_RDONLY)) == -1)
+		goto bad;
+
+	if(fstat(fd, &_stat) != 0)
+		goto bad;
+
+	if(_stat.st_size < 18)
+		goto bad; // too small to hold a prom header.
+
+	if((map = mmap(NULL, _stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+		goto bad;
+
+	// the mapping holds its own reference to the file.
+	close(fd);
+	fd = -1;
+
+	if((*ph = calloc(1, sizeof(prom_context_t) )) == NULL)
+		goto bad;
+
+	(*ph)->map = map;
+	(*ph)->map_size = _stat.st_size;
+
+	memcpy(&((*ph)->samples), map + 14, 2);
+
+	BE_TO_CPU_16_INPLACE((*ph)->samples);
+
+	if( (18 + 10 * (*ph)->samples) > (*ph)->map_size )
+		goto bad; // truncated sample table.
+
+	(*ph)->sample_headers = (sample_header_t *)calloc( (*ph)->samples, sizeof(sample_header_t));
+	if(!((*ph)->sample_headers))
+		goto bad;
+
+	{
+		// Samples are used in-place - just record where they live in the mapping.
+		int i;
+		for(i=0;i< (*ph)->samples; i++) {
+
+			int data[2];
+
+			memcpy(data, map + 18 + 10 * i, sizeof data);
+
+			BE_TO_CPU_32_INPLACE(data[0]);
+			BE_TO_CPU_32_INPLACE(data[1]);
+
+			if( (data[0] < 0) || (data[1] < data[0]) || (data[1] >= (*ph)->map_size) )
+				goto bad; // sample lies outside of the file.
+
+			(*ph)->sample_headers[i].start = data[0];
+			(*ph)->sample_headers[i].end   = data[1];
+		}
+	}
+
+	if( mem_chunk_init_flat( &(*ph)->mem_chunk_ctx, map, (*ph)->map_size ) != 0 )
+		goto bad;
+
+	return 0;
+
+bad:
+
+	if(ph && *ph) {
+		free( (*ph)->sample_headers );
+		free(*ph);
+		*ph = NULL;
+	}
+	if(map != MAP_FAILED)
+		munmap(map, _stat.st_size);
+	if(fd != -1)
+		close(fd);
+
+	return -1;
+}
+
+/*
+ * Compiled prom image ( esprom_compile / esprom_alloc_image ).
+ *	Native byte order, so loading is a mapping and some sanity checks:
+ *
+ *	[ header | sample table | pad | body | pad | body | pad ... ]
+ *
+ *	Table entries hold the first and last byte of each sample in the image,
+ *	and every body starts on an PROM_IMAGE_ALIGN boundary. Samples that overlap in the prom
+ *	( or alias each other ) are merged into one body, and point into it.
+ *	Exported images ( esprom_export ) may follow the table with an esprom_format_t byte per sample.
+ */
+#define PROM_IMAGE_MAGIC      "ESPROMIM"
+#define PROM_IMAGE_VERSION    1
+#define PROM_IMAGE_BYTE_ORDER 0x01020304
+#define PROM_IMAGE_ALIGN      4096
+#define PROM_IMAGE_COPY       (1024*1024) // compiler copy buffer.
+
+struct prom_image_header_struct {
+
+	char     magic[8];
+	uint32_t byte_order;   // PROM_IMAGE_BYTE_ORDER as the compiler wrote it.
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t samples;
+	uint32_t alignment;    // of the sample bodies.
+	uint32_t table_crc;    // header ( crcs zeroed ) and sample table.
+	uint32_t data_crc;     // everything from data_offset to the end.
+	uint32_t formats;      // 1 if a format byte per sample follows the table, else 0.
+	uint32_t reserved;     // 0 - keeps the 64 bit fields aligned without compiler padding.
+	uint64_t table_offset;
+	uint64_t data_offset;
+	uint64_t image_size;
+};
+typedef struct prom_image_header_struct prom_image_header_t;
+
+// no padding - the header is crc'd and mapped as it is.
+_Static_assert( sizeof(prom_image_header_t) == 72, "prom image header layout" );
+
+struct prom_image_sample_struct {
+
+	uint64_t start;
+	uint64_t end; // inclusive.
+};
+typedef struct prom_image_sample_struct prom_image_sample_t;
+
+static uint32_t _crc32_table[256];
+static pthread_once_t _crc32_once = PTHREAD_ONCE_INIT;
+
+static void _crc32_init(void) {
+
+	uint32_t i, k;
+
+	for(i=0;i<256;i++) {
+		uint32_t c = i;
+		for(k=0;k<8;k++)
+			c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+		_crc32_table[i] = c;
+	}
+}
+
+static uint32_t _crc32(uint32_t crc, const void * data, size_t len) {
+
+	const uint8_t * p = (const uint8_t *)data;
+
+	pthread_once(&_crc32_once, &_crc32_init);
+
+	crc = ~crc;
+	while(len--)
+		crc = _crc32_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static uint32_t _image_table_crc(const prom_image_header_t * header, const prom_image_sample_t * table) {
+
+	prom_image_header_t h = *header;
+
+	h.table_crc = 0;
+	h.data_crc  = 0;
+
+	// the formats follow the table, so are covered by one crc with it.
+	return _crc32( _crc32( 0, &h, sizeof h ), table, (sizeof(prom_image_sample_t) + (h.formats ? 1 : 0)) * h.samples );
+}
+
+// Append to an image being compiled ( NULL 'data' writes zeros ).
+static int _image_write(ef_file_t out, const void * data, size_t len, uint32_t * crc) {
+
+	static const uint8_t zeros[PROM_IMAGE_ALIGN];
+
+	while(len) {
+
+		size_t n = len;
+
+		if(!data && n > sizeof zeros)
+			n = sizeof zeros;
+
+		if( ef_file_write( out, data ? data : zeros, n ) != (ssize_t)n )
+			return -1;
+
+		if(crc)
+			*crc = _crc32( *crc, data ? data : zeros, n );
+
+		if(data)
+			data = ((const uint8_t *)data) + n;
+		len -= n;
+	}
+	return 0;
+}
+
+static size_t _image_align(size_t offset, size_t align) {
+
+	return (offset + (align-1)) / align * align;
+}
+
+// EXPORTED SYMBOL
+int esprom_compile( const char * const prom_fn, const char * const image_fn ) {
+
+	ef_file_t in  = NULL;
+	ef_file_t out = NULL;
+	sample_range_t * ranges = NULL;
+	sample_run_t * runs = NULL;
+	prom_image_sample_t * table = NULL;
+	uint8_t * buffer = NULL;
+	prom_image_header_t header;
+	struct stat _stat;
+	short samples = 0;
+	size_t align = PROM_IMAGE_ALIGN;
+	size_t offset;
+	long page = sysconf(_SC_PAGESIZE);
+	uint32_t data_crc = 0;
+	int nruns;
+	int i;
+	int r;
+
+	if(!prom_fn || !image_fn)
+		goto bad;
+
+	if(stat(prom_fn, &_stat) != 0)
+		goto bad;
+
+	if(_open_for_loading(prom_fn, &in) != 0)
+		goto bad;
+
+	if((ranges = _read_sample_table(in, &samples)) == NULL)
+		goto bad;
+
+	if((table = calloc(samples, sizeof(prom_image_sample_t))) == NULL)
+		goto bad;
+
+	if((runs = calloc(samples, sizeof(sample_run_t))) == NULL)
+		goto bad;
+
+	if((buffer = malloc(PROM_IMAGE_COPY)) == NULL)
+		goto bad;
+
+	if((page > 0) && ((size_t)page > align))
+		align = page;
+
+	memset(&header, 0, sizeof header);
+	memcpy(header.magic, PROM_IMAGE_MAGIC, sizeof header.magic);
+	header.byte_order   = PROM_IMAGE_BYTE_ORDER;
+	header.version      = PROM_IMAGE_VERSION;
+	header.header_size  = sizeof header;
+	header.samples      = samples;
+	header.alignment    = align;
+	header.table_offset = sizeof header;
+	header.data_offset  = _image_align( header.table_offset + sizeof(prom_image_sample_t) * samples, align );
+
+	// lay the bodies out in file order, overlapping samples share one body.
+	nruns  = _merge_sample_ranges(ranges, samples, 0, runs);
+	offset = header.data_offset;
+	for(r=0;r<nruns;r++) {
+
+		if( runs[r].end >= _stat.st_size )
+			goto bad; // sample lies outside of the file.
+
+		runs[r].mem_start = offset;
+
+		for(i=runs[r].first;i<runs[r].last;i++) {
+			table[ ranges[i].id ].start = offset + (ranges[i].start - runs[r].start);
+			table[ ranges[i].id ].end   = offset + (ranges[i].end   - runs[r].start);
+		}
+
+		offset = _image_align( offset + (runs[r].end - runs[r].start) + 1, align );
+	}
+	header.image_size = offset;
+
+	if(ef_file_open(&out, NULL, image_fn, O_WRONLY | O_CREAT | O_TRUNC, 0644) != 0)
+		goto bad;
+
+	// header is written last, once the crcs are known.
+	if( _image_write( out, NULL, header.table_offset, NULL ) != 0 )
+		goto bad;
+	if( _image_write( out, table, sizeof(prom_image_sample_t) * samples, NULL ) != 0 )
+		goto bad;
+	if( _image_write( out, NULL, header.data_offset - (header.table_offset + sizeof(prom_image_sample_t) * samples), NULL ) != 0 )
+		goto bad;
+
+	for(r=0;r<nruns;r++) {
+
+		size_t pos = runs[r].start;
+		size_t len = runs[r].end - runs[r].start + 1;
+
+		offset = runs[r].mem_start;
+
+		while(len) {
+			size_t n = len < PROM_IMAGE_COPY ? len : PROM_IMAGE_COPY;
+
+			if( ef_file_pread( in, buffer, n, pos ) != (ssize_t)n )
+				goto bad;
+			if( _image_write( out, buffer, n, &data_crc ) != 0 )
+				goto bad;
+
+			pos += n;
+			len -= n;
+		}
+
+		len = runs[r].end - runs[r].start + 1;
+		if( _image_write( out, NULL, _image_align( offset + len, align ) - (offset + len), &data_crc ) != 0 )
+			goto bad;
+	}
+
+	header.data_crc  = data_crc;
+	header.table_crc = _image_table_crc( &header, table );
+
+	if( ef_file_seek( out, 0, SEEK_SET ) != 0 )
+		goto bad;
+	if( _image_write( out, &header, sizeof header, NULL ) != 0 )
+		goto bad;
+
+	if( ef_file_sync( out ) != 0 )
+		goto bad;
+
+	if( ef_file_close( out ) != 0 ) {
+		out = NULL;
+		unlink(image_fn);
+		goto bad;
+	}
+
+	ef_file_close( in );
+	free(ranges);
+	free(runs);
+	free(table);
+	free(buffer);
+
+	return 0;
+
+bad:
+	if(out) {
+		ef_file_close(out);
+		unlink(image_fn); // don't leave a half written image behind.
+	}
+	if(in)
+		ef_file_close(in);
+	free(ranges);
+	free(runs);
+	free(table);
+	free(buffer);
+
+	return -1;
+}
+
+// Map an image and use it in-place. The mapping holds its own reference to 'fd'.
+static int _map_image( int fd, int verify, esprom_handle * ph ) {
+
+	struct stat _stat;
+	uint8_t * map = MAP_FAILED;
+	const prom_image_header_t * header;
+	const prom_image_sample_t * table;
+	uint32_t i;
+
+	*ph = NULL;
+
+	if(fstat(fd, &_stat) != 0)
+		goto bad;
+
+	if(_stat.st_size < (off_t)sizeof(prom_image_header_t))
+		goto bad; // too small to hold an image header.
+
+	if((map = mmap(NULL, _stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+		goto bad;
+
+	header = (const prom_image_header_t *)map;
+
+	if( memcmp(header->magic, PROM_IMAGE_MAGIC, sizeof header->magic) != 0 )
+		goto bad;
+
+	if( (header->byte_order != PROM_IMAGE_BYTE_ORDER) || (header->version != PROM_IMAGE_VERSION) )
+		goto bad; // compiled for another machine, or another library.
+
+	if( (header->header_size != sizeof(prom_image_header_t)) || (header->image_size != (uint64_t)_stat.st_size) )
+		goto bad;
+
+	if( (header->samples == 0) || (header->samples > SHRT_MAX) || (header->formats > 1) || header->reserved )
+		goto bad;
+
+	// subtract rather than add, so offsets from a hostile image ( esprom_attach ) can't wrap.
+	if( (header->data_offset > header->image_size) ||
+		(header->table_offset < header->header_size) ||
+		(header->table_offset > header->data_offset) ||
+		((header->table_offset % sizeof(uint64_t)) != 0) ||
+		(((sizeof(prom_image_sample_t) + header->formats) * header->samples) > (header->data_offset - header->table_offset)) )
+		goto bad; // truncated sample table.
+
+	table = (const prom_image_sample_t *)(map + header->table_offset);
+
+	if( _image_table_crc( header, table ) != header->table_crc )
+		goto bad;
+
+	// the bodies are only checked on request - it means touching every page.
+	if( verify && (_crc32( 0, map + header->data_offset, header->image_size - header->data_offset ) != header->data_crc) )
+		goto bad;
+
+	if((*ph = calloc(1, sizeof(prom_context_t) )) == NULL)
+		goto bad;
+
+	(*ph)->map = map;
+	(*ph)->map_size = _stat.st_size;
+	(*ph)->samples = header->samples;
+
+	(*ph)->sample_headers = (sample_header_t *)calloc( (*ph)->samples, sizeof(sample_header_t));
+	if(!((*ph)->sample_headers))
+		goto bad;
+
+	for(i=0;i< header->samples; i++) {
+
+		if( (table[i].start < header->data_offset) || (table[i].end < table[i].start) || (table[i].end >= header->image_size) )
+			goto bad; // sample lies outside of the image.
+
+		(*ph)->sample_headers[i].start = table[i].start;
+		(*ph)->sample_headers[i].end   = table[i].end;
+	}
+
+	if( header->formats ) {
+
+		const uint8_t * formats = (const uint8_t *)(table + header->samples);
+
+		if(((*ph)->formats = calloc(header->samples, 1)) == NULL)
+			goto bad;
+
+		for(i=0;i< header->samples; i++) {
+
+			if( (formats[i] != ESPROM_FORMAT_NONE) && (esprom_format_bytes(formats[i]) == 0) )
+				goto bad; // not a format we know.
+
+			(*ph)->formats[i] = formats[i];
+		}
+	}
+
+	if( mem_chunk_init_flat( &(*ph)->mem_chunk_ctx, map, (*ph)->map_size ) != 0 )
+		goto bad;
+
+	return 0;
+
+bad:
+
+	if(*ph) {
+		free( (*ph)->sample_headers );
+		free( (*ph)->formats );
+		free(*ph);
+		*ph = NULL;
+	}
+	if(map != MAP_FAILED)
+		munmap(map, _stat.st_size);
+
+	return -1;
+}
+
+// EXPORTED SYMBOL
+int esprom_alloc_image( const char * const fn, int verify, esprom_handle * ph ) {
+
+	int fd;
+	int err;
+
+	if(!ph || !fn)
+		return -1;
+
+	*ph = NULL;
+
+	if((fd = open(fn, O_RDONLY)) == -1)
+		return -1;
+
+	err = _map_image( fd, verify, ph );
+
+	close(fd);
+
+	return err;
+}
+
+/*
+ * Proms shared by esprom_open, keyed on the files device, inode and modification time.
+ */
+static pthread_mutex_t _shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static prom_context_t * _shared_proms = NULL;
+
+// call with _shared_lock held.
+static prom_context_t * _shared_find(const struct stat * _stat) {
+
+	prom_context_t * prom;
+
+	for(prom = _shared_proms; prom; prom = prom->shared_next)
+		if( (prom->shared_dev == _stat->st_dev) &&
+			(prom->shared_ino == _stat->st_ino) &&
+			(prom->shared_mtime.tv_sec  == _stat->st_mtim.tv_sec) &&
+			(prom->shared_mtime.tv_nsec == _stat->st_mtim.tv_nsec) )
+			return prom;
+
+	return NULL;
+}
+
+// Drop a reference to a shared prom. Returns 1 if it was the last ( and the prom is unshared ).
+static int _shared_release(prom_context_t * prom) {
+
+	prom_context_t ** link;
+	int last;
+
+	pthread_mutex_lock(&_shared_lock);
+
+	if((last = (--prom->shared_refs == 0)))
+		for(link = &_shared_proms; *link; link = &(*link)->shared_next)
+			if(*link == prom) {
+				*link = prom->shared_next;
+				break;
+			}
+
+	pthread_mutex_unlock(&_shared_lock);
+
+	return last;
+}
+
+// Does a file start with an image header?
+static int _is_image(int fd) {
+
+	char magic[8];
+
+	return (pread(fd, magic, sizeof magic, 0) == sizeof magic) && (memcmp(magic, PROM_IMAGE_MAGIC, sizeof magic) == 0);
+}
+
+// EXPORTED SYMBOL
+int esprom_open( const char * const fn, esprom_handle * ph ) {
+
+	struct stat _stat;
+	prom_context_t * prom = NULL;
+	prom_context_t * found;
+	char path[32];
+	int fd;
+
+	if(!ph || !fn)
+		return -1;
+
+	*ph = NULL;
+
+	// key on the file that is actually loaded, not whatever the name refers to later.
+	if((fd = open(fn, O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+
+	if(fstat(fd, &_stat) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	pthread_mutex_lock(&_shared_lock);
+	if((found = _shared_find(&_stat)) != NULL)
+		found->shared_refs++;
+	pthread_mutex_unlock(&_shared_lock);
+
+	if(!found) {
+
+		// load without the lock, so other proms can be opened meanwhile.
+		//	esprom_alloc takes a name - reopen the same file through its descriptor.
+		snprintf(path, sizeof path, "/proc/self/fd/%d", fd);
+
+		if( (_is_image(fd) ? _map_image(fd, 0, &prom) : esprom_alloc(path, &prom)) != 0 ) {
+			close(fd);
+			return -1;
+		}
+
+		pthread_mutex_lock(&_shared_lock);
+
+		if((found = _shared_find(&_stat)) != NULL)
+			found->shared_refs++; // another thread got there first.
+		else {
+			prom->shared_refs  = 1;
+			prom->shared_dev   = _stat.st_dev;
+			prom->shared_ino   = _stat.st_ino;
+			prom->shared_mtime = _stat.st_mtim;
+			prom->shared_next  = _shared_proms;
+			_shared_proms = found = prom;
+		}
+
+		pthread_mutex_unlock(&_shared_lock);
+
+		if(found != prom)
+			esprom_free(prom);
+	}
+
+	close(fd);
+
+	*ph = found;
+
+	return 0;
+}
+
+// EXPORTED SYMBOL
+int esprom_export( esprom_handle prom, int * fd ) {
+
+	sample_range_t * ranges = NULL;
+	sample_run_t * runs = NULL;
+	prom_image_header_t * header;
+	prom_image_sample_t * table;
+	uint8_t * map = MAP_FAILED;
+	size_t align = PROM_IMAGE_ALIGN;
+	size_t data_offset;
+	size_t size;
+	long page = sysconf(_SC_PAGESIZE);
+	int nruns;
+	int i;
+	int r;
+
+	if(!prom || !fd)
+		return -1;
+
+	*fd = -1;
+
+	if( prom->streams )
+		return -1; // only the heads are in memory.
+
+	if((ranges = calloc(prom->samples, sizeof(sample_range_t))) == NULL)
+		goto bad;
+
+	if((runs = calloc(prom->samples, sizeof(sample_run_t))) == NULL)
+		goto bad;
+
+	for(i=0;i< prom->samples;i++) {
+
+		// samples of an async prom have to finish loading.
+		if( esprom_sample_wait(prom, i) != 0 )
+			goto bad;
+
+		ranges[i].start = prom->sample_headers[i].start;
+		ranges[i].end   = prom->sample_headers[i].end;
+		ranges[i].id    = i;
+	}
+
+	qsort(ranges, prom->samples, sizeof(sample_range_t), &_sample_range_cmp);
+
+	// the same layout as esprom_compile, from the proms memory instead of the file.
+	nruns = _merge_sample_ranges(ranges, prom->samples, 0, runs);
+
+	if((page > 0) && ((size_t)page > align))
+		align = page;
+
+	// formats go out with the samples, or converted samples would be misread by the attacher.
+	data_offset = _image_align( sizeof(prom_image_header_t) + (sizeof(prom_image_sample_t) + (prom->formats ? 1 : 0)) * prom->samples, align );
+
+	size = data_offset;
+	for(r=0;r<nruns;r++) {
+		runs[r].mem_start = size;
+		size = _image_align( size + (runs[r].end - runs[r].start) + 1, align );
+	}
+
+	if((*fd = memfd_create("esprom", MFD_CLOEXEC | MFD_ALLOW_SEALING)) == -1)
+		goto bad;
+
+	if( ftruncate(*fd, size) != 0 )
+		goto bad;
+
+	if((map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0)) == MAP_FAILED)
+		goto bad;
+
+	header = (prom_image_header_t *)map;
+	table  = (prom_image_sample_t *)(map + sizeof(prom_image_header_t));
+
+	memcpy(header->magic, PROM_IMAGE_MAGIC, sizeof header->magic);
+	header->byte_order   = PROM_IMAGE_BYTE_ORDER;
+	header->version      = PROM_IMAGE_VERSION;
+	header->header_size  = sizeof(prom_image_header_t);
+	header->samples      = prom->samples;
+	header->alignment    = align;
+	header->formats      = prom->formats ? 1 : 0;
+	header->table_offset = sizeof(prom_image_header_t);
+	header->data_offset  = data_offset;
+	header->image_size   = size;
+
+	if( prom->formats )
+		memcpy( table + prom->samples, prom->formats, prom->samples );
+
+	for(r=0;r<nruns;r++) {
+
+		size_t len = 1 + (runs[r].end - runs[r].start);
+
+		if( mem_chunk_pread( &prom->mem_chunk_ctx, runs[r].start, map + runs[r].mem_start, len ) != (ssize_t)len )
+			goto bad;
+
+		for(i=runs[r].first;i<runs[r].last;i++) {
+			table[ ranges[i].id ].start = runs[r].mem_start + (ranges[i].start - runs[r].start);
+			table[ ranges[i].id ].end   = runs[r].mem_start + (ranges[i].end   - runs[r].start);
+		}
+	}
+
+	header->data_crc  = _crc32( 0, map + data_offset, size - data_offset );
+	header->table_crc = _image_table_crc( header, table );
+
+	// the write seal needs every writable mapping gone.
+	munmap(map, size);
+	map = MAP_FAILED;
+
+	if( fcntl(*fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0 )
+		goto bad;
+
+	free(ranges);
+	free(runs);
+
+	return 0;
+
+bad:
+
+	if(map != MAP_FAILED)
+		munmap(map, size);
+	if(*fd != -1) {
+		close(*fd);
+		*fd = -1;
+	}
+	free(ranges);
+	free(runs);
+
+	return -1;
+}
+
+// EXPORTED SYMBOL
+int esprom_attach( int fd, esprom_handle * ph ) {
+
+	int seals;
+
+	if(!ph)
+		return -1;
+
+	*ph = NULL;
+
+	// only sealed images - the exporter can't change or truncate them under us.
+	if((seals = fcntl(fd, F_GET_SEALS)) == -1)
+		return -1;
+
+	if((seals & (F_SEAL_SHRINK | F_SEAL_WRITE)) != (F_SEAL_SHRINK | F_SEAL_WRITE))
+		return -1;
+
+	return _map_image( fd, 0, ph );
+}
+
+// EXPORTED SYMBOL
+int esprom_alloc_lazy( const char * const fn, size_t cache_bytes, esprom_handle * ph ) {
+
+	ef_file_t ef_file = NULL;
+	sample_range_t * ranges = NULL;
+	struct stat _stat;
+	int i;
+
+	if(!ph || !fn)
+		goto bad;
+
+	*ph = NULL;
+
+	if(stat(fn, &_stat) != 0)
+		goto bad;
+
+	if( ef_file_open(&ef_file, NULL, fn, O_RDONLY, 0))
+		goto bad;
+
+	if((*ph = calloc(1, sizeof(prom_context_t) )) == NULL)
+		goto bad;
+
+	// the prom owns the file from here on.
+	(*ph)->file = ef_file;
+
+	if((ranges = _read_sample_table(ef_file, &((*ph)->samples))) == NULL)
+		goto bad;
+
+	(*ph)->sample_headers = (sample_header_t *)calloc( (*ph)->samples, sizeof(sample_header_t));
+	if(!((*ph)->sample_headers))
+		goto bad;
+
+	// samples are addressed by their offset in the file.
+	for(i=0;i< (*ph)->samples; i++) {
+
+		if( ranges[i].end >= _stat.st_size )
+			goto bad; // sample lies outside of the file.
+
+		(*ph)->sample_headers[ ranges[i].id ].start = ranges[i].start;
+		(*ph)->sample_headers[ ranges[i].id ].end   = ranges[i].end;
+	}
+
+	if( chunk_cache_create(&(*ph)->cache, ef_file, _stat.st_size, ALLOC_DATA_SIZE, cache_bytes) != 0 )
+		goto bad;
+
+	mem_chunk_init_paged( &(*ph)->mem_chunk_ctx, chunk_cache_pager((*ph)->cache), ALLOC_DATA_SIZE, _stat.st_size );
+
+	free(ranges);
+
+	return 0;
+
+bad:
+
+	free(ranges);
+
+	if(ph && *ph) {
+		esprom_free(*ph);
+		*ph = NULL;
+	}
+	else if(ef_file)
+		ef_file_close(ef_file);
+
+	return -1;
+}
+
+/*
+ * State shared between an async prom and its loader thread.
+ *	The prom's memory is allocated and mapped before the thread starts,
+ *	the thread only fills it in, one run at a time.
+ */
+struct prom_loader_struct {
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+
+	ef_file_t file; // closed by the thread when it is done.
+
+	sample_range_t * ranges;
+	sample_run_t * runs;
+	int nruns;
+	int * run_of; // sample id -> run.
+
+	int * order;
+	int norder;
+
+	// per sample: 0 loading, 1 ready, -1 failed. Set with the lock held ( for waiters ),
+	//	but published with release ordering, so a sample seen ready needs no lock.
+	signed char * state;
+	unsigned char * loaded; // per run - runs listed in 'order' aren't loaded again.
+	int cancel;
+
+	esprom_ready_callback callback;
+	void * user;
+};
+
+static void _loader_destroy(prom_loader_t * loader) {
+
+	if(loader) {
+		if(loader->file)
+			ef_file_close(loader->file);
+		free(loader->ranges);
+		free(loader->runs);
+		free(loader->run_of);
+		free(loader->order);
+		free(loader->state);
+		free(loader->loaded);
+		pthread_cond_destroy(&loader->cond);
+		pthread_mutex_destroy(&loader->lock);
+		free(loader);
+	}
+}
+
+static void * _loader_thread(void * arg) {
+
+	prom_context_t * prom = (prom_context_t *)arg;
+	prom_loader_t * loader = prom->loader;
+	int i;
+
+	// requested samples first, then everything else in file order.
+	for(i=0;i< (loader->norder + loader->nruns); i++) {
+
+		int r = (i < loader->norder) ? loader->run_of[ loader->order[i] ] : (i - loader->norder);
+		signed char state;
+		int cancel;
+		int j;
+
+		if(loader->loaded[r])
+			continue;
+
+		pthread_mutex_lock(&loader->lock);
+		cancel = loader->cancel;
+		pthread_mutex_unlock(&loader->lock);
+
+		if(cancel)
+			state = -1;
+		else
+			state = (_load_sample_run(prom, loader->file, loader->runs + r) == 0) ? 1 : -1;
+
+		loader->loaded[r] = 1;
+
+		// publish - waiters may now read this runs memory.
+		pthread_mutex_lock(&loader->lock);
+		for(j=loader->runs[r].first;j<loader->runs[r].last;j++)
+			__atomic_store_n( loader->state + loader->ranges[j].id, state, __ATOMIC_RELEASE );
+		pthread_cond_broadcast(&loader->cond);
+		pthread_mutex_unlock(&loader->lock);
+
+		if(loader->callback && !cancel)
+			for(j=loader->runs[r].first;j<loader->runs[r].last;j++)
+				loader->callback(prom, loader->ranges[j].id, state, loader->user);
+	}
+
+	ef_file_close(loader->file);
+	loader->file = NULL;
+
+	return NULL;
+}
+
+// EXPORTED SYMBOL
+int esprom_alloc_async( const char * const fn, const int * order, int order_len,
+		esprom_ready_callback callback, void * user, esprom_handle * ph ) {
+
+	prom_loader_t * loader = NULL;
+	int i;
+
+	if(!ph || !fn)
+		goto bad;
+
+	*ph = NULL;
+
+	if((loader = calloc(1, sizeof(prom_loader_t))) == NULL)
+		goto bad;
+
+	if(pthread_mutex_init(&loader->lock, NULL) != 0) {
+		free(loader);
+		loader = NULL;
+		goto bad;
+	}
+	if(pthread_cond_init(&loader->cond, NULL) != 0) {
+		pthread_mutex_destroy(&loader->lock);
+		free(loader);
+		loader = NULL;
+		goto bad;
+	}
+
+	loader->callback = callback;
+	loader->user     = user;
+
+	if( _open_for_loading(fn, &loader->file) )
+		goto bad;
+
+	if((*ph = calloc(1, sizeof(prom_context_t) )) == NULL)
+		goto bad;
+
+	if((loader->ranges = _read_sample_table(loader->file, &((*ph)->samples))) == NULL)
+		goto bad;
+
+	(*ph)->sample_headers = (sample_header_t *)calloc( (*ph)->samples, sizeof(sample_header_t));
+	if(!((*ph)->sample_headers))
+		goto bad;
+
+	if((loader->runs = _plan_sample_runs(*ph, loader->ranges, &loader->nruns)) == NULL)
+		goto bad;
+
+	if((loader->run_of = calloc( (*ph)->samples, sizeof(int) )) == NULL)
+		goto bad;
+
+	if((loader->state = calloc( (*ph)->samples, 1 )) == NULL)
+		goto bad;
+
+	if((loader->loaded = calloc( loader->nruns ? loader->nruns : 1, 1 )) == NULL)
+		goto bad;
+
+	for(i=0;i<loader->nruns;i++) {
+		int j;
+		for(j=loader->runs[i].first;j<loader->runs[i].last;j++)
+			loader->run_of[ loader->ranges[j].id ] = i;
+	}
+
+	// keep the valid part of the callers priority list.
+	if(order && (order_len > 0)) {
+
+		if((loader->order = calloc( order_len, sizeof(int) )) == NULL)
+			goto bad;
+
+		for(i=0;i<order_len;i++)
+			if( (order[i] >= 0) && (order[i] < (*ph)->samples) )
+				loader->order[ loader->norder++ ] = order[i];
+	}
+
+	(*ph)->loader = loader;
+
+	if(pthread_create(&loader->thread, NULL, &_loader_thread, *ph) != 0) {
+		(*ph)->loader = NULL;
+		goto bad;
+	}
+
+	return 0;
+
+bad:
+
+	_loader_destroy(loader);
+
+	if(ph && *ph) {
+		esprom_free(*ph);
+		*ph = NULL;
+	}
+
+	return -1;
+}
+
+// EXPORTED SYMBOL
+int esprom_paged( esprom_handle prom ) {
+
+	if(!prom)
+		return -1;
+
+	return prom->cache ? 1 : 0;
+}
+
+// EXPORTED SYMBOL
+int esprom_sample_ready( esprom_handle prom, int sample_id ) {
+
+	int state;
+
+	if(!prom || (sample_id < 0) || (sample_id >= prom->samples))
+		return -1;
+
+	if(!prom->loader)
+		return 1;
+
+	state = __atomic_load_n( prom->loader->state + sample_id, __ATOMIC_ACQUIRE );
+
+	return state;
+}
+
+// EXPORTED SYMBOL
+int esprom_sample_wait( esprom_handle prom, int sample_id ) {
+
+	int state;
+
+	if(!prom || (sample_id < 0) || (sample_id >= prom->samples))
+		return -1;
+
+	if(!prom->loader)
+		return 0;
+
+	// loaded ( or failed ) samples don't touch the lock.
+	if((state = __atomic_load_n( prom->loader->state + sample_id, __ATOMIC_ACQUIRE )) != 0)
+		return state == 1 ? 0 : -1;
+
+	pthread_mutex_lock(&prom->loader->lock);
+	while((state = __atomic_load_n( prom->loader->state + sample_id, __ATOMIC_ACQUIRE )) == 0)
+		pthread_cond_wait(&prom->loader->cond, &prom->loader->lock);
+	pthread_mutex_unlock(&prom->loader->lock);
+
+	return state == 1 ? 0 : -1;
+}
+
+/*
+ * Memory a prom keeps its sample data in - the index ( or arena, or mapping ), compressed
+ * blocks and their decode buffers, and cache slots. Mappings of the file are read-only.
+ * Stream buffers belong to sample handles, so aren't included.
+ *	Each region is page aligned and a whole number of pages ( ALLOC_ARENA_ALIGNMENT ),
+ *	or lies inside a mapping, so locking one never locks ( or unlocks ) another allocation.
+ */
+struct mem_region_struct {
+
+	uint8_t * data;
+	size_t len;
+	int writable;
+};
+typedef struct mem_region_struct mem_region_t;
+
+typedef int (*mem_region_fn)(const mem_region_t * region, void * user);
+
+static int _for_each_region(prom_context_t * prom, mem_region_fn fn, void * user) {
+
+	const mem_chunk_ctx_t * ctx = &prom->mem_chunk_ctx;
+	mem_region_t region;
+	size_t i;
+	int err;
+
+	for(i=0;!ctx->pager && (i< ctx->nchunks);i++) {
+
+		// chunks, arenas and mappings all end on a page.
+		region.data     = ctx->chunks[i];
+		region.len      = (ctx->chunk_size + (ALLOC_ARENA_ALIGNMENT-1)) & ~((size_t)ALLOC_ARENA_ALIGNMENT-1);
+		region.writable = prom->map == NULL;
+
+		if((err = fn(&region, user)) != 0)
+			return err;
+	}
+
+	if( prom->adpcm ) {
+
+		region.data     = prom->adpcm;
+		region.len      = prom->adpcm_size;
+		region.writable = 1;
+
+		if((err = fn(&region, user)) != 0)
+			return err;
+	}
+
+	if( prom->decode_buffers ) {
+
+		region.data     = prom->decode_buffers;
+		region.len      = prom->decode_buffers_size;
+		region.writable = 1;
+
+		if((err = fn(&region, user)) != 0)
+			return err;
+	}
+
+	if( prom->cache ) {
+
+		region.data     = chunk_cache_memory( prom->cache, &region.len );
+		region.writable = 1;
+
+		if((err = fn(&region, user)) != 0)
+			return err;
+	}
+
+	return 0;
+}
+
+// The whole pages a region touches ( mlock and madvise need page aligned addresses ).
+static uint8_t * _region_pages(const mem_region_t * region, size_t * len) {
+
+	size_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t)region->data & ~(page-1);
+	uintptr_t end   = ((uintptr_t)region->data + region->len + (page-1)) & ~(page-1);
+
+	*len = end - start;
+
+	return (uint8_t *)start;
+}
+
+// The pages wholly inside a region - the ones it may lock. mlock isn't counted, so
+//	( on systems with pages larger than ALLOC_ARENA_ALIGNMENT ) a page shared with
+//	another allocation is left alone rather than unlocked under it later.
+static uint8_t * _region_own_pages(const mem_region_t * region, size_t * len) {
+
+	size_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = ((uintptr_t)region->data + (page-1)) & ~(page-1);
+	uintptr_t end   = ((uintptr_t)region->data + region->len) & ~(page-1);
+
+	*len = end > start ? end - start : 0;
+
+	return (uint8_t *)start;
+}
+
+static int _pin_region(const mem_region_t * region, void * user) {
+
+	int flags = *(int *)user;
+	size_t len;
+	uint8_t * pages = _region_pages(region, &len);
+
+	if(!region->len)
+		return 0;
+
+#ifdef MADV_HUGEPAGE
+	if( flags & ESPROM_MEM_HUGE_PAGES )
+		madvise(pages, len, MADV_HUGEPAGE); // best effort - transparent huge pages may be disabled.
+#endif
+
+	if( flags & ESPROM_MEM_LOCK ) {
+
+		size_t own;
+		uint8_t * own_pages = _region_own_pages(region, &own);
+
+		if( own && (mlock(own_pages, own) != 0) )
+			return -1;
+
+		if( own == len )
+			return 0; // mlock faulted every page in.
+	}
+
+	if( flags & ESPROM_MEM_PREFAULT ) {
+
+		size_t page = sysconf(_SC_PAGESIZE);
+		size_t i;
+
+#ifdef MADV_POPULATE_READ
+		// writable memory is faulted in for writing too, so a first write can't fault later ( eg, filling a cache slot ).
+		if( madvise(pages, len, region->writable ? MADV_POPULATE_WRITE : MADV_POPULATE_READ) == 0 )
+			return 0;
+#endif
+		// older kernels - read a byte from every page.
+		madvise(pages, len, MADV_WILLNEED);
+		for(i=0;i<len;i+=page)
+			(void)*(volatile uint8_t *)(pages + i);
+	}
+
+	return 0;
+}
+
+static int _unlock_region(const mem_region_t * region, void * user) {
+
+	size_t len;
+	uint8_t * pages = _region_own_pages(region, &len);
+
+	(void)user;
+
+	if(len)
+		munlock(pages, len);
+
+	return 0;
+}
+
+struct count_region_struct {
+
+	esprom_footprint_t * fp;
+	int locked;
+};
+
+static int _count_region(const mem_region_t * region, void * user) {
+
+	struct count_region_struct * count = (struct count_region_struct *)user;
+	esprom_footprint_t * fp = count->fp;
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t len;
+	uint8_t * pages = _region_pages(region, &len);
+	unsigned char vec[256];
+	size_t resident = 0;
+	size_t i;
+
+	fp->data_bytes += region->len;
+
+	if( count->locked ) {
+		size_t own;
+		_region_own_pages(region, &own);
+		fp->locked_bytes += own;
+	}
+
+	// pages at either end may be shared with a neighbouring region, so this is approximate.
+	for(i=0;i<len;i+=page*sizeof vec) {
+
+		size_t n = (len - i) < page*sizeof vec ? (len - i) : page*sizeof vec;
+		size_t j;
+
+		if( mincore(pages + i, n, vec) != 0 )
+			return -1;
+
+		for(j=0;j< n/page;j++)
+			if( vec[j] & 1 )
+				resident += page;
+	}
+
+	fp->resident_bytes += resident < region->len ? resident : region->len;
+
+	return 0;
+}
+
+// EXPORTED SYMBOL
+void esprom_free(esprom_handle ph) {
+
+	if(ph) {
+		if( ph->shared_refs && !_shared_release(ph) )
+			return; // still open elsewhere.
+		if( ph->loader ) {
+			// stop loading, the thread fails whatever is left.
+			pthread_mutex_lock(&ph->loader->lock);
+			ph->loader->cancel = 1;
+			pthread_mutex_unlock(&ph->loader->lock);
+			pthread_join(ph->loader->thread, NULL);
+			_loader_destroy(ph->loader);
+		}
+		if( ph->mem_flags & ESPROM_MEM_LOCK )
+			_for_each_region( ph, &_unlock_region, NULL ); // heap memory stays locked after free().
+		free( ph->sample_headers );
+		free( ph->formats );
+		mem_chunk_free( &ph->mem_chunk_ctx );
+		chunk_cache_destroy( ph->cache );
+		free( ph->adpcm );
+		_decode_pool_free( ph );
+		free( ph->streams );
+		ef_aio_destroy( ph->stream_aio ); // waits for stream reads in flight.
+		_stream_pool_free( ph );
+		if( ph->file )
+			ef_file_close( ph->file );
+		if( ph->map )
+			munmap( ph->map, ph->map_size );
+		free(ph);
+	}
+}
+
+// EXPORTED SYMBOL
+int esprom_set_sample_format( esprom_handle prom, int sample_id, esprom_format_t format ) {
+
+	if(!prom || (sample_id < 0) || (sample_id >= prom->samples) || (esprom_format_bytes(format) == 0))
+		return -1;
+
+	// other handles on a shared prom may be reading its formats.
+	if(prom->shared_refs)
+		return -1;
+
+	if(!prom->formats && ((prom->formats = calloc(prom->samples, 1)) == NULL))
+		return -1;
+
+	prom->formats[sample_id] = format;
+
+	return 0;
+}
+
+// EXPORTED SYMBOL
+int esprom_set_format( esprom_handle prom, esprom_format_t format ) {
+
+	int i;
+
+	for(i=0;prom && (i< prom->samples);i++)
+		if( esprom_set_sample_format( prom, i, format ) != 0 )
+			return -1;
+
+	return prom ? 0 : -1;
+}
+
+// EXPORTED SYMBOL
+esprom_format_t esprom_sample_format( esprom_handle prom, int sample_id ) {
+
+	if(!prom || !prom->formats || (sample_id < 0) || (sample_id >= prom->samples))
+		return ESPROM_FORMAT_NONE;
+
+	return (esprom_format_t)prom->formats[sample_id];
+}
+
+// Wait for everything to load, and the loader to finish with the memory.
+static int _finish_loading( prom_context_t * prom ) {
+
+	int i;
+
+	if( prom->loader ) {
+		for(i=0;i< prom->samples;i++)
+			if( esprom_sample_wait( prom, i ) != 0 )
+				return -1;
+		pthread_join(prom->loader->thread, NULL);
+		_loader_destroy(prom->loader);
+		prom->loader = NULL;
+	}
+
+	return 0;
+}
+
+// EXPORTED SYMBOL
+int esprom_convert_samples( esprom_handle prom, esprom_format_t format ) {
+
+	mem_chunk_ctx_t arena;
+	sample_header_t * headers = NULL;
+	uint8_t * raw = NULL;
+	size_t out_bytes = esprom_format_bytes(format);
+	size_t size = 0;
+	int i;
+
+	memset(&arena, 0, sizeof arena);
+
+	if(!prom || !prom->formats || prom->cache || prom->adpcm || prom->streams || prom->shared_refs || (prom->mem_flags & ESPROM_MEM_LOCK))
+		goto bad; // nothing to convert from, not resident, shared or pinned.
+
+	if((format != ESPROM_FORMAT_S16) && (format != ESPROM_FORMAT_F32))
+		goto bad;
+
+	if( _finish_loading( prom ) != 0 )
+		goto bad;
+
+	if((headers = calloc(prom->samples, sizeof(sample_header_t))) == NULL)
+		goto bad;
+
+	// arena layout, as esprom_alloc_arena.
+	for(i=0;i< prom->samples;i++) {
+
+		size_t in_bytes = esprom_format_bytes(prom->formats[i]);
+		size_t count;
+
+		if(!in_bytes)
+			goto bad; // format not set.
+
+		count = (1 + prom->sample_headers[i].end - prom->sample_headers[i].start) / in_bytes;
+		if(!count)
+			goto bad; // not even one whole sample.
+
+		size += (PROM_ARENA_ALIGN - (size % PROM_ARENA_ALIGN)) % PROM_ARENA_ALIGN;
+		headers[i].start = size;
+		headers[i].end   = size + count * out_bytes - 1;
+		size = headers[i].end + 1 + PROM_ARENA_GUARD;
+	}
+
+	if( ((prom->mem_flags & ESPROM_MEM_HUGE_PAGES)
+			? mem_chunk_alloc_arena_huge(&arena, size)
+			: mem_chunk_alloc_arena(&arena, size)) != 0 )
+		goto bad;
+
+	memset(arena.chunks[0], 0, size);
+
+	if( posix_memalign((void **)&raw, ALLOC_CHUNK_ALIGNMENT, ALLOC_DATA_SIZE) != 0 ) {
+		raw = NULL;
+		goto bad;
+	}
+
+	// convert a buffer at a time - the source may be chunked.
+	for(i=0;i< prom->samples;i++) {
+
+		size_t in_bytes = esprom_format_bytes(prom->formats[i]);
+		size_t count = (1 + headers[i].end - headers[i].start) / out_bytes;
+		size_t src = prom->sample_headers[i].start;
+		uint8_t * dst = arena.chunks[0] + headers[i].start;
+
+		while(count) {
+
+			size_t n = ALLOC_DATA_SIZE / in_bytes;
+			if(n > count)
+				n = count;
+
+			if( mem_chunk_pread(&prom->mem_chunk_ctx, src, raw, n * in_bytes) != (ssize_t)(n * in_bytes) )
+				goto bad;
+
+			if( esprom_convert(dst, format, raw, prom->formats[i], n) != 0 )
+				goto bad;
+
+			src   += n * in_bytes;
+			dst   += n * out_bytes;
+			count -= n;
+		}
+	}
+
+	// swap the converted samples in.
+	mem_chunk_free( &prom->mem_chunk_ctx );
+	if( prom->map ) {
+		munmap( prom->map, prom->map_size );
+		prom->map = NULL;
+	}
+
+	prom->mem_chunk_ctx = arena;
+	prom->arena = 1;
+
+	free( prom->sample_headers );
+	prom->sample_headers = headers;
+
+	memset( prom->formats, format, prom->samples );
+
+	free(raw);
+	return 0;
+
+bad:
+	free(raw);
+	free(headers);
+	mem_chunk_free(&arena);
+	return -1;
+}
+
+// decoded bytes per compressed block.
+#define PROM_ADPCM_CHUNK (ADPCM_BLOCK_FRAMES * sizeof(int16_t))
+
+// Do two sorted ranges hold the same data?
+static int _same_sample( const prom_context_t * prom, const sample_range_t * a, const sample_range_t * b ) {
+
+	return (a->start == b->start) && (a->end == b->end) && (prom->formats[a->id] == prom->formats[b->id]);
+}
+
+// EXPORTED SYMBOL
+int esprom_compress_samples( esprom_handle prom, int handles ) {
+
+	sample_header_t * headers = NULL;
+	sample_range_t * ranges = NULL;
+	uint8_t * blocks = NULL;
+	uint8_t * raw = NULL;
+	int16_t * pcm = NULL;
+	size_t nblocks = 0;
+	size_t adpcm_size;
+	int i;
+
+	if(!prom || !prom->formats || prom->cache || prom->adpcm || prom->streams || prom->shared_refs || (prom->mem_flags & ESPROM_MEM_LOCK))
+		goto bad; // nothing to convert from, not resident, shared or pinned.
+
+	if(handles <= 0)
+		goto bad;
+
+	if( _finish_loading( prom ) != 0 )
+		goto bad;
+
+	if((headers = calloc(prom->samples, sizeof(sample_header_t))) == NULL)
+		goto bad;
+
+	if((ranges = calloc(prom->samples, sizeof(sample_range_t))) == NULL)
+		goto bad;
+
+	for(i=0;i< prom->samples;i++) {
+
+		size_t in_bytes = esprom_format_bytes(prom->formats[i]);
+
+		if(!in_bytes)
+			goto bad; // format not set.
+
+		if( (1 + prom->sample_headers[i].end - prom->sample_headers[i].start) < in_bytes )
+			goto bad; // not even one whole sample.
+
+		ranges[i].start = prom->sample_headers[i].start;
+		ranges[i].end   = prom->sample_headers[i].end;
+		ranges[i].id    = i;
+	}
+
+	qsort(ranges, prom->samples, sizeof(sample_range_t), &_sample_range_cmp);
+
+	// every sample starts on a block, aliased samples share their blocks.
+	for(i=0;i< prom->samples;i++) {
+
+		const sample_range_t * r = ranges + i;
+		size_t count = (1 + r->end - r->start) / esprom_format_bytes(prom->formats[r->id]);
+
+		if( i && _same_sample(prom, r, r - 1) ) {
+			headers[r->id] = headers[(r - 1)->id];
+			continue;
+		}
+
+		headers[r->id].start = nblocks * PROM_ADPCM_CHUNK;
+		headers[r->id].end   = headers[r->id].start + count * sizeof(int16_t) - 1;
+
+		nblocks += (count + ADPCM_BLOCK_FRAMES - 1) / ADPCM_BLOCK_FRAMES;
+	}
+
+	// whole pages, so esprom_pin can lock them exactly.
+	adpcm_size = (nblocks * ADPCM_BLOCK_BYTES + (ALLOC_ARENA_ALIGNMENT-1)) & ~((size_t)ALLOC_ARENA_ALIGNMENT-1);
+
+	if(posix_memalign((void **)&blocks, ALLOC_ARENA_ALIGNMENT, adpcm_size ? adpcm_size : ALLOC_ARENA_ALIGNMENT) != 0) {
+		blocks = NULL;
+		goto bad;
+	}
+
+	if((raw = malloc(ADPCM_BLOCK_FRAMES * sizeof(float))) == NULL)
+		goto bad;
+
+	if((pcm = malloc(ADPCM_BLOCK_FRAMES * sizeof(int16_t))) == NULL)
+		goto bad;
+
+	// convert to s16 and encode a block at a time - the source may be chunked.
+	for(i=0;i< prom->samples;i++) {
+
+		const sample_range_t * r = ranges + i;
+		esprom_format_t format = prom->formats[r->id];
+		size_t in_bytes = esprom_format_bytes(format);
+		size_t count = (1 + headers[r->id].end - headers[r->id].start) / sizeof(int16_t);
+		size_t src = r->start;
+		uint8_t * dst = blocks + (headers[r->id].start / PROM_ADPCM_CHUNK) * ADPCM_BLOCK_BYTES;
+		int index = 0;
+
+		if( i && _same_sample(prom, r, r - 1) )
+			continue;
+
+		while(count) {
+
+			size_t n = count < ADPCM_BLOCK_FRAMES ? count : ADPCM_BLOCK_FRAMES;
+
+			if( mem_chunk_pread(&prom->mem_chunk_ctx, src, raw, n * in_bytes) != (ssize_t)(n * in_bytes) )
+				goto bad;
+
+			if( esprom_convert(pcm, ESPROM_FORMAT_S16, raw, format, n) != 0 )
+				goto bad;
+
+			adpcm_encode_block(dst, pcm, n, &index);
+
+			src   += n * in_bytes;
+			dst   += ADPCM_BLOCK_BYTES;
+			count -= n;
+		}
+	}
+
+	if( _decode_pool_alloc(prom, handles) != 0 )
+		goto bad;
+
+	// swap the compressed samples in.
+	mem_chunk_free( &prom->mem_chunk_ctx );
+	if( prom->map ) {
+		munmap( prom->map, prom->map_size );
+		prom->map = NULL;
+	}
+
+	mem_chunk_init_paged( &prom->mem_chunk_ctx, &prom->decode_pager, PROM_ADPCM_CHUNK, nblocks * PROM_ADPCM_CHUNK );
+	prom->adpcm = blocks;
+	prom->adpcm_size = adpcm_size;
+	prom->arena = 0;
+
+	free( prom->sample_headers );
+	prom->sample_headers = headers;
+
+	memset( prom->formats, ESPROM_FORMAT_S16, prom->samples );
+
+	free(ranges);
+	free(raw);
+	free(pcm);
+	return 0;
+
+bad:
+	free(headers);
+	free(ranges);
+	free(blocks);
+	free(raw);
+	free(pcm);
+	return -1;
+}
+
+/*
+ * Lock-free free list of indices, for handing out preallocated objects without a lock
+ *	( sample pools, stream buffers ). 'head' holds index + 1 ( 0 when empty ) in its low
+ *	32 bits, and a generation in the high bits, so a stale pop can't succeed ( ABA ).
+ *	'next' links each index to the one below it, also as index + 1.
+ */
+#define POOL_INDEX(head) ((uint32_t)((head) & 0xffffffff))
+#define POOL_GEN(head)   ((head) >> 32)
+
+static void _free_list_init( uint64_t * head, uint32_t * next, uint32_t size ) {
+
+	uint32_t i;
+
+	for(i=0;i<size;i++)
+		next[i] = (i+1 < size) ? (i+2) : 0;
+
+	*head = size ? 1 : 0;
+}
+
+// Returns a free index, or -1 if there are none.
+static long _free_list_pop( uint64_t * head, uint32_t * next ) {
+
+	uint64_t h;
+	uint32_t index;
+
+	do {
+		h = __atomic_load_n( head, __ATOMIC_ACQUIRE );
+		if((index = POOL_INDEX(h)) == 0)
+			return -1; // exhausted.
+		// may be stale if another thread got here first - then the generation has moved on, and the swap fails.
+	} while( !__sync_bool_compare_and_swap( head, h,
+			((POOL_GEN(h) + 1) << 32) | __atomic_load_n( &next[index - 1], __ATOMIC_RELAXED ) ) );
+
+	return index - 1;
+}
+
+static void _free_list_push( uint64_t * head, uint32_t * next, uint32_t index ) {
+
+	uint64_t h;
+
+	do {
+		h = __atomic_load_n( head, __ATOMIC_ACQUIRE );
+		__atomic_store_n( &next[index], POOL_INDEX(h), __ATOMIC_RELAXED );
+	} while( !__sync_bool_compare_and_swap( head, h, ((POOL_GEN(h) + 1) << 32) | (index + 1) ) );
+}
+
+/*
+ * Compressed samples ( esprom_compress_samples ).
+ *	Every handle decodes into buffers of its own, taken from the prom, so playback
+ *	shares nothing with other threads but the ( read-only ) compressed blocks.
+ */
+
+#define DECODE_NO_BLOCK ((size_t)-1)
+
+struct prom_decoder {
+
+	mem_chunk_pager_t pager; // MUST BE FIRST.
+
+	prom_context_t * prom;
+
+	// the last two blocks decoded - a read ( or esprom_sample_map_frames ) may span two.
+	size_t block[2];
+	uint8_t * buffer[2];
+	int last; // buffer of the block faulted last.
+};
+typedef struct prom_decoder prom_decoder_t;
+
+// mem_chunk pager - decode a block into the handles buffers, unless it's already there.
+static uint8_t * _decode_fault(mem_chunk_pager_t * pager, size_t chunk) {
+
+	prom_decoder_t * decoder = (prom_decoder_t *)pager;
+	prom_context_t * prom = decoder->prom;
+	int other = !decoder->last;
+
+	if( chunk >= prom->mem_chunk_ctx.nchunks )
+		return NULL;
+
+	if( decoder->block[decoder->last] == chunk )
+		return decoder->buffer[decoder->last];
+
+	// keep the block faulted last, a read may still be using it.
+	if( decoder->block[other] != chunk ) {
+		adpcm_decode_block( (int16_t *)decoder->buffer[other], prom->adpcm + chunk * ADPCM_BLOCK_BYTES );
+		decoder->block[other] = chunk;
+	}
+
+	decoder->last = other;
+
+	return decoder->buffer[other];
+}
+
+// the proms own pager has no buffers to hand out, it only copies ( see _decode_read ).
+static uint8_t * _decode_no_fault(mem_chunk_pager_t * pager, size_t chunk) {
+
+	return NULL;
+}
+
+// mem_chunk pager copy for the prom itself - decodes on the stack, so any number of threads may share it.
+static int _decode_read(mem_chunk_pager_t * pager, size_t chunk, size_t offset, void * dst, size_t count) {
+
+	prom_context_t * prom = (prom_context_t *)(((uint8_t *)pager) - offsetof(prom_context_t, decode_pager));
+	int16_t pcm[ADPCM_BLOCK_FRAMES];
+
+	if( (chunk >= prom->mem_chunk_ctx.nchunks) || (offset + count > PROM_ADPCM_CHUNK) )
+		return -1;
+
+	adpcm_decode_block( pcm, prom->adpcm + chunk * ADPCM_BLOCK_BYTES );
+
+	memcpy( dst, ((uint8_t *)pcm) + offset, count );
+
+	return 0;
+}
+
+// Give a handles decode buffers back to its prom.
+static void _decoder_destroy(prom_decoder_t * decoder) {
+
+	if(decoder)
+		_free_list_push( &decoder->prom->decode_head, decoder->prom->decode_next, (uint32_t)(decoder - decoder->prom->decode_pool) );
+}
+
+// Take decode buffers for a handle from its prom - no allocation. Fails if all are in use.
+static int _decoder_create(prom_context_t * prom, prom_decoder_t ** decoder) {
+
+	long index;
+
+	if((index = _free_list_pop( &prom->decode_head, prom->decode_next )) < 0)
+		return -1;
+
+	*decoder = prom->decode_pool + index;
+
+	(*decoder)->block[0] = DECODE_NO_BLOCK;
+	(*decoder)->block[1] = DECODE_NO_BLOCK;
+	(*decoder)->last     = 0;
+
+	return 0;
+}
+
+static void _decode_pool_free(prom_context_t * prom) {
+
+	free(prom->decode_pool);
+	free(prom->decode_buffers);
+	free(prom->decode_next);
+
+	prom->decode_pool         = NULL;
+	prom->decode_buffers      = NULL;
+	prom->decode_buffers_size = 0;
+	prom->decode_next         = NULL;
+	prom->decode_max          = 0;
+}
+
+// Decode buffers for 'max' handles on a compressed prom at once.
+static int _decode_pool_alloc(prom_context_t * prom, int max) {
+
+	int i;
+
+	if((prom->decode_pool = calloc(max, sizeof(prom_decoder_t))) == NULL)
+		goto bad;
+
+	if((prom->decode_next = calloc(max, sizeof(uint32_t))) == NULL)
+		goto bad;
+
+	// whole pages, so esprom_pin can lock them exactly.
+	prom->decode_buffers_size = (max * 2 * PROM_ADPCM_CHUNK + (ALLOC_ARENA_ALIGNMENT-1)) & ~((size_t)ALLOC_ARENA_ALIGNMENT-1);
+
+	if(posix_memalign((void **)&prom->decode_buffers, ALLOC_ARENA_ALIGNMENT, prom->decode_buffers_size) != 0) {
+		prom->decode_buffers = NULL;
+		goto bad;
+	}
+
+	for(i=0;i<max;i++) {
+
+		prom_decoder_t * decoder = prom->decode_pool + i;
+
+		decoder->pager.fault = &_decode_fault;
+		decoder->prom        = prom;
+		decoder->buffer[0]   = prom->decode_buffers + (i * 2 + 0) * PROM_ADPCM_CHUNK;
+		decoder->buffer[1]   = prom->decode_buffers + (i * 2 + 1) * PROM_ADPCM_CHUNK;
+	}
+
+	prom->decode_pager.fault = &_decode_no_fault;
+	prom->decode_pager.read  = &_decode_read;
+	prom->decode_max = max;
+
+	_free_list_init( &prom->decode_head, prom->decode_next, max );
+
+	return 0;
+
+bad:
+	_decode_pool_free(prom);
+	return -1;
+}
+
+/*
+ * Streamed samples ( esprom_alloc_streaming ).
+ *	The prom holds the head of each long sample, every handle reads the rest
+ *	from disk into a few buffers of its own, a little ahead of where it is.
+ */
+
+// bytes per stream buffer ( a multiple of EF_ALIGNMENT ).
+#define PROM_STREAM_CHUNK (32*1024)
+
+// buffers per handle - the chunk being read, the one before it ( so a read can
+//	span two ), and PROM_STREAM_AHEAD being filled in the background.
+#define PROM_STREAM_AHEAD 2
+#define PROM_STREAM_SLOTS (2 + PROM_STREAM_AHEAD)
+
+// background reads in flight, for all of a proms handles.
+#define PROM_STREAM_DEPTH 64
+
+#define STREAM_NO_CHUNK ((size_t)-1)
+
+struct prom_stream_info_struct {
+
+	size_t file_start; // where the sample starts in the file.
+	size_t len;        // bytes in the sample, 0 if it is resident.
+	size_t head_len;   // bytes held by the prom, a multiple of PROM_STREAM_CHUNK.
+};
+
+enum {
+	STREAM_SLOT_EMPTY = 0,
+	STREAM_SLOT_FILLING,
+	STREAM_SLOT_READY,
+	STREAM_SLOT_FAILED,
+};
+
+struct stream_slot {
+
+	struct prom_stream * stream;
+	uint8_t * buffer;
+	size_t chunk; // or STREAM_NO_CHUNK.
+	size_t skew;  // where the chunk starts in 'buffer' - reads are aligned.
+	int state;
+};
+
+struct prom_stream {
+
+	mem_chunk_pager_t pager; // MUST BE FIRST.
+
+	prom_context_t * prom;
+	const prom_stream_info_t * info;
+	const uint8_t * head;
+	size_t nchunks;
+
+	// slots are refilled by the handles thread, and completed by ef_aio's.
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int inflight;
+
+	struct stream_slot slots[PROM_STREAM_SLOTS];
+};
+typedef struct prom_stream prom_stream_t;
+
+static size_t _stream_chunk_bytes(const prom_stream_info_t * info, size_t chunk) {
+
+	size_t left = info->len - chunk * PROM_STREAM_CHUNK;
+
+	return left < PROM_STREAM_CHUNK ? left : PROM_STREAM_CHUNK;
+}
+
+static void _stream_done(void * user, ssize_t result) {
+
+	struct stream_slot * slot = (struct stream_slot *)user;
+	prom_stream_t * stream = slot->stream;
+
+	pthread_mutex_lock(&stream->lock);
+
+	slot->state = (result >= (ssize_t)(slot->skew + _stream_chunk_bytes(stream->info, slot->chunk))) ?
+		STREAM_SLOT_READY : STREAM_SLOT_FAILED;
+
+	stream->inflight--;
+	pthread_cond_broadcast(&stream->cond);
+	pthread_mutex_unlock(&stream->lock);
+}
+
+// call with stream->lock held.
+static struct stream_slot * _stream_find(prom_stream_t * stream, size_t chunk) {
+
+	int i;
+
+	for(i=0;i<PROM_STREAM_SLOTS;i++)
+		if( (stream->slots[i].chunk == chunk) &&
+			((stream->slots[i].state == STREAM_SLOT_FILLING) || (stream->slots[i].state == STREAM_SLOT_READY)) )
+			return stream->slots + i;
+
+	return NULL;
+}
+
+// A slot that isn't being read, and doesn't hold a chunk in [keep_lo, keep_hi]. Call with stream->lock held.
+static struct stream_slot * _stream_victim(prom_stream_t * stream, size_t keep_lo, size_t keep_hi) {
+
+	int i;
+
+	for(i=0;i<PROM_STREAM_SLOTS;i++) {
+
+		struct stream_slot * slot = stream->slots + i;
+
+		if( slot->state == STREAM_SLOT_FILLING )
+			continue;
+
+		if( (slot->state != STREAM_SLOT_READY) || (slot->chunk < keep_lo) || (slot->chunk > keep_hi) )
+			return slot;
+	}
+
+	return NULL;
+}
+
+/*
+ * Fill a slot with a chunk, in the background. If the read can't be queued, and 'wait',
+ *	read it here instead ( dropping the lock ), otherwise give up. Call with stream->lock held.
+ */
+static int _stream_fill(prom_stream_t * stream, struct stream_slot * slot, size_t chunk, int wait) {
+
+	size_t bytes   = _stream_chunk_bytes(stream->info, chunk);
+	off_t  offset  = stream->info->file_start + chunk * PROM_STREAM_CHUNK;
+	off_t  aligned = offset - (offset % EF_ALIGNMENT);
+	size_t count   = (offset - aligned) + bytes;
+	int ok;
+
+	count += (EF_ALIGNMENT - (count % EF_ALIGNMENT)) % EF_ALIGNMENT;
+
+	slot->chunk = chunk;
+	slot->skew  = offset - aligned;
+	slot->state = STREAM_SLOT_FILLING;
+
+	if( ef_file_aio_read( stream->prom->file, stream->prom->stream_aio, slot->buffer, count, aligned, &_stream_done, slot ) == 0 ) {
+		stream->inflight++;
+		return 0;
+	}
+
+	if( !wait ) {
+		slot->state = STREAM_SLOT_EMPTY;
+		slot->chunk = STREAM_NO_CHUNK;
+		return -1;
+	}
+
+	// nobody else touches a filling slot. Read it just as the background read would have.
+	pthread_mutex_unlock(&stream->lock);
+	ok = ef_file_pread_direct( stream->prom->file, slot->buffer, count, aligned ) >= (ssize_t)(slot->skew + bytes);
+	pthread_mutex_lock(&stream->lock);
+
+	slot->state = ok ? STREAM_SLOT_READY : STREAM_SLOT_FAILED;
+
+	return 0;
+}
+
+// Start reading the chunks after 'chunk' that aren't resident or on their way. Call with stream->lock held.
+static void _stream_ahead(prom_stream_t * stream, size_t chunk) {
+
+	size_t keep_lo = chunk ? chunk - 1 : 0;
+	size_t c;
+
+	for(c = chunk + 1; (c <= chunk + PROM_STREAM_AHEAD) && (c < stream->nchunks); c++) {
+
+		struct stream_slot * slot;
+
+		if( (c * PROM_STREAM_CHUNK < stream->info->head_len) || _stream_find(stream, c) )
+			continue;
+
+		if( ((slot = _stream_victim(stream, keep_lo, chunk + PROM_STREAM_AHEAD)) == NULL) ||
+			(_stream_fill(stream, slot, c, 0) != 0) )
+			break; // out of buffers, or the queue is full - try again on the next chunk.
+	}
+}
+
+// mem_chunk pager - the head from the prom, the rest from the handles buffers.
+static uint8_t * _stream_fault(mem_chunk_pager_t * pager, size_t chunk) {
+
+	prom_stream_t * stream = (prom_stream_t *)pager;
+	struct stream_slot * slot;
+	uint8_t * data = NULL;
+
+	if( chunk >= stream->nchunks )
+		return NULL;
+
+	pthread_mutex_lock(&stream->lock);
+
+	if( chunk * PROM_STREAM_CHUNK < stream->info->head_len )
+		data = (uint8_t *)stream->head + chunk * PROM_STREAM_CHUNK;
+
+	else {
+
+		for(;;) {
+
+			if( (slot = _stream_find(stream, chunk)) == NULL ) {
+
+				// missed ( after a seek, or an underrun ) - every buffer may be busy.
+				if( (slot = _stream_victim(stream, chunk ? chunk - 1 : 0, chunk + PROM_STREAM_AHEAD)) == NULL ) {
+					pthread_cond_wait(&stream->cond, &stream->lock);
+					continue;
+				}
+
+				_stream_fill(stream, slot, chunk, 1);
+			}
+
+			if( slot->state != STREAM_SLOT_FILLING )
+				break;
+
+			pthread_cond_wait(&stream->cond, &stream->lock);
+		}
+
+		if( slot->state == STREAM_SLOT_READY )
+			data = slot->buffer + slot->skew;
+	}
+
+	_stream_ahead(stream, chunk);
+
+	pthread_mutex_unlock(&stream->lock);
+
+	return data;
+}
+
+// Give a handles buffers back to its prom.
+static void _stream_destroy(prom_stream_t * stream) {
+
+	if(stream) {
+
+		prom_context_t * prom = stream->prom;
+
+		// background reads land in our buffers.
+		pthread_mutex_lock(&stream->lock);
+		while( stream->inflight )
+			pthread_cond_wait(&stream->cond, &stream->lock);
+		pthread_mutex_unlock(&stream->lock);
+
+		_free_list_push( &prom->stream_head, prom->stream_next, (uint32_t)(stream - prom->stream_pool) );
+	}
+}
+
+// Take buffers for a handle on a streamed sample from its prom - no allocation. Fails if all are in use.
+static int _stream_create(prom_context_t * prom, int sample_id, prom_stream_t ** stream) {
+
+	long index;
+	int i;
+
+	if((index = _free_list_pop( &prom->stream_head, prom->stream_next )) < 0)
+		return -1;
+
+	*stream = prom->stream_pool + index;
+
+	(*stream)->info    = prom->streams + sample_id;
+	(*stream)->head    = prom->mem_chunk_ctx.chunks[0] + prom->sample_headers[sample_id].start;
+	(*stream)->nchunks = ((*stream)->info->len + PROM_STREAM_CHUNK - 1) / PROM_STREAM_CHUNK;
+
+	// start on what follows the head now, so it's there when the head runs out.
+	pthread_mutex_lock(&(*stream)->lock);
+	for(i=0;i<PROM_STREAM_SLOTS;i++) {
+		(*stream)->slots[i].chunk = STREAM_NO_CHUNK;
+		(*stream)->slots[i].state = STREAM_SLOT_EMPTY;
+	}
+	_stream_ahead(*stream, ((*stream)->info->head_len / PROM_STREAM_CHUNK) - 1);
+	pthread_mutex_unlock(&(*stream)->lock);
+
+	return 0;
+}
+
+static void _stream_pool_free(prom_context_t * prom) {
+
+	int i;
+
+	for(i=0;prom->stream_pool && (i< prom->stream_max);i++) {
+		pthread_cond_destroy(&prom->stream_pool[i].cond);
+		pthread_mutex_destroy(&prom->stream_pool[i].lock);
+	}
+
+	free(prom->stream_pool);
+	free(prom->stream_buffers);
+	free(prom->stream_next);
+
+	prom->stream_pool    = NULL;
+	prom->stream_buffers = NULL;
+	prom->stream_next    = NULL;
+	prom->stream_max     = 0;
+}
+
+// Buffers ( and locks ) for 'max' handles on streamed samples at once.
+static int _stream_pool_alloc(prom_context_t * prom, int max) {
+
+	size_t slot_bytes = PROM_STREAM_CHUNK + EF_ALIGNMENT; // reads are aligned, so start up to EF_ALIGNMENT early.
+	int i, j;
+
+	if((prom->stream_pool = calloc(max, sizeof(prom_stream_t))) == NULL)
+		goto bad;
+
+	if((prom->stream_next = calloc(max, sizeof(uint32_t))) == NULL)
+		goto bad;
+
+	if(posix_memalign((void **)&prom->stream_buffers, EF_ALIGNMENT, max * PROM_STREAM_SLOTS * slot_bytes) != 0) {
+		prom->stream_buffers = NULL;
+		goto bad;
+	}
+
+	for(i=0;i<max;i++) {
+
+		prom_stream_t * stream = prom->stream_pool + i;
+
+		stream->pager.fault = &_stream_fault;
+		stream->prom        = prom;
+
+		if(pthread_mutex_init(&stream->lock, NULL) != 0)
+			goto bad;
+
+		if(pthread_cond_init(&stream->cond, NULL) != 0) {
+			pthread_mutex_destroy(&stream->lock);
+			goto bad;
+		}
+
+		prom->stream_max = i + 1;
+
+		for(j=0;j<PROM_STREAM_SLOTS;j++) {
+			stream->slots[j].stream = stream;
+			stream->slots[j].buffer = prom->stream_buffers + (i * PROM_STREAM_SLOTS + j) * slot_bytes;
+			stream->slots[j].chunk  = STREAM_NO_CHUNK;
+		}
+	}
+
+	_free_list_init( &prom->stream_head, prom->stream_next, max );
+
+	return 0;
+
+bad:
+	_stream_pool_free(prom);
+	return -1;
+}
+
+// EXPORTED SYMBOL
+int esprom_alloc_streaming( const char * const fn, size_t threshold, size_t head_bytes, int handles, esprom_handle * ph ) {
+
+	ef_file_t ef_file = NULL;
+	sample_range_t * ranges = NULL;
+	struct stat _stat;
+	size_t head_len;
+	int streamed = 0;
+	int i;
+
+	if(!ph || !fn || (handles <= 0))
+		goto bad;
+
+	*ph = NULL;
+
+	if( _open_for_loading(fn, &ef_file) )
+		goto bad;
+
+	if( stat(fn, &_stat) != 0 )
+		goto bad;
+
+	if((*ph = calloc(1, sizeof(prom_context_t) )) == NULL)
+		goto bad;
+
+	// heads are used in-place, so have to be contiguous.
+	(*ph)->arena = 1;
+
+	if((ranges = _read_sample_table(ef_file, &((*ph)->samples))) == NULL)
+		goto bad;
+
+	(*ph)->sample_headers = (sample_header_t *)calloc( (*ph)->samples, sizeof(sample_header_t));
+	if(!((*ph)->sample_headers))
+		goto bad;
+
+	if(((*ph)->streams = calloc( (*ph)->samples, sizeof(prom_stream_info_t))) == NULL)
+		goto bad;
+
+	// at least one chunk stays resident, for an instant start.
+	head_len  = head_bytes ? head_bytes : 1;
+	head_len += (PROM_STREAM_CHUNK - (head_len % PROM_STREAM_CHUNK)) % PROM_STREAM_CHUNK;
+
+	for(i=0;i< (*ph)->samples;i++) {
+
+		prom_stream_info_t * info = (*ph)->streams + ranges[i].id;
+		size_t len = 1 + (ranges[i].end - ranges[i].start);
+
+		if( (len <= threshold) || (len <= head_len) )
+			continue; // resident.
+
+		if( ranges[i].end >= (size_t)_stat.st_size )
+			goto bad; // sample lies outside of the file.
+
+		info->file_start = ranges[i].start;
+		info->len        = len;
+		info->head_len   = head_len;
+
+		// only load the head ( the ranges stay sorted on their start ).
+		ranges[i].end = ranges[i].start + head_len - 1;
+		streamed++;
+	}
+
+	if( _load_sample_ranges(*ph, ef_file, ranges) != 0 )
+		goto bad;
+
+	free(ranges);
+	ranges = NULL;
+
+	if( !streamed ) {
+		// everything fitted - an ordinary arena prom.
+		free((*ph)->streams);
+		(*ph)->streams = NULL;
+		ef_file_close(ef_file);
+		return 0;
+	}
+
+	if( _stream_pool_alloc(*ph, handles) != 0 )
+		goto bad;
+
+	if( ef_aio_create(&(*ph)->stream_aio, PROM_STREAM_DEPTH) != 0 )
+		goto bad;
+
+	// kept open for the streams.
+	(*ph)->file = ef_file;
+
+	return 0;
+
+bad:
+
+	free(ranges);
+
+	if(ph) {
+		if(*ph) {
+			_stream_pool_free( *ph );
+			free( (*ph)->sample_headers );
+			free( (*ph)->streams );
+			mem_chunk_free( &(*ph)->mem_chunk_ctx );
+			free(*ph);
+			*ph = NULL;
+		}
+	}
+	if(ef_file)
+		ef_file_close(ef_file);
+
+	return -1;
+}
+
+// EXPORTED SYMBOL
+int esprom_pin( esprom_handle prom, int flags ) {
+
+	int was_locked;
+
+	if(!prom || (flags & ~(ESPROM_MEM_HUGE_PAGES | ESPROM_MEM_LOCK | ESPROM_MEM_PREFAULT)))
+		return -1;
+
+	// the loader may still be filling the memory.
+	if( _finish_loading( prom ) != 0 )
+		return -1;
+
+	was_locked = prom->mem_flags & ESPROM_MEM_LOCK;
+
+	if( _for_each_region( prom, &_pin_region, &flags ) != 0 ) {
+		if( !was_locked && (flags & ESPROM_MEM_LOCK) )
+			_for_each_region( prom, &_unlock_region, NULL ); // don't leave it half locked.
+		return -1;
+	}
+
+	prom->mem_flags |= flags & ESPROM_MEM_LOCK;
+
+	return 0;
+}
+
+// EXPORTED SYMBOL
+int esprom_footprint( esprom_handle prom, esprom_footprint_t * fp ) {
+
+	sample_range_t * ranges = NULL;
+	sample_run_t * runs = NULL;
+	struct count_region_struct count;
+	int nranges = 0;
+	int nruns;
+	int i;
+
+	if(!prom || !fp)
+		return -1;
+
+	memset(fp, 0, sizeof *fp);
+
+	count.fp     = fp;
+	count.locked = prom->mem_flags & ESPROM_MEM_LOCK;
+
+	if( _for_each_region( prom, &_count_region, &count ) != 0 )
+		return -1;
+
+	if( prom->mem_chunk_ctx.flags & MEM_CHUNK_FLAG_HUGETLB )
+		fp->huge_pages = 2;
+	else if( prom->mem_chunk_ctx.flags & MEM_CHUNK_FLAG_HUGE )
+		fp->huge_pages = 1;
+
+	// what the samples refer to - aliased bytes once, streamed samples at their full length.
+	if((ranges = calloc(prom->samples ? prom->samples : 1, sizeof(sample_range_t))) == NULL)
+		return -1;
+
+	if((runs = calloc(prom->samples ? prom->samples : 1, sizeof(sample_run_t))) == NULL) {
+		free(ranges);
+		return -1;
+	}
+
+	for(i=0;i< prom->samples;i++) {
+
+		if( prom->streams && prom->streams[i].len ) {
+			fp->sample_bytes += prom->streams[i].len;
+			continue;
+		}
+
+		ranges[nranges].start = prom->sample_headers[i].start;
+		ranges[nranges].end   = prom->sample_headers[i].end;
+		ranges[nranges].id    = i;
+		nranges++;
+	}
+
+	qsort(ranges, nranges, sizeof(sample_range_t), &_sample_range_cmp);
+
+	nruns = _merge_sample_ranges(ranges, nranges, 0, runs);
+
+	for(i=0;i<nruns;i++)
+		fp->sample_bytes += 1 + runs[i].end - runs[i].start;
+
+	free(ranges);
+	free(runs);
+
+	return 0;
+}
+
+struct esprom_sample_struct {
+
+	esprom_handle prom;
+	mem_chunk_ctx_t mem_chunk_ctx;
+	size_t start;
+	size_t end;
+
+	// where the handle lives - see esprom_sample_free.
+	int storage;
+	esprom_sample_pool_t * pool;
+
+	// buffers of a streamed sample, or NULL.
+	prom_stream_t * stream;
+
+	// buffers of a compressed sample, or NULL.
+	prom_decoder_t * decoder;
+};
+typedef struct esprom_sample_struct sample_t;
+
+enum {
+	SAMPLE_STORAGE_HEAP = 0, // esprom_sample_alloc
+	SAMPLE_STORAGE_USER,     // esprom_sample_init
+	SAMPLE_STORAGE_POOL,     // esprom_sample_pool_get
+};
+
+// esprom_sample_storage_t has to be big enough to hold a sample.
+typedef char _sample_storage_check[ (sizeof(sample_t) <= sizeof(esprom_sample_storage_t)) ? 1 : -1 ];
+
+/*
+ * Point a sample at 'sample_id'. No allocation and no blocking - the prom's chunk index is
+ *	shared, and a seek only sets the cursor ( streamed and compressed samples take buffers
+ *	from their prom ).
+ */
+static int _sample_init( esprom_handle prom, int sample_id, sample_t * sample ) {
+
+	if((sample_id < 0) || (sample_id >= prom->samples))
+		return -1;
+
+	// samples of an async prom can't be used before they are loaded - fail rather than wait.
+	if( esprom_sample_ready(prom, sample_id) != 1 )
+		return -1;
+
+	sample->prom    = prom;
+	sample->stream  = NULL;
+	sample->decoder = NULL;
+
+	if( prom->streams && prom->streams[sample_id].len ) {
+
+		// read through the handles own buffers, addressed from the start of the sample.
+		if( _stream_create(prom, sample_id, &sample->stream) != 0 )
+			return -1;
+
+		mem_chunk_init_paged( &sample->mem_chunk_ctx, &sample->stream->pager, PROM_STREAM_CHUNK, prom->streams[sample_id].len );
+
+		sample->start = 0;
+		sample->end   = prom->streams[sample_id].len - 1;
+
+		return 0;
+	}
+
+	sample->start = prom->sample_headers[sample_id].start;
+	sample->end   = prom->sample_headers[sample_id].end;
+
+	if( prom->adpcm ) {
+
+		// decode through the handles own buffers, addressed like the prom.
+		if( _decoder_create(prom, &sample->decoder) != 0 )
+			return -1;
+
+		mem_chunk_init_paged( &sample->mem_chunk_ctx, &sample->decoder->pager, PROM_ADPCM_CHUNK, 1 + sample->end );
+
+		if( mem_chunk_seek(&sample->mem_chunk_ctx, sample->start ,SEEK_SET) != 0 ) {
+			_decoder_destroy(sample->decoder);
+			sample->decoder = NULL;
+			return -1;
+		}
+		return 0;
+	}
+
+	// COPY THE PROM'S memory chunk context ( shares its chunk index ).
+	sample->mem_chunk_ctx = prom->mem_chunk_ctx;
+
+	// truncate the context at the end of this sample.
+	sample->mem_chunk_ctx.size = 1 + sample->end;
+
+	// SEEK to this samples start address.
+	return mem_chunk_seek(&sample->mem_chunk_ctx, sample->start ,SEEK_SET);
+}
+
+// EXPORTED SYMBOL
+int esprom_sample_alloc( esprom_handle prom, int sample_id, esprom_sample_handle * sample ) {
+
+	if(!prom || !sample)
+		return -1;
+
+	// allocating isn't for the render thread anyway - wait for an async load.
+	if( esprom_sample_wait(prom, sample_id) != 0 )
+		return -1;
+
+	if((*sample = calloc(1, sizeof(sample_t))) == NULL)
+		goto bad;
+
+	if( _sample_init(prom, sample_id, *sample) != 0 )
+		goto bad;
+
+	(*sample)->storage = SAMPLE_STORAGE_HEAP;
+
+	return 0;
+
+bad:
+
+	free(*sample);
+	*sample = NULL;
+
+	return -1;
+}
+
+// EXPORTED SYMBOL
+int esprom_sample_init( esprom_handle prom, int sample_id, esprom_sample_storage_t * storage, esprom_sample_handle * sample ) {
+
+	if(!prom || !storage || !sample)
+		return -1;
+
+	*sample = (sample_t *)storage;
+
+	if( _sample_init(prom, sample_id, *sample) != 0 ) {
+		*sample = NULL;
+		return -1;
+	}
+
+	(*sample)->storage = SAMPLE_STORAGE_USER;
+	(*sample)->pool    = NULL;
+
+	return 0;
+}
+
+/*
+ * A fixed set of sample handles on a lock-free free list.
+ *	'head' packs a generation count ( against ABA ) above the index of the first free handle + 1.
+ */
+struct esprom_sample_pool_struct {
+
+	sample_t * samples;
+	uint32_t * next; // free list links, index + 1 ( 0 ends the list ).
+	uint64_t head;
+	int size;
+};
+
+// EXPORTED SYMBOL
+int esprom_sample_pool_alloc( esprom_sample_pool_t ** pool, int size ) {
+
+	int i;
+
+	if(!pool || (size <= 0))
+		return -1;
+
+	if((*pool = calloc(1, sizeof(esprom_sample_pool_t))) == NULL)
+		goto bad;
+
+	if(((*pool)->samples = calloc(size, sizeof(sample_t))) == NULL)
+		goto bad;
+
+	if(((*pool)->next = calloc(size, sizeof(uint32_t))) == NULL)
+		goto bad;
+
+	for(i=0;i<size;i++) {
+		(*pool)->samples[i].storage = SAMPLE_STORAGE_POOL;
+		(*pool)->samples[i].pool    = *pool;
+	}
+
+	_free_list_init( &(*pool)->head, (*pool)->next, size );
+	(*pool)->size = size;
+
+	return 0;
+
+bad:
+	if(pool && *pool) {
+		free((*pool)->samples);
+		free(*pool);
+		*pool = NULL;
+	}
+	return -1;
+}
+
+// EXPORTED SYMBOL
+void esprom_sample_pool_free( esprom_sample_pool_t * pool ) {
+
+	if(pool) {
+		free(pool->samples);
+		free(pool->next);
+		free(pool);
+	}
+}
+
+static void _pool_put( esprom_sample_pool_t * pool, sample_t * sample ) {
+
+	_free_list_push( &pool->head, pool->next, (uint32_t)(sample - pool->samples) );
+}
+
+// EXPORTED SYMBOL
+int esprom_sample_pool_get( esprom_sample_pool_t * pool, esprom_handle prom, int sample_id, esprom_sample_handle * sample ) {
+
+	long index;
+
+	if(!pool || !prom || !sample)
+		return -1;
+
+	*sample = NULL;
+
+	if((index = _free_list_pop( &pool->head, pool->next )) < 0)
+		return -1; // exhausted.
+
+	if( _sample_init(prom, sample_id, pool->samples + index) != 0 ) {
+		_pool_put(pool, pool->samples + index);
+		return -1;
+	}
+
+	*sample = pool->samples + index;
+
+	return 0;
+}
+
+// EXPORTED SYMBOL
+int esprom_sample_seek( esprom_sample_handle sample, long offset, int whence ) {
+
+	size_t abs;
+
+	if(!sample)
+		return -1;
+
+	// sample offsets are relative to the samples start address.
+	switch(whence) {
+	case SEEK_SET:
+		abs = sample->start + offset;
+		break;
+	case SEEK_CUR:
+		abs = sample->mem_chunk_ctx.cur_pos + offset;
+		break;
+	case SEEK_END:
+		abs = sample->end + 1 + offset;
+		break;
+	default:
+		return -1;
+	}
+
+	if( (abs < sample->start) || (abs > (sample->end + 1)) )
+		return -1; // outside of this sample.
+
+	return mem_chunk_seek(&sample->mem_chunk_ctx, abs, SEEK_SET);
+}
+
+// EXPORTED SYMBOL
+long esprom_sample_tell( esprom_sample_handle sample ) {
+
+	if(!sample)
+		return -1;
+
+	return sample->mem_chunk_ctx.cur_pos - sample->start;
+}
+
+// EXPORTED SYMBOL
+ssize_t esprom_sample_pread( esprom_sample_handle sample, size_t offset, void * dst, size_t len ) {
+
+	if(!sample || (!dst && len))
+		return -1;
+
+	if( offset > (sample->end - sample->start) )
+		return 0; // past end of sample.
+
+	return mem_chunk_pread(&sample->mem_chunk_ctx, sample->start + offset, dst, len);
+}
+
+// EXPORTED SYMBOL
+int esprom_sample_rewind( esprom_sample_handle sample ) {
+
+	return esprom_sample_seek(sample, 0, SEEK_SET);
+}
+
+// EXPORTED SYMBOL
+int esprom_sample_getbuffer(esprom_sample_handle sample, void ** buffer, size_t * bufferlen ) {
+
+	int err;
+
+	*buffer = NULL;
+	*bufferlen = 0;
+
+	if(!sample)
+		return -1;
+
+	if((err = mem_chunk_getbuffer( &sample->mem_chunk_ctx, buffer, bufferlen)) == 0)
+	{
+		size_t size = 1 + (sample->end - sample->mem_chunk_ctx.cur_pos);
+		if( *bufferlen > size)
+			*bufferlen = size;
+
+		err = esprom_sample_seek( sample, *bufferlen, SEEK_CUR );
+	}
+
+	return err;
+}
+
+// Whole frames left in a sample ( a trailing partial frame doesn't count ).
+static size_t _frames_left( esprom_sample_handle sample, size_t frame_bytes ) {
+
+	return ((sample->end + 1) - sample->mem_chunk_ctx.cur_pos) / frame_bytes;
+}
+
+// Move a samples cursor past 'frames' frames, or to its end if that's all there is.
+static int _skip_frames( esprom_sample_handle sample, size_t frames, size_t frame_bytes, size_t left ) {
+
+	if( frames < left )
+		return mem_chunk_seek( &sample->mem_chunk_ctx, frames * frame_bytes, SEEK_CUR );
+
+	// consumed the sample - skip any partial frame too.
+	return mem_chunk_seek( &sample->mem_chunk_ctx, sample->end + 1, SEEK_SET );
+}
+
+// EXPORTED SYMBOL
+ssize_t esprom_sample_read_frames( esprom_sample_handle sample, void * dst, size_t frames, size_t frame_bytes ) {
+
+	size_t left;
+	size_t got;
+
+	if(!sample || !frame_bytes || (!dst && frames))
+		return -1;
+
+	left = _frames_left( sample, frame_bytes );
+	got  = frames < left ? frames : left;
+
+	if( mem_chunk_pread( &sample->mem_chunk_ctx, sample->mem_chunk_ctx.cur_pos, dst, got * frame_bytes ) != (ssize_t)(got * frame_bytes) )
+		return -1;
+
+	// the rest of the period is silence.
+	memset( ((uint8_t *)dst) + got * frame_bytes, 0, (frames - got) * frame_bytes );
+
+	if( _skip_frames( sample, got, frame_bytes, left ) != 0 )
+		return -1;
+
+	return got;
+}
+
+// EXPORTED SYMBOL
+ssize_t esprom_sample_map_frames( esprom_sample_handle sample, size_t frames, size_t frame_bytes, esprom_span_t span[2] ) {
+
+	mem_chunk_ctx_t ctx;
+	size_t left;
+	size_t bytes;
+	int i;
+
+	if(!sample || !frame_bytes || !span)
+		return -1;
+
+	memset(span, 0, 2 * sizeof(esprom_span_t));
+
+	left = _frames_left( sample, frame_bytes );
+	if( frames > left )
+		frames = left;
+
+	bytes = frames * frame_bytes;
+
+	// at most one chunk crossing - a buffer each side of it.
+	ctx = sample->mem_chunk_ctx;
+	for(i=0;(i<2) && (bytes > 0);i++) {
+
+		void * buffer;
+		size_t bufferlen;
+
+		if( mem_chunk_getbuffer( &ctx, &buffer, &bufferlen ) != 0 )
+			return -1;
+
+		if( bufferlen > bytes )
+			bufferlen = bytes;
+
+		span[i].data = buffer;
+		span[i].len  = bufferlen;
+
+		if( mem_chunk_seek( &ctx, bufferlen, SEEK_CUR ) != 0 )
+			return -1;
+
+		bytes -= bufferlen;
+	}
+
+	if( bytes ) {
+		// longer than a chunk - only map the whole frames the two spans cover.
+		size_t mapped = (span[0].len + span[1].len) / frame_bytes;
+		size_t excess = (span[0].len + span[1].len) - mapped * frame_bytes;
+
+		if( excess > span[1].len ) {
+			span[0].len -= excess - span[1].len;
+			span[1].len  = 0;
+		}
+		else
+			span[1].len -= excess;
+
+		frames = mapped;
+	}
+
+	if( _skip_frames( sample, frames, frame_bytes, left ) != 0 )
+		return -1;
+
+	return frames;
+}
+
+// EXPORTED SYMBOL
+void esprom_sample_free( esprom_sample_handle sample ) {
+
+	if(sample) {
+
+		_stream_destroy(sample->stream);
+		sample->stream = NULL;
+
+		_decoder_destroy(sample->decoder);
+		sample->decoder = NULL;
+
+		switch(sample->storage) {
+		case SAMPLE_STORAGE_HEAP:
+			free(sample);
+			break;
+		case SAMPLE_STORAGE_POOL:
+			_pool_put(sample->pool, sample);
+			break;
+		default:
+			break; // the callers memory.
+		}
+	}
 }
 
 
@@ -2,6 +2,8 @@
 #pragma once
 
 #include<stddef.h>
+#include<sys/types.h>
+#include<stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -13,20 +15,287 @@ typedef struct esprom_struct * esprom_handle;
 struct esprom_sample_struct;
 typedef struct esprom_sample_struct * esprom_sample_handle;
 
+// Threads:
+//	A prom is read-only once loaded ( once esprom_sample_ready for an async prom ), so any
+//	number of threads may create and play samples from one prom without locking.
+//	A sample handle has its own cursor - use each handle from one thread at a time.
+//	Calls that change a prom ( esprom_set_format, esprom_convert_samples, esprom_free )
+//	must not overlap any other use of it ( except esprom_free of a prom from esprom_open
+//	that is still open elsewhere ).
+//	Buffers from a lazy prom can be evicted by other threads ( see esprom_paged ), so
+//	threads sharing one should copy with esprom_sample_pread / esprom_sample_read_frames.
+
 // Create / destroy a sound prom.
+//	Only bytes that samples refer to are loaded, each once - samples that alias or
+//	overlap share memory, and gaps between samples aren't stored.
 int  esprom_alloc( const char * const fn, esprom_handle * ph );
 void esprom_free (esprom_handle ph);
 
+// Create a sound prom with every sample in one contiguous arena.
+//	Samples start on a cache line ( unless they overlap another sample ) and are followed
+//	by zeroed guard bytes, so esprom_sample_getbuffer returns the rest of a sample in one buffer.
+int  esprom_alloc_arena( const char * const fn, esprom_handle * ph );
+
+// Memory flags for esprom_alloc_arena_ex and esprom_pin.
+#define ESPROM_MEM_HUGE_PAGES 0x01 // huge pages - reserved ones if the system has any, otherwise transparent ( best effort ).
+#define ESPROM_MEM_LOCK       0x02 // lock into memory ( mlock ), so nothing is paged out. Limited by RLIMIT_MEMLOCK.
+#define ESPROM_MEM_PREFAULT   0x04 // fault every page in up front, so the first playback of a sample doesn't.
+
+// esprom_alloc_arena, with the arena on huge pages ( fewer TLB misses ) and / or pinned ( see esprom_pin ).
+//	Fails if the memory can't be locked.
+int  esprom_alloc_arena_ex( const char * const fn, int flags, esprom_handle * ph );
+
+// Create a sound prom, loading it with 'threads' concurrent readers ( <= 0 for one per cpu ).
+int  esprom_alloc_parallel( const char * const fn, int threads, esprom_handle * ph );
+
+// Create a sound prom backed by a read-only mapping of the file.
+//	Nothing is copied at load time, and esprom_sample_getbuffer returns
+//	pointers straight into the mapping ( a whole sample in one buffer ).
+int  esprom_alloc_mmap( const char * const fn, esprom_handle * ph );
+
+// Compile a prom into a native image for esprom_alloc_image.
+//	The image is only valid on machines with the same byte order.
+//	Overlapping samples share one body in the image.
+int  esprom_compile( const char * const prom_fn, const char * const image_fn );
+
+// Create a sound prom from a compiled image, used in-place like esprom_alloc_mmap.
+//	The header and sample table are always checked, the sample data only if 'verify'
+//	is non-zero ( which reads the whole image ).
+int  esprom_alloc_image( const char * const fn, int verify, esprom_handle * ph );
+
+// Create a sound prom that only reads its sample table up front.
+//	Sample data is paged in on demand into an LRU cache of at most 'cache_bytes'.
+//	Buffers from esprom_sample_getbuffer remain valid until enough other data
+//	has been paged in to evict them, so consume them before reading further.
+//	Copies ( esprom_sample_pread / _read_frames ) are safe from any number of threads.
+int  esprom_alloc_lazy( const char * const fn, size_t cache_bytes, esprom_handle * ph );
+
+// Is a prom paged in on demand ( esprom_alloc_lazy )? 1 = paged, 0 = resident, -1 on error.
+//	Buffers into a paged prom can be evicted by other threads sharing it.
+int  esprom_paged( esprom_handle prom );
+
+// Open a prom shared with the rest of the process. Opening a file that is already open
+//	( same device, inode and modification time ) returns the same handle with another
+//	reference, esprom_free drops one. Compiled images are mapped ( esprom_alloc_image ),
+//	anything else is loaded with esprom_alloc. Shared proms can't be converted.
+int  esprom_open( const char * const fn, esprom_handle * ph );
+
+// Copy a prom into a sealed memfd, in the compiled image format, so other processes can
+//	esprom_attach it ( pass 'fd' over a unix socket, or let a child inherit it ).
+//	Close 'fd' once it has been handed out. Sample formats go with it.
+int  esprom_export( esprom_handle prom, int * fd );
+
+// Use a prom exported by esprom_export, in-place and read-only. 'fd' may be closed afterwards.
+int  esprom_attach( int fd, esprom_handle * ph );
+
+// Create a sound prom that streams long samples from disk. Samples longer than 'threshold'
+//	bytes only have their first 'head_bytes' ( rounded up to 32KiB ) loaded, for an instant start.
+//	Each handle on one reads the rest through a few 32KiB buffers of its own, filled in the
+//	background ahead of the handles cursor - so memory grows with voices, not sample length.
+//	A buffer from a streamed sample is valid until the handle has read two buffers further on.
+//	Buffers for 'handles' streamed handles are allocated here, opening another fails until one
+//	is esprom_sample_free'd ( so always free them, even from esprom_sample_init or a pool ).
+int  esprom_alloc_streaming( const char * const fn, size_t threshold, size_t head_bytes, int handles, esprom_handle * ph );
+
+// Called from the loader thread of an async prom as each sample finishes loading.
+//	'ready' is 1 if the sample loaded, -1 if it failed.
+typedef void (*esprom_ready_callback)( esprom_handle prom, int sample_id, int ready, void * user );
+
+// Create a sound prom that returns as soon as its sample table is read.
+//	Sample data is loaded by a background thread, the samples listed in 'order' first,
+//	then the rest in file order. 'order' and 'callback' are optional.
+//	esprom_sample_alloc blocks until the requested sample is loaded, esprom_sample_init and
+//	esprom_sample_pool_get fail until it is.
+int  esprom_alloc_async( const char * const fn, const int * order, int order_len,
+		esprom_ready_callback callback, void * user, esprom_handle * ph );
+
+// Has a sample finished loading? 1 = ready, 0 = still loading, -1 = failed.
+//	Samples of a synchronously loaded prom are always ready. Lock-free, as is waiting on a loaded sample.
+int  esprom_sample_ready( esprom_handle prom, int sample_id );
+
+// Block until a sample has finished loading. 0 = ready, -1 = failed.
+int  esprom_sample_wait ( esprom_handle prom, int sample_id );
+
 // Create / destroy a sample on a prom.
 int esprom_sample_alloc( esprom_handle prom, int sample_id, esprom_sample_handle * sample );
 void esprom_sample_free( esprom_sample_handle sample );
 
+// Caller provided memory for a sample handle.
+typedef struct {
+	union { void * p; uint64_t u; double d; } opaque[16];
+} esprom_sample_storage_t;
+
+// Create a sample in 'storage' - no allocation. The handle lives as long as 'storage',
+//	esprom_sample_free is optional ( and does nothing ) unless the sample is streamed or compressed.
+//	Never blocks - fails ( -1 ) on a sample an async prom hasn't loaded yet ( see
+//	esprom_sample_ready ), so call esprom_sample_wait first if waiting is fine.
+int esprom_sample_init( esprom_handle prom, int sample_id, esprom_sample_storage_t * storage, esprom_sample_handle * sample );
+
+// A preallocated set of sample handles, for triggering voices without allocating.
+//	Get and free ( esprom_sample_free returns a handle to its pool ) are lock-free, and may be
+//	called from any thread. Every handle must be back before the pool is freed.
+struct esprom_sample_pool_struct;
+typedef struct esprom_sample_pool_struct esprom_sample_pool_t;
+
+int  esprom_sample_pool_alloc( esprom_sample_pool_t ** pool, int size );
+void esprom_sample_pool_free ( esprom_sample_pool_t * pool );
+
+// Create a sample from the pool. Fails ( -1 ) if every handle is in use, or, like
+//	esprom_sample_init, if an async prom hasn't loaded the sample yet.
+int  esprom_sample_pool_get( esprom_sample_pool_t * pool, esprom_handle prom, int sample_id, esprom_sample_handle * sample );
+
 // Seek to the beginning of a sample.
 int esprom_sample_rewind( esprom_sample_handle sample );
 
+// Seek within a sample ( SEEK_SET / SEEK_CUR / SEEK_END, offsets in bytes relative to the sample ).
+int esprom_sample_seek( esprom_sample_handle sample, long offset, int whence );
+
+// Current byte offset from the start of the sample.
+long esprom_sample_tell( esprom_sample_handle sample );
+
+// Copy up to 'len' bytes from 'offset' in the sample, without moving its cursor.
+//	Returns the number of bytes copied ( short at the end of the sample ), or -1.
+ssize_t esprom_sample_pread( esprom_sample_handle sample, size_t offset, void * dst, size_t len );
+
+// Copy the next 'frames' frames of 'frame_bytes' each, and move the cursor past them.
+//	Past the end of the sample 'dst' is filled with silence ( zeros ), and a trailing
+//	partial frame is dropped. Returns the number of frames that came from the sample, or -1.
+ssize_t esprom_sample_read_frames( esprom_sample_handle sample, void * dst, size_t frames, size_t frame_bytes );
+
+// A piece of sample memory.
+typedef struct {
+	const void * data;
+	size_t len;
+} esprom_span_t;
+
+// Zero-copy esprom_sample_read_frames - points 'span' at the next 'frames' frames
+//	in place and moves the cursor past them. The frames are split over two spans where
+//	they cross a chunk ( span[1].len is 0 otherwise ). Returns the number of frames mapped,
+//	which is short at the end of the sample, or when more than two spans would be needed.
+ssize_t esprom_sample_map_frames( esprom_sample_handle sample, size_t frames, size_t frame_bytes, esprom_span_t span[2] );
+
 // Get a filled buffer. you should release it with _releasebuffer when it is no-longer needed.
 int esprom_sample_getbuffer(esprom_sample_handle sample, void ** buffer, size_t * bufferlen );
 
+// Sample data formats. The prom doesn't record them, so they are set by the caller.
+typedef enum {
+	ESPROM_FORMAT_NONE = 0, // unknown.
+	ESPROM_FORMAT_S8,
+	ESPROM_FORMAT_U8,
+	ESPROM_FORMAT_S16LE,
+	ESPROM_FORMAT_S16BE,
+	ESPROM_FORMAT_F32,      // native float, -1 to 1.
+} esprom_format_t;
+
+// Native signed 16 bit.
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+	#define ESPROM_FORMAT_S16 ESPROM_FORMAT_S16BE
+#else
+	#define ESPROM_FORMAT_S16 ESPROM_FORMAT_S16LE
+#endif
+
+// Bytes per sample of a format ( 0 if unknown ).
+size_t esprom_format_bytes( esprom_format_t format );
+
+// Convert 'count' samples to ESPROM_FORMAT_S16 or ESPROM_FORMAT_F32. 'src' need not be aligned.
+int esprom_convert( void * dst, esprom_format_t dst_format, const void * src, esprom_format_t src_format, size_t count );
+
+// Describe the format of every sample on a prom, or of just one.
+//	Fails on a shared prom ( esprom_open / esprom_attach ) - formats go with it when exported.
+int esprom_set_format( esprom_handle prom, esprom_format_t format );
+int esprom_set_sample_format( esprom_handle prom, int sample_id, esprom_format_t format );
+esprom_format_t esprom_sample_format( esprom_handle prom, int sample_id );
+
+// Convert every sample on a prom to ESPROM_FORMAT_S16 or ESPROM_FORMAT_F32, once, so playback
+//	never has to. Call it straight after loading - no sample handles may be open.
+//	The converted samples are kept in an arena ( see esprom_alloc_arena ). Not for lazy proms.
+//	Fails if any sample has no format, or is shorter than one sample of its format.
+int esprom_convert_samples( esprom_handle prom, esprom_format_t format );
+
+// Compress every sample on a prom with IMA-ADPCM ( 4 bits per sample, lossy ) - about a
+//	quarter of the memory for 16 bit samples. Call it straight after loading, like esprom_convert_samples.
+//	Samples are decoded to ESPROM_FORMAT_S16 on demand, a block of 1024 frames at a time, by each
+//	handle into two 2KiB buffers of its own, so playback never waits on another thread. Buffers for
+//	'handles' handles are allocated here - like esprom_alloc_streaming, opening another fails until
+//	one is esprom_sample_free'd. A buffer is valid until the handle has read two blocks further on.
+//	Seeking only decodes the block it lands in. Fails if any sample has no format.
+int esprom_compress_samples( esprom_handle prom, int handles );
+
+// Lock ( ESPROM_MEM_LOCK ) and / or fault in ( ESPROM_MEM_PREFAULT ) the memory a prom keeps its
+//	samples in, so playback never waits on a page fault - works for any loader ( mapped proms are
+//	read in from the file ). ESPROM_MEM_HUGE_PAGES only advises transparent huge pages here.
+//	Paged proms pin their cache, but a miss still reads, compressed proms pin their blocks and decode
+//	buffers, and streamed samples only pin their heads. Waits for an async prom to load. Locked proms can't be converted or compressed,
+//	so do that first. Memory is unlocked by esprom_free. Sample memory is allocated in whole 4KiB
+//	pages, so it's locked exactly - with larger pages, a page shared with other memory isn't locked.
+int esprom_pin( esprom_handle prom, int flags );
+
+// Memory held by a prom's sample data ( excluding sample tables and sample handles ).
+typedef struct {
+	size_t sample_bytes;   // sample data the samples refer to ( shared bytes once ), as played.
+	size_t data_bytes;     // memory allocated or mapped to hold it ( compressed, cached, or just the heads ).
+	size_t resident_bytes; // of data_bytes, in RAM now ( in whole pages, so approximate ).
+	size_t locked_bytes;   // of data_bytes, locked by esprom_pin ( whole pages the prom owns ).
+	int    huge_pages;     // 0 = normal pages, 1 = transparent huge pages advised, 2 = reserved huge pages.
+} esprom_footprint_t;
+
+int esprom_footprint( esprom_handle prom, esprom_footprint_t * fp );
+
+// Multi-voice mixer. Each voice plays a sample of mono signed 16 bit ( native endian ) frames,
+//	voices are mixed to interleaved stereo signed 16 bit with saturation.
+//	A mixer is not thread safe - control it from the thread that renders.
+//	Voices on a paged prom are copied rather than mixed in place, so mixers on
+//	different threads can share any prom.
+struct esprom_mixer_struct;
+typedef struct esprom_mixer_struct esprom_mixer_t;
+
+// 'max_frames' is the most frames mixed in one pass ( longer renders are split ).
+int  esprom_mixer_alloc( esprom_mixer_t ** mixer, int voices, size_t max_frames );
+void esprom_mixer_free ( esprom_mixer_t * mixer );
+
+// Which kernels were picked for this cpu ( "avx2", "sse2", "neon" or "c" ).
+const char * esprom_mixer_backend( const esprom_mixer_t * mixer );
+
+// Start a sample on a voice, replacing whatever it was playing ( the voice is left stopped
+//	if the sample can't be started ). Doesn't allocate, so is safe on the render thread.
+//	'gain' is 0 to 1, 'pan' is -1 ( left ) to 1 ( right ).
+int  esprom_mixer_play( esprom_mixer_t * mixer, int voice, esprom_handle prom, int sample_id, float gain, float pan );
+int  esprom_mixer_set_gain( esprom_mixer_t * mixer, int voice, float gain, float pan );
+int  esprom_mixer_stop( esprom_mixer_t * mixer, int voice );
+
+// Is a voice still playing? ( voices stop at the end of their sample ).
+int  esprom_mixer_playing( const esprom_mixer_t * mixer, int voice );
+
+// Mix the next 'frames' frames of every playing voice into 'out' ( 2 * frames samples ).
+int  esprom_mixer_render( esprom_mixer_t * mixer, int16_t * out, size_t frames );
+
+// Resampler - plays a sample of mono signed 16 bit ( native endian ) frames at another rate / pitch.
+//	Reads from the samples cursor, a block at a time, so the sample isn't copied.
+//	Sinc filters for 41 cutoffs are built on first use, into a static table of about 656KiB
+//	( shared by every resampler, but held for the life of the process ).
+struct esprom_resampler_struct;
+typedef struct esprom_resampler_struct esprom_resampler_t;
+
+typedef enum {
+	ESPROM_RESAMPLE_LINEAR = 0, // cheap.
+	ESPROM_RESAMPLE_SINC,       // 16 tap windowed sinc, band limited when reading faster than 1:1.
+} esprom_resample_t;
+
+// The sample must outlive the resampler.
+int  esprom_resampler_alloc( esprom_resampler_t ** rs, esprom_sample_handle sample, esprom_resample_t mode );
+void esprom_resampler_free ( esprom_resampler_t * rs );
+
+// Input frames per output frame: ( sample rate / output rate ) * pitch. Can change while playing,
+//	and is cheap enough to call from the render thread - it only picks the two prebuilt sinc
+//	filters either side of the new cutoff. Between cutoffs, each output frame runs both.
+int  esprom_resampler_set_ratio( esprom_resampler_t * rs, double ratio );
+
+// Forget filter history, after seeking the sample.
+int  esprom_resampler_reset( esprom_resampler_t * rs );
+
+// Produce up to 'frames' frames. Returns the number produced ( short at the end of the sample ), or -1.
+ssize_t esprom_resampler_read( esprom_resampler_t * rs, int16_t * dst, size_t frames );
+
 #ifdef __cplusplus
 } // extern "C" {
 #endif
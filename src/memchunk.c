@@ -4,63 +4,186 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/types.h>
+#include <sys/mman.h>
 
 #include "memchunk.h"
 
-void free_chunks(struct mem_chunk * head) {
+static uint8_t * _get_chunk(const mem_chunk_ctx_t * ctx, size_t chunk) {
 
-	while(head) {
-		struct mem_chunk * p = head;
-		head = head->header.next;
-		free(p);
+	if( ctx->pager )
+		return ctx->pager->fault( ctx->pager, chunk );
+
+	return ctx->chunks[ chunk ];
+}
+
+// huge page arenas are mapped in whole huge pages, so the size can be worked out again when unmapping.
+static size_t _mapped_size(size_t bytes) {
+
+	return ((bytes ? bytes : 1) + (ALLOC_HUGE_PAGE_SIZE-1)) & ~((size_t)ALLOC_HUGE_PAGE_SIZE-1);
+}
+
+void mem_chunk_free(mem_chunk_ctx_t * ctx) {
+
+	if(ctx && ctx->chunks) {
+
+		if(ctx->flags & MEM_CHUNK_FLAG_MAPPED)
+			munmap(ctx->chunks[0], _mapped_size(ctx->size));
+		else if(ctx->flags & MEM_CHUNK_FLAG_OWNS_DATA) {
+			size_t i;
+			for(i=0;i<ctx->nchunks;i++)
+				free(ctx->chunks[i]);
+		}
+		free(ctx->chunks);
+		memset(ctx, 0, sizeof *ctx);
 	}
 }
 
-static struct mem_chunk * alloc_chunk(struct mem_chunk * parent) {
+int mem_chunk_alloc(mem_chunk_ctx_t * ctx, size_t bytes) {
 
-	struct mem_chunk * chunk = malloc(sizeof(struct mem_chunk));
+	size_t i;
 
-	if( chunk ) {
-		chunk->header.next = NULL;
-		if( parent )
-			parent->header.next = chunk;
+	memset(ctx, 0, sizeof *ctx);
+
+	ctx->flags      = MEM_CHUNK_FLAG_OWNS_DATA;
+	ctx->chunk_size = ALLOC_DATA_SIZE;
+	ctx->size       = bytes;
+	ctx->nchunks    = (bytes + (ALLOC_DATA_SIZE-1)) / ALLOC_DATA_SIZE;
+
+	if((ctx->chunks = calloc(ctx->nchunks ? ctx->nchunks : 1, sizeof(uint8_t *))) == NULL)
+		goto cleanup;
+
+	for(i=0;i<ctx->nchunks;i++)
+		if(posix_memalign((void **)(ctx->chunks + i), ALLOC_CHUNK_ALIGNMENT, ALLOC_DATA_SIZE) != 0)
+			goto cleanup;
+
+	return 0;
+
+cleanup:
+
+	mem_chunk_free(ctx);
+	return -1;
+}
+
+int mem_chunk_alloc_arena(mem_chunk_ctx_t * ctx, size_t bytes) {
+
+	void * data = NULL;
+	size_t len = ((bytes ? bytes : 1) + (ALLOC_ARENA_ALIGNMENT-1)) & ~((size_t)ALLOC_ARENA_ALIGNMENT-1);
+
+	if(posix_memalign(&data, ALLOC_ARENA_ALIGNMENT, len) != 0)
+		return -1;
+
+	if(mem_chunk_init_flat(ctx, data, bytes) != 0) {
+		free(data);
+		return -1;
 	}
 
-	return chunk;
+	ctx->flags = MEM_CHUNK_FLAG_OWNS_DATA;
+
+	return 0;
 }
 
-static struct mem_chunk * _alloc_num_chunks(size_t chunks) {
+int mem_chunk_alloc_arena_huge(mem_chunk_ctx_t * ctx, size_t bytes) {
 
-	struct mem_chunk * head = NULL;
-	struct mem_chunk * thiz = NULL;
+	size_t len = _mapped_size(bytes);
+	int flags = MEM_CHUNK_FLAG_OWNS_DATA | MEM_CHUNK_FLAG_MAPPED;
+	uint8_t * data;
 
-	while(chunks--) {
-		if((thiz = alloc_chunk(thiz))==NULL)
-			goto cleanup;
-		if(!head)
-			head = thiz;
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+	// reserved huge pages first - they can't be split, swapped or compacted away.
+	//	Asked for by size, the systems default huge page may not be 2MiB ( and then _mapped_size would be wrong ).
+	data = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (21 << MAP_HUGE_SHIFT), -1, 0);
+	if(data != MAP_FAILED)
+		flags |= MEM_CHUNK_FLAG_HUGETLB;
+	else
+#endif
+	{
+		// none reserved - over map, so the arena can start on a huge page boundary ( required for transparent huge pages ).
+		uint8_t * raw;
+		size_t head;
+
+		if((raw = mmap(NULL, len + ALLOC_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+			return -1;
+
+		head = (ALLOC_HUGE_PAGE_SIZE - ((uintptr_t)raw & (ALLOC_HUGE_PAGE_SIZE-1))) & (ALLOC_HUGE_PAGE_SIZE-1);
+		data = raw + head;
+
+		if(head)
+			munmap(raw, head);
+		if(ALLOC_HUGE_PAGE_SIZE - head)
+			munmap(data + len, ALLOC_HUGE_PAGE_SIZE - head);
+
+#ifdef MADV_HUGEPAGE
+		// best effort - transparent huge pages may be disabled.
+		madvise(data, len, MADV_HUGEPAGE);
+#endif
+		flags |= MEM_CHUNK_FLAG_HUGE;
 	}
 
-	return head;
+	if(mem_chunk_init_flat(ctx, data, bytes) != 0) {
+		munmap(data, len);
+		return -1;
+	}
 
-cleanup:
+	ctx->flags = flags;
 
-	free_chunks(head);
-	return NULL;
+	return 0;
 }
 
-struct mem_chunk * alloc_chunks(size_t bytes) {
+int mem_chunk_init_flat(mem_chunk_ctx_t * ctx, void * data, size_t size) {
+
+	memset(ctx, 0, sizeof *ctx);
+
+	if((ctx->chunks = malloc(sizeof(uint8_t *))) == NULL)
+		return -1;
+
+	// one chunk spanning the whole buffer - data is not ours to free.
+	ctx->chunks[0]  = data;
+	ctx->nchunks    = 1;
+	ctx->chunk_size = size ? size : 1;
+	ctx->size       = size;
+
+	return 0;
+}
+
+void mem_chunk_init_paged(mem_chunk_ctx_t * ctx, mem_chunk_pager_t * pager, size_t chunk_size, size_t size) {
+
+	memset(ctx, 0, sizeof *ctx);
 
-	return _alloc_num_chunks( (bytes + (ALLOC_DATA_SIZE-1)) / ALLOC_DATA_SIZE );
+	ctx->pager      = pager;
+	ctx->chunk_size = chunk_size;
+	ctx->size       = size;
+	ctx->nchunks    = (size + (chunk_size-1)) / chunk_size;
 }
 
 int mem_chunk_getbuffer(mem_chunk_ctx_t * ctx, void ** buffer, size_t * bufferlen ) {
 
+	size_t remaining;
+	size_t offset;
+
 	if(!ctx || ! buffer || !bufferlen)
 		return 0;
 
-	*buffer = ctx->thiz->data + ctx->thiz_offset;
-	*bufferlen = sizeof( ctx->thiz->data ) - ctx->thiz_offset;
+	if( ctx->cur_pos >= ctx->size ) {
+		// end of file.
+		*buffer = NULL;
+		*bufferlen = 0;
+		return 0;
+	}
+
+	offset    = ctx->cur_pos % ctx->chunk_size;
+	remaining = ctx->size - ctx->cur_pos;
+
+	if((*buffer = _get_chunk( ctx, ctx->cur_pos / ctx->chunk_size )) == NULL) {
+		*bufferlen = 0;
+		return -1; // failed to page in chunk.
+	}
+
+	*buffer    = ((uint8_t *)*buffer) + offset;
+	*bufferlen = ctx->chunk_size - offset;
+
+	if( *bufferlen > remaining )
+		*bufferlen = remaining;
 
 	return 0;
 }
@@ -80,47 +203,57 @@ int mem_chunk_seek( mem_chunk_ctx_t * ctx, long offset, int whence) {
 	case SEEK_END:
 		abs = ctx->size + offset;
 		break;
+	default:
+		return -1;
 	}
 
-	/*** is a relative seek possible ??? ***/
-	if( (ctx->cur_pos - ctx->thiz_offset) <= abs ) {
+	if( abs > ctx->size )
+		return -1; // attempted to seek past end of file!
 
-		/*
-		 * yes! - rewind to the beginning of this block
-		 * and make the absolute address relative.
-		 */
-		ctx->cur_pos -= ctx->thiz_offset;
-		ctx->thiz_offset = 0;
-		abs -= ctx->cur_pos;
-	}
-	else {
-
-		/*
-		 * no! - rewind to the beginning of the file.
-		 */
-		ctx->cur_pos = 0;
-		ctx->thiz_offset = 0;
-		ctx->thiz = ctx->base;
-	}
+	// the chunk is looked up from the index when a buffer is requested.
+	ctx->cur_pos = abs;
+
+	return 0;
+}
+
+ssize_t mem_chunk_pread(const mem_chunk_ctx_t * ctx, size_t offset, void * dst, size_t count) {
+
+	size_t total = 0;
+
+	if( offset >= ctx->size )
+		return 0;
+
+	if( count > (ctx->size - offset) )
+		count = ctx->size - offset;
+
+	// copy chunk by chunk, the cursor is not used.
+	while( count ) {
+
+		size_t chunk_offset = offset % ctx->chunk_size;
+		size_t actual_sz    = ctx->chunk_size - chunk_offset;
+		uint8_t * chunk;
 
-	// now seek forward to target address.
-	for(;;) {
-		if( abs < ALLOC_DATA_SIZE ) {
-			ctx->thiz_offset  = abs;
-			ctx->cur_pos += abs;
-			return 0;
+		if( actual_sz > count )
+			actual_sz = count;
+
+		if( ctx->pager && ctx->pager->read ) {
+
+			// paged chunks may be shared with other threads - let the pager copy.
+			if( ctx->pager->read( ctx->pager, offset / ctx->chunk_size, chunk_offset, ((uint8_t *)dst) + total, actual_sz ) != 0 )
+				return -1;
 		}
 		else {
 
-			if( !ctx->thiz->header.next )
-				return -1; // attempted to seek past end of file!
+			if((chunk = _get_chunk( ctx, offset / ctx->chunk_size )) == NULL)
+				return -1; // failed to page in chunk.
 
-			abs -= ALLOC_DATA_SIZE;
-			ctx->cur_pos += ALLOC_DATA_SIZE;
-			ctx->thiz = ctx->thiz->header.next;
+			memcpy( ((uint8_t *)dst) + total, chunk + chunk_offset, actual_sz );
 		}
+
+		offset += actual_sz;
+		total  += actual_sz;
+		count  -= actual_sz;
 	}
 
-	return -1; // never hit
+	return total;
 }
-
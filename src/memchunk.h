@@ -1,32 +1,68 @@
+
 #pragma once
 
 #define ALLOC_CHUNK_SIZE 4096 * 2
 
-struct mem_chunk;
+#define ALLOC_DATA_SIZE (ALLOC_CHUNK_SIZE)
 
-struct mem_chunk_header {
-	struct mem_chunk * next;
-};
+// chunks are page aligned - for direct ( O_DIRECT ) reads, and so locking a chunk
+//	into memory ( mlock ) can't lock or unlock a neighbouring allocation.
+#define ALLOC_CHUNK_ALIGNMENT 4096
+
+// arenas are page aligned, and allocated in whole pages.
+#define ALLOC_ARENA_ALIGNMENT 4096
+
+// huge page backed arenas are mapped in multiples of this ( and aligned to it ).
+//	Reserved huge pages are always requested in this size ( MAP_HUGE_2MB ).
+#define ALLOC_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+typedef enum {
+
+	MEM_CHUNK_FLAG_OWNS_DATA = 0x01, // chunks were allocated by mem_chunk_alloc.
+	MEM_CHUNK_FLAG_MAPPED    = 0x02, // the arena was mapped ( mem_chunk_alloc_arena_huge ), not allocated.
+	MEM_CHUNK_FLAG_HUGE      = 0x04, // the arena is advised to use transparent huge pages.
+	MEM_CHUNK_FLAG_HUGETLB   = 0x08, // the arena is backed by reserved ( hugetlbfs ) huge pages.
+
+} mem_chunk_flags_t;
 
-#define ALLOC_DATA_SIZE (ALLOC_CHUNK_SIZE - sizeof(struct mem_chunk_header))
+/*
+ * Optional source of chunks that are not held in the index ( eg, a demand paged cache ).
+ *	'fault' returns the chunks data, or NULL on error.
+ *	'read' is optional, and copies from a chunk while it can't be evicted by another thread.
+ */
+struct mem_chunk_pager;
+typedef struct mem_chunk_pager mem_chunk_pager_t;
 
-struct mem_chunk {
-	struct mem_chunk_header header;
-	uint8_t data[ALLOC_DATA_SIZE];
+struct mem_chunk_pager {
+	uint8_t * (*fault)(mem_chunk_pager_t * pager, size_t chunk);
+	int (*read)(mem_chunk_pager_t * pager, size_t chunk, size_t offset, void * dst, size_t count);
 };
 
+/*
+ * A byte-addressable store made of fixed size chunks.
+ *	'chunks' is a dense index, so any offset is found in constant time.
+ *	Contexts may be copied freely ( each copy has its own cursor ),
+ *	the index is shared and belongs to the context it was allocated into.
+ */
 struct mem_chunk_ctx {
 
-	struct mem_chunk * base;
-	struct mem_chunk * thiz;
+	uint8_t ** chunks;
+	mem_chunk_pager_t * pager; // if set, chunks are requested from here instead of the index.
+	size_t nchunks;
+	size_t chunk_size;
 	size_t cur_pos;
-	size_t thiz_offset;
 	size_t size;
+	int flags;
 };
 typedef struct mem_chunk_ctx mem_chunk_ctx_t;
 
-void free_chunks(struct mem_chunk * head);
-struct mem_chunk * alloc_chunks(size_t bytes);
+int  mem_chunk_alloc(mem_chunk_ctx_t * ctx, size_t bytes);
+int  mem_chunk_alloc_arena(mem_chunk_ctx_t * ctx, size_t bytes); // one contiguous chunk.
+int  mem_chunk_alloc_arena_huge(mem_chunk_ctx_t * ctx, size_t bytes); // one contiguous chunk, on huge pages where the system allows.
+int  mem_chunk_init_flat(mem_chunk_ctx_t * ctx, void * data, size_t size);
+void mem_chunk_init_paged(mem_chunk_ctx_t * ctx, mem_chunk_pager_t * pager, size_t chunk_size, size_t size);
+void mem_chunk_free(mem_chunk_ctx_t * ctx);
 int mem_chunk_getbuffer(mem_chunk_ctx_t * ctx, void ** buffer, size_t * bufferlen );
 int mem_chunk_seek( mem_chunk_ctx_t * ctx, long offset, int whence);
+ssize_t mem_chunk_pread(const mem_chunk_ctx_t * ctx, size_t offset, void * dst, size_t count);
 
@@ -0,0 +1,467 @@
+/***
+ * AUTHOR:  Christopher Stones
+ * EMAIL:   chris.stones _AT_ zoho.com / chris.stones _AT_ gmail.com
+ * LICENSE: GPL-v3
+ *
+ * Multi-voice mixer. Voices are mono signed 16 bit samples, mixed to
+ *	interleaved stereo signed 16 bit. Sample memory is read in place, through
+ *	esprom_sample_map_frames, and accumulated at 32 bits before saturating.
+ *	The kernels are picked at runtime ( AVX2 / SSE2 / NEON / C ).
+ */
+
+#include "libesprom.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define MIXER_X86
+	#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	#define MIXER_NEON
+	#include <arm_neon.h>
+#endif
+
+#define MIXER_FRAME_BYTES 2 // mono s16.
+#define MIXER_UNITY 32767   // Q15 gain of 1.0
+
+// acc[2i] += (src[i] * gl) >> 15, acc[2i+1] += (src[i] * gr) >> 15. 'src' may be unaligned.
+typedef void (*mix_fn)(int32_t * acc, const void * src, size_t frames, int16_t gl, int16_t gr);
+
+// dst[i] = saturate( acc[i] )
+typedef void (*pack_fn)(int16_t * dst, const int32_t * acc, size_t count);
+
+struct mixer_voice {
+
+	esprom_sample_storage_t storage; // the voices sample lives here, so starting one doesn't allocate.
+	esprom_sample_handle sample; // NULL if the slot is free.
+	int16_t gl;
+	int16_t gr;
+	int playing;
+	int copy; // prom is paged - its buffers can be evicted by other threads.
+};
+
+struct esprom_mixer_struct {
+
+	struct mixer_voice * voices;
+	int nvoices;
+
+	int32_t * acc;
+	int16_t * scratch; // frames copied from paged proms.
+	size_t max_frames;
+
+	mix_fn  mix;
+	pack_fn pack;
+	const char * backend;
+};
+
+/*** C ***/
+
+static void _mix_c(int32_t * acc, const void * src, size_t frames, int16_t gl, int16_t gr) {
+
+	const uint8_t * p = (const uint8_t *)src;
+	size_t i;
+
+	for(i=0;i<frames;i++) {
+		int16_t s;
+		memcpy(&s, p + i * MIXER_FRAME_BYTES, sizeof s);
+		acc[2*i+0] += ((int32_t)s * gl) >> 15;
+		acc[2*i+1] += ((int32_t)s * gr) >> 15;
+	}
+}
+
+static void _pack_c(int16_t * dst, const int32_t * acc, size_t count) {
+
+	size_t i;
+
+	for(i=0;i<count;i++)
+		dst[i] = acc[i] > INT16_MAX ? INT16_MAX : (acc[i] < INT16_MIN ? INT16_MIN : acc[i]);
+}
+
+/*** SSE2 / AVX2 ***/
+
+#ifdef MIXER_X86
+
+__attribute__((target("sse2")))
+static void _mix_sse2(int32_t * acc, const void * src, size_t frames, int16_t gl, int16_t gr) {
+
+	const __m128i vgl = _mm_set1_epi16(gl);
+	const __m128i vgr = _mm_set1_epi16(gr);
+	size_t i = 0;
+
+	for(;(i+8)<=frames;i+=8) {
+
+		__m128i s  = _mm_loadu_si128((const __m128i *)(((const uint8_t *)src) + i * MIXER_FRAME_BYTES));
+
+		// 16x16 -> 32 bit products, then Q15.
+		__m128i ll = _mm_mullo_epi16(s, vgl);
+		__m128i lh = _mm_mulhi_epi16(s, vgl);
+		__m128i rl = _mm_mullo_epi16(s, vgr);
+		__m128i rh = _mm_mulhi_epi16(s, vgr);
+
+		__m128i l0 = _mm_srai_epi32(_mm_unpacklo_epi16(ll, lh), 15); // L0..L3
+		__m128i l1 = _mm_srai_epi32(_mm_unpackhi_epi16(ll, lh), 15); // L4..L7
+		__m128i r0 = _mm_srai_epi32(_mm_unpacklo_epi16(rl, rh), 15);
+		__m128i r1 = _mm_srai_epi32(_mm_unpackhi_epi16(rl, rh), 15);
+
+		__m128i * a = (__m128i *)(acc + 2*i);
+
+		_mm_storeu_si128(a + 0, _mm_add_epi32(_mm_loadu_si128(a + 0), _mm_unpacklo_epi32(l0, r0)));
+		_mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1), _mm_unpackhi_epi32(l0, r0)));
+		_mm_storeu_si128(a + 2, _mm_add_epi32(_mm_loadu_si128(a + 2), _mm_unpacklo_epi32(l1, r1)));
+		_mm_storeu_si128(a + 3, _mm_add_epi32(_mm_loadu_si128(a + 3), _mm_unpackhi_epi32(l1, r1)));
+	}
+
+	_mix_c(acc + 2*i, ((const uint8_t *)src) + i * MIXER_FRAME_BYTES, frames - i, gl, gr);
+}
+
+__attribute__((target("sse2")))
+static void _pack_sse2(int16_t * dst, const int32_t * acc, size_t count) {
+
+	size_t i = 0;
+
+	for(;(i+8)<=count;i+=8) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(acc + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(acc + i + 4));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(a, b));
+	}
+
+	_pack_c(dst + i, acc + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void _mix_avx2(int32_t * acc, const void * src, size_t frames, int16_t gl, int16_t gr) {
+
+	const __m256i vgl = _mm256_set1_epi16(gl);
+	const __m256i vgr = _mm256_set1_epi16(gr);
+	size_t i = 0;
+
+	for(;(i+16)<=frames;i+=16) {
+
+		__m256i s  = _mm256_loadu_si256((const __m256i *)(((const uint8_t *)src) + i * MIXER_FRAME_BYTES));
+
+		__m256i ll = _mm256_mullo_epi16(s, vgl);
+		__m256i lh = _mm256_mulhi_epi16(s, vgl);
+		__m256i rl = _mm256_mullo_epi16(s, vgr);
+		__m256i rh = _mm256_mulhi_epi16(s, vgr);
+
+		// unpacks work within 128 bit lanes: l0 = L0..L3 | L8..L11, l1 = L4..L7 | L12..L15
+		__m256i l0 = _mm256_srai_epi32(_mm256_unpacklo_epi16(ll, lh), 15);
+		__m256i l1 = _mm256_srai_epi32(_mm256_unpackhi_epi16(ll, lh), 15);
+		__m256i r0 = _mm256_srai_epi32(_mm256_unpacklo_epi16(rl, rh), 15);
+		__m256i r1 = _mm256_srai_epi32(_mm256_unpackhi_epi16(rl, rh), 15);
+
+		__m256i a0 = _mm256_unpacklo_epi32(l0, r0); // L0R0L1R1 | L8R8L9R9
+		__m256i a1 = _mm256_unpackhi_epi32(l0, r0); // L2R2L3R3 | L10R10L11R11
+		__m256i b0 = _mm256_unpacklo_epi32(l1, r1); // L4R4L5R5 | L12R12L13R13
+		__m256i b1 = _mm256_unpackhi_epi32(l1, r1); // L6R6L7R7 | L14R14L15R15
+
+		__m256i * a = (__m256i *)(acc + 2*i);
+
+		_mm256_storeu_si256(a + 0, _mm256_add_epi32(_mm256_loadu_si256(a + 0), _mm256_permute2x128_si256(a0, a1, 0x20)));
+		_mm256_storeu_si256(a + 1, _mm256_add_epi32(_mm256_loadu_si256(a + 1), _mm256_permute2x128_si256(b0, b1, 0x20)));
+		_mm256_storeu_si256(a + 2, _mm256_add_epi32(_mm256_loadu_si256(a + 2), _mm256_permute2x128_si256(a0, a1, 0x31)));
+		_mm256_storeu_si256(a + 3, _mm256_add_epi32(_mm256_loadu_si256(a + 3), _mm256_permute2x128_si256(b0, b1, 0x31)));
+	}
+
+	_mix_sse2(acc + 2*i, ((const uint8_t *)src) + i * MIXER_FRAME_BYTES, frames - i, gl, gr);
+}
+
+__attribute__((target("avx2")))
+static void _pack_avx2(int16_t * dst, const int32_t * acc, size_t count) {
+
+	size_t i = 0;
+
+	for(;(i+16)<=count;i+=16) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(acc + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(acc + i + 8));
+		// packs works within lanes, put the quads back in order.
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8));
+	}
+
+	_pack_sse2(dst + i, acc + i, count - i);
+}
+
+#endif // MIXER_X86
+
+/*** NEON ***/
+
+#ifdef MIXER_NEON
+
+static void _mix_neon(int32_t * acc, const void * src, size_t frames, int16_t gl, int16_t gr) {
+
+	size_t i = 0;
+
+	for(;(i+8)<=frames;i+=8) {
+
+		int16x8_t s = vreinterpretq_s16_u8(vld1q_u8(((const uint8_t *)src) + i * MIXER_FRAME_BYTES));
+
+		int32x4x2_t lo = vzipq_s32(vshrq_n_s32(vmull_n_s16(vget_low_s16 (s), gl), 15), vshrq_n_s32(vmull_n_s16(vget_low_s16 (s), gr), 15));
+		int32x4x2_t hi = vzipq_s32(vshrq_n_s32(vmull_n_s16(vget_high_s16(s), gl), 15), vshrq_n_s32(vmull_n_s16(vget_high_s16(s), gr), 15));
+
+		int32_t * a = acc + 2*i;
+
+		vst1q_s32(a +  0, vaddq_s32(vld1q_s32(a +  0), lo.val[0]));
+		vst1q_s32(a +  4, vaddq_s32(vld1q_s32(a +  4), lo.val[1]));
+		vst1q_s32(a +  8, vaddq_s32(vld1q_s32(a +  8), hi.val[0]));
+		vst1q_s32(a + 12, vaddq_s32(vld1q_s32(a + 12), hi.val[1]));
+	}
+
+	_mix_c(acc + 2*i, ((const uint8_t *)src) + i * MIXER_FRAME_BYTES, frames - i, gl, gr);
+}
+
+static void _pack_neon(int16_t * dst, const int32_t * acc, size_t count) {
+
+	size_t i = 0;
+
+	for(;(i+8)<=count;i+=8)
+		vst1q_s16(dst + i, vcombine_s16(vqmovn_s32(vld1q_s32(acc + i)), vqmovn_s32(vld1q_s32(acc + i + 4))));
+
+	_pack_c(dst + i, acc + i, count - i);
+}
+
+#endif // MIXER_NEON
+
+static void _pick_kernels(esprom_mixer_t * mixer) {
+
+	mixer->mix     = &_mix_c;
+	mixer->pack    = &_pack_c;
+	mixer->backend = "c";
+
+#if defined(MIXER_X86)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		mixer->mix     = &_mix_avx2;
+		mixer->pack    = &_pack_avx2;
+		mixer->backend = "avx2";
+	}
+	else if(__builtin_cpu_supports("sse2")) {
+		mixer->mix     = &_mix_sse2;
+		mixer->pack    = &_pack_sse2;
+		mixer->backend = "sse2";
+	}
+#elif defined(MIXER_NEON)
+	mixer->mix     = &_mix_neon;
+	mixer->pack    = &_pack_neon;
+	mixer->backend = "neon";
+#endif
+}
+
+static int16_t _q15(float f) {
+
+	if(f <= 0.0f)
+		return 0;
+	if(f >= 1.0f)
+		return MIXER_UNITY;
+	return (int16_t)(f * MIXER_UNITY + 0.5f);
+}
+
+static void _release_voice(struct mixer_voice * voice) {
+
+	esprom_sample_free(voice->sample);
+	memset(voice, 0, sizeof *voice);
+}
+
+// EXPORTED SYMBOL
+int esprom_mixer_alloc( esprom_mixer_t ** mixer, int voices, size_t max_frames ) {
+
+	if(!mixer || (voices <= 0) || !max_frames)
+		return -1;
+
+	if((*mixer = calloc(1, sizeof(esprom_mixer_t))) == NULL)
+		goto bad;
+
+	if(((*mixer)->voices = calloc(voices, sizeof(struct mixer_voice))) == NULL)
+		goto bad;
+
+	if(posix_memalign((void **)&(*mixer)->acc, 64, 2 * max_frames * sizeof(int32_t)) != 0) {
+		(*mixer)->acc = NULL;
+		goto bad;
+	}
+
+	if(((*mixer)->scratch = malloc(max_frames * MIXER_FRAME_BYTES)) == NULL)
+		goto bad;
+
+	(*mixer)->nvoices    = voices;
+	(*mixer)->max_frames = max_frames;
+
+	_pick_kernels(*mixer);
+
+	return 0;
+
+bad:
+	if(mixer && *mixer) {
+		free((*mixer)->acc);
+		free((*mixer)->voices);
+		free(*mixer);
+		*mixer = NULL;
+	}
+	return -1;
+}
+
+// EXPORTED SYMBOL
+void esprom_mixer_free( esprom_mixer_t * mixer ) {
+
+	if(mixer) {
+		int i;
+		for(i=0;i<mixer->nvoices;i++)
+			_release_voice(mixer->voices + i);
+		free(mixer->voices);
+		free(mixer->acc);
+		free(mixer->scratch);
+		free(mixer);
+	}
+}
+
+// EXPORTED SYMBOL
+const char * esprom_mixer_backend( const esprom_mixer_t * mixer ) {
+
+	return mixer ? mixer->backend : NULL;
+}
+
+// EXPORTED SYMBOL
+int esprom_mixer_play( esprom_mixer_t * mixer, int voice, esprom_handle prom, int sample_id, float gain, float pan ) {
+
+	esprom_sample_handle sample;
+
+	if(!mixer || (voice < 0) || (voice >= mixer->nvoices))
+		return -1;
+
+	// the old sample goes first - it's in the storage ( and may hold stream buffers ) the new one needs.
+	_release_voice(mixer->voices + voice);
+
+	if(esprom_sample_init(prom, sample_id, &mixer->voices[voice].storage, &sample) != 0)
+		return -1;
+
+	mixer->voices[voice].sample  = sample;
+	mixer->voices[voice].playing = 1;
+	mixer->voices[voice].copy    = (esprom_paged(prom) == 1);
+
+	return esprom_mixer_set_gain(mixer, voice, gain, pan);
+}
+
+// EXPORTED SYMBOL
+int esprom_mixer_set_gain( esprom_mixer_t * mixer, int voice, float gain, float pan ) {
+
+	if(!mixer || (voice < 0) || (voice >= mixer->nvoices))
+		return -1;
+
+	if(pan < -1.0f) pan = -1.0f;
+	if(pan >  1.0f) pan =  1.0f;
+
+	// linear pan law - centre is full gain on both sides.
+	mixer->voices[voice].gl = _q15(gain * (pan > 0.0f ? 1.0f - pan : 1.0f));
+	mixer->voices[voice].gr = _q15(gain * (pan < 0.0f ? 1.0f + pan : 1.0f));
+
+	return 0;
+}
+
+// EXPORTED SYMBOL
+int esprom_mixer_stop( esprom_mixer_t * mixer, int voice ) {
+
+	if(!mixer || (voice < 0) || (voice >= mixer->nvoices))
+		return -1;
+
+	_release_voice(mixer->voices + voice);
+
+	return 0;
+}
+
+// EXPORTED SYMBOL
+int esprom_mixer_playing( const esprom_mixer_t * mixer, int voice ) {
+
+	if(!mixer || (voice < 0) || (voice >= mixer->nvoices))
+		return -1;
+
+	return mixer->voices[voice].playing;
+}
+
+/*
+ * Mix the next 'frames' of a voice into 'acc'.
+ *	Spans are in place, a frame split over a chunk edge is put back together on the stack.
+ *	Voices on paged proms are copied to scratch first.
+ */
+static void _mix_voice(esprom_mixer_t * mixer, struct mixer_voice * voice, int32_t * acc, size_t frames) {
+
+	if(voice->copy) {
+
+		ssize_t got = esprom_sample_read_frames(voice->sample, mixer->scratch, frames, MIXER_FRAME_BYTES);
+
+		if(got > 0)
+			mixer->mix(acc, mixer->scratch, got, voice->gl, voice->gr);
+
+		if(got < (ssize_t)frames)
+			voice->playing = 0; // end of sample ( or a paging error ).
+		return;
+	}
+
+	while(frames) {
+
+		esprom_span_t span[2];
+		const uint8_t * p;
+		size_t n;
+		ssize_t got = esprom_sample_map_frames(voice->sample, frames, MIXER_FRAME_BYTES, span);
+
+		if(got <= 0) {
+			voice->playing = 0; // end of sample ( or a paging error ).
+			return;
+		}
+
+		n = span[0].len / MIXER_FRAME_BYTES;
+		mixer->mix(acc, span[0].data, n, voice->gl, voice->gr);
+		acc += 2*n;
+
+		p = (const uint8_t *)span[1].data;
+		n = span[1].len;
+
+		if(span[0].len % MIXER_FRAME_BYTES) {
+
+			uint8_t frame[MIXER_FRAME_BYTES];
+			frame[0] = ((const uint8_t *)span[0].data)[span[0].len - 1];
+			frame[1] = p[0];
+
+			mixer->mix(acc, frame, 1, voice->gl, voice->gr);
+			acc += 2;
+
+			p++;
+			n--;
+		}
+
+		n /= MIXER_FRAME_BYTES;
+		if(n) {
+			mixer->mix(acc, p, n, voice->gl, voice->gr);
+			acc += 2*n;
+		}
+
+		frames -= got;
+	}
+}
+
+// EXPORTED SYMBOL
+int esprom_mixer_render( esprom_mixer_t * mixer, int16_t * out, size_t frames ) {
+
+	if(!mixer || (!out && frames))
+		return -1;
+
+	while(frames) {
+
+		size_t n = frames < mixer->max_frames ? frames : mixer->max_frames;
+		int i;
+
+		memset(mixer->acc, 0, 2 * n * sizeof(int32_t));
+
+		for(i=0;i<mixer->nvoices;i++)
+			if(mixer->voices[i].playing)
+				_mix_voice(mixer, mixer->voices + i, mixer->acc, n);
+
+		mixer->pack(out, mixer->acc, 2 * n);
+
+		out    += 2 * n;
+		frames -= n;
+	}
+
+	return 0;
+}
@@ -0,0 +1,366 @@
+/***
+ * AUTHOR:  Christopher Stones
+ * EMAIL:   chris.stones _AT_ zoho.com / chris.stones _AT_ gmail.com
+ * LICENSE: GPL-v3
+ *
+ * Resampler ( pitch / rate conversion ) reading from a sample handle.
+ *	Mono signed 16 bit in and out. The sample is pulled through a small window,
+ *	a block at a time, so chunk edges are handled by esprom_sample_read_frames.
+ *	Sinc mode is a polyphase FIR - a table of RESAMPLE_TAPS coefficients for each of
+ *	RESAMPLE_PHASES fractional positions. Tables for a ladder of cutoffs are built once,
+ *	a change of ratio only picks the two either side of its cutoff, and each output frame
+ *	blends what the two filters make of it ( no trig, no allocation, nothing rebuilt ).
+ */
+
+#include "libesprom.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define RESAMPLE_X86
+	#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	#define RESAMPLE_NEON
+	#include <arm_neon.h>
+#endif
+
+#define RESAMPLE_TAPS   16
+#define RESAMPLE_PHASE_BITS 9
+#define RESAMPLE_PHASES (1 << RESAMPLE_PHASE_BITS)
+#define RESAMPLE_SHIFT  14  // coefficients are Q14.
+#define RESAMPLE_BLOCK  1024 // input frames read at a time.
+
+// taps before / after the output position.
+#define RESAMPLE_BEFORE ((RESAMPLE_TAPS/2) - 1)
+#define RESAMPLE_AFTER  (RESAMPLE_TAPS/2)
+
+// cutoffs of the prebuilt tables - RESAMPLE_CUTOFF_TOP, then down a quarter octave at a time,
+//	to below the lowest ratio allowed ( RESAMPLE_BLOCK ).
+#define RESAMPLE_CUTOFF_TOP   0.95 // leave room for the transition band.
+#define RESAMPLE_CUTOFF_STEPS 4    // tables per octave.
+#define RESAMPLE_CUTOFFS      41
+#define RESAMPLE_BLEND_BITS   8
+
+#define FRAC_BITS 32
+#define FRAC_ONE  ((uint64_t)1 << FRAC_BITS)
+
+typedef int32_t (*dot_fn)(const int16_t * x, const int16_t * c);
+
+struct esprom_resampler_struct {
+
+	esprom_sample_handle sample;
+	esprom_resample_t mode;
+
+	// sliding window over the input, with RESAMPLE_BEFORE frames of history.
+	int16_t win[RESAMPLE_BEFORE + RESAMPLE_BLOCK + RESAMPLE_TAPS];
+	size_t filled;  // frames in win.
+	size_t real;    // frames in win that came from the sample ( the rest is silence ).
+	int eof;
+
+	// output position in the window, 32.32 fixed point.
+	uint64_t pos;
+	uint64_t step;
+
+	// the ladder tables either side of the cutoff, and how far to blend from 'lo' to 'hi'
+	//	( RESAMPLE_BLEND_BITS fixed point ).
+	const int16_t * lo;
+	const int16_t * hi;
+	int32_t mix;
+	dot_fn dot;
+};
+
+/*** dot products ***/
+
+static int32_t _dot_c(const int16_t * x, const int16_t * c) {
+
+	int32_t sum = 0;
+	int i;
+	for(i=0;i<RESAMPLE_TAPS;i++)
+		sum += (int32_t)x[i] * c[i];
+	return sum;
+}
+
+#ifdef RESAMPLE_X86
+
+__attribute__((target("sse2")))
+static int32_t _dot_sse2(const int16_t * x, const int16_t * c) {
+
+	__m128i a = _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(x + 0)), _mm_load_si128((const __m128i *)(c + 0)));
+	__m128i b = _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(x + 8)), _mm_load_si128((const __m128i *)(c + 8)));
+	__m128i s = _mm_add_epi32(a, b);
+
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1,0,3,2)));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2,3,0,1)));
+	return _mm_cvtsi128_si32(s);
+}
+
+__attribute__((target("avx2")))
+static int32_t _dot_avx2(const int16_t * x, const int16_t * c) {
+
+	__m256i p = _mm256_madd_epi16(_mm256_loadu_si256((const __m256i *)x), _mm256_load_si256((const __m256i *)c));
+	__m128i s = _mm_add_epi32(_mm256_castsi256_si128(p), _mm256_extracti128_si256(p, 1));
+
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1,0,3,2)));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2,3,0,1)));
+	return _mm_cvtsi128_si32(s);
+}
+
+#endif // RESAMPLE_X86
+
+#ifdef RESAMPLE_NEON
+
+static int32_t _dot_neon(const int16_t * x, const int16_t * c) {
+
+	int16x8_t x0 = vld1q_s16(x);
+	int16x8_t x1 = vld1q_s16(x + 8);
+	int16x8_t c0 = vld1q_s16(c);
+	int16x8_t c1 = vld1q_s16(c + 8);
+	int32x4_t s;
+
+	s = vmull_s16(vget_low_s16(x0), vget_low_s16(c0));
+	s = vmlal_s16(s, vget_high_s16(x0), vget_high_s16(c0));
+	s = vmlal_s16(s, vget_low_s16 (x1), vget_low_s16 (c1));
+	s = vmlal_s16(s, vget_high_s16(x1), vget_high_s16(c1));
+
+	return vgetq_lane_s32(s, 0) + vgetq_lane_s32(s, 1) + vgetq_lane_s32(s, 2) + vgetq_lane_s32(s, 3);
+}
+
+#endif // RESAMPLE_NEON
+
+static dot_fn _pick_dot(void) {
+
+#if defined(RESAMPLE_X86)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+		return &_dot_avx2;
+	if(__builtin_cpu_supports("sse2"))
+		return &_dot_sse2;
+#elif defined(RESAMPLE_NEON)
+	return &_dot_neon;
+#endif
+	return &_dot_c;
+}
+
+/*
+ * Blackman windowed sinc, low-passed at 'cutoff' ( 1 = the input nyquist ).
+ *	Each phase is normalised to unity gain at DC.
+ */
+static void _build_coeffs(int16_t * coeffs, double cutoff) {
+
+	int p, k;
+
+	for(p=0;p<RESAMPLE_PHASES;p++) {
+
+		double h[RESAMPLE_TAPS];
+		double sum = 0.0;
+		double d = (double)p / RESAMPLE_PHASES;
+
+		for(k=0;k<RESAMPLE_TAPS;k++) {
+
+			double t = (k - RESAMPLE_BEFORE) - d; // distance from the output position.
+			double u = t / (RESAMPLE_TAPS/2);
+			double w = (fabs(u) >= 1.0) ? 0.0 : (0.42 + 0.5 * cos(M_PI * u) + 0.08 * cos(2.0 * M_PI * u));
+			double s = (t == 0.0) ? 1.0 : sin(M_PI * cutoff * t) / (M_PI * cutoff * t);
+
+			h[k] = cutoff * s * w;
+			sum += h[k];
+		}
+
+		for(k=0;k<RESAMPLE_TAPS;k++)
+			coeffs[p * RESAMPLE_TAPS + k] = (int16_t)lrint(h[k] / sum * (1 << RESAMPLE_SHIFT));
+	}
+}
+
+static int16_t _ladder[RESAMPLE_CUTOFFS][RESAMPLE_PHASES * RESAMPLE_TAPS] __attribute__((aligned(32)));
+static pthread_once_t _ladder_once = PTHREAD_ONCE_INIT;
+
+static void _build_ladder(void) {
+
+	int i;
+
+	for(i=0;i<RESAMPLE_CUTOFFS;i++)
+		_build_coeffs(_ladder[i], RESAMPLE_CUTOFF_TOP * pow(2.0, -(double)i / RESAMPLE_CUTOFF_STEPS));
+}
+
+// One output frame of the sinc filter, at window frame 'x' and 'phase'.
+//	Both tables are normalised, so the blend keeps unity gain at DC.
+static int32_t _sinc(const esprom_resampler_t * rs, const int16_t * x, size_t phase) {
+
+	int32_t v = rs->dot(x, rs->lo + phase * RESAMPLE_TAPS);
+
+	if(rs->mix) {
+		int32_t w = rs->dot(x, rs->hi + phase * RESAMPLE_TAPS);
+		v += (int32_t)((((int64_t)w - v) * rs->mix + (1 << (RESAMPLE_BLEND_BITS-1))) >> RESAMPLE_BLEND_BITS);
+	}
+
+	return (v + (1 << (RESAMPLE_SHIFT-1))) >> RESAMPLE_SHIFT;
+}
+
+// Slide the window along and read the next block of the sample into it.
+static int _refill(esprom_resampler_t * rs) {
+
+	size_t keep;
+	size_t drop;
+	ssize_t got;
+
+	// keep what the filter still needs behind the current position.
+	drop = (size_t)(rs->pos >> FRAC_BITS);
+	drop = drop > RESAMPLE_BEFORE ? drop - RESAMPLE_BEFORE : 0;
+	if(drop > rs->filled)
+		drop = rs->filled;
+
+	keep = rs->filled - drop;
+	memmove(rs->win, rs->win + drop, keep * sizeof(int16_t));
+
+	rs->filled -= drop;
+	rs->real    = rs->real > drop ? rs->real - drop : 0;
+	rs->pos    -= (uint64_t)drop << FRAC_BITS;
+
+	if(rs->eof) {
+		// silence after the end, for the filter to ring out into.
+		memset(rs->win + rs->filled, 0, RESAMPLE_BLOCK * sizeof(int16_t));
+		rs->filled += RESAMPLE_BLOCK;
+		return 0;
+	}
+
+	if((got = esprom_sample_read_frames(rs->sample, rs->win + rs->filled, RESAMPLE_BLOCK, sizeof(int16_t))) < 0)
+		return -1;
+
+	rs->filled += RESAMPLE_BLOCK; // padded with silence by read_frames.
+	rs->real    = rs->filled - (RESAMPLE_BLOCK - got);
+
+	if(got < RESAMPLE_BLOCK)
+		rs->eof = 1;
+
+	return 0;
+}
+
+// EXPORTED SYMBOL
+int esprom_resampler_alloc( esprom_resampler_t ** rs, esprom_sample_handle sample, esprom_resample_t mode ) {
+
+	if(!rs || !sample)
+		return -1;
+
+	if((mode != ESPROM_RESAMPLE_LINEAR) && (mode != ESPROM_RESAMPLE_SINC))
+		return -1;
+
+	if((*rs = calloc(1, sizeof(esprom_resampler_t))) == NULL)
+		return -1;
+
+	(*rs)->sample = sample;
+	(*rs)->mode   = mode;
+	(*rs)->dot    = _pick_dot();
+
+	if(mode == ESPROM_RESAMPLE_SINC)
+		pthread_once(&_ladder_once, &_build_ladder);
+
+	if(esprom_resampler_set_ratio(*rs, 1.0) != 0) {
+		esprom_resampler_free(*rs);
+		*rs = NULL;
+		return -1;
+	}
+
+	esprom_resampler_reset(*rs);
+
+	return 0;
+}
+
+// EXPORTED SYMBOL
+void esprom_resampler_free( esprom_resampler_t * rs ) {
+
+	free(rs);
+}
+
+// EXPORTED SYMBOL
+int esprom_resampler_set_ratio( esprom_resampler_t * rs, double ratio ) {
+
+	double octaves;
+	int blend;
+	int i;
+
+	if(!rs || !(ratio > 0.0) || (ratio >= RESAMPLE_BLOCK))
+		return -1;
+
+	rs->step = (uint64_t)(ratio * FRAC_ONE);
+	if(!rs->step)
+		rs->step = 1;
+
+	if(rs->mode != ESPROM_RESAMPLE_SINC)
+		return 0;
+
+	// reading faster than the input rate - band limit to the output nyquist ( 1 / ratio ).
+	octaves = ratio > 1.0 ? log2(ratio) : 0.0;
+	blend   = (int)lrint(octaves * RESAMPLE_CUTOFF_STEPS * (1 << RESAMPLE_BLEND_BITS));
+
+	if(blend > ((RESAMPLE_CUTOFFS-1) << RESAMPLE_BLEND_BITS))
+		blend = (RESAMPLE_CUTOFFS-1) << RESAMPLE_BLEND_BITS;
+
+	i = blend >> RESAMPLE_BLEND_BITS;
+
+	rs->lo  = _ladder[i];
+	rs->hi  = _ladder[i < (RESAMPLE_CUTOFFS-1) ? i + 1 : i];
+	rs->mix = blend & ((1 << RESAMPLE_BLEND_BITS) - 1);
+
+	return 0;
+}
+
+// EXPORTED SYMBOL
+int esprom_resampler_reset( esprom_resampler_t * rs ) {
+
+	if(!rs)
+		return -1;
+
+	// silence before the start of the sample, so the first taps have something to read.
+	memset(rs->win, 0, sizeof rs->win);
+	rs->filled = RESAMPLE_BEFORE;
+	rs->real   = RESAMPLE_BEFORE;
+	rs->pos    = (uint64_t)RESAMPLE_BEFORE << FRAC_BITS;
+	rs->eof    = 0;
+
+	return 0;
+}
+
+// EXPORTED SYMBOL
+ssize_t esprom_resampler_read( esprom_resampler_t * rs, int16_t * dst, size_t frames ) {
+
+	size_t n = 0;
+
+	if(!rs || (!dst && frames))
+		return -1;
+
+	while(n < frames) {
+
+		size_t i = (size_t)(rs->pos >> FRAC_BITS);
+		int32_t v;
+
+		if((i >= rs->real) && rs->eof)
+			break; // past the last frame of the sample.
+
+		if((i + RESAMPLE_AFTER + 1) > rs->filled) {
+			if(_refill(rs) != 0)
+				return -1;
+			continue;
+		}
+
+		if(rs->mode == ESPROM_RESAMPLE_SINC) {
+			size_t phase = (size_t)((rs->pos & (FRAC_ONE - 1)) >> (FRAC_BITS - RESAMPLE_PHASE_BITS));
+			v = _sinc(rs, rs->win + i - RESAMPLE_BEFORE, phase);
+		}
+		else {
+			int32_t frac = (int32_t)((rs->pos & (FRAC_ONE - 1)) >> (FRAC_BITS - 15));
+			v = rs->win[i] + ((((int32_t)rs->win[i+1] - rs->win[i]) * frac) >> 15);
+		}
+
+		dst[n++] = v > INT16_MAX ? INT16_MAX : (v < INT16_MIN ? INT16_MIN : v);
+
+		rs->pos += rs->step;
+	}
+
+	return n;
+}
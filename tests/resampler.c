@@ -0,0 +1,324 @@
+/***
+ * AUTHOR:  Christopher Stones
+ * EMAIL:   chris.stones _AT_ zoho.com / chris.stones _AT_ gmail.com
+ * LICENSE: GPL-v3
+ *
+ * Resampler test.
+ *	Every dot product the CPU supports against the plain C one, then the linear and sinc
+ *	paths against what they should make of a ramp, DC and sine waves.
+ *
+ *	usage: esprom-resampler <scratch directory>
+ */
+
+// built in, for its static dot products ( its exported functions take the place of the librarys ).
+#include "../src/resampler.c"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#define TEST_FRAMES 8192
+
+enum {
+	TEST_RAMP = 0, // 3 * frame - linear interpolation is exact on it.
+	TEST_DC,       // a constant.
+	TEST_LOW,      // a sine well inside every passband.
+	TEST_HIGH,     // a sine at 0.8 of the input nyquist.
+	TEST_SAMPLES
+};
+
+#define TEST_AMPLITUDE 10000.0
+#define TEST_LOW_PERIOD 64.0
+#define TEST_HIGH_PERIOD 2.5
+
+static char prom_path[4096];
+static int failures;
+
+static void _fail(const char * what, double ratio, long detail) {
+
+	fprintf(stderr, "FAIL %s ( ratio %g, %ld )\n", what, ratio, detail);
+	failures++;
+}
+
+static void _put32(uint8_t * p, uint32_t v) {
+
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static double _signal(int id, double t) {
+
+	switch(id) {
+	case TEST_RAMP:
+		return 3.0 * t;
+	case TEST_DC:
+		return 8000.0;
+	case TEST_LOW:
+		return TEST_AMPLITUDE * sin(2.0 * M_PI * t / TEST_LOW_PERIOD);
+	default:
+		return TEST_AMPLITUDE * sin(2.0 * M_PI * t / TEST_HIGH_PERIOD);
+	}
+}
+
+// A prom of TEST_SAMPLES samples of TEST_FRAMES native 16 bit frames.
+static int _write_prom(void) {
+
+	size_t table_end = 18 + 10 * TEST_SAMPLES;
+	size_t size = table_end + TEST_SAMPLES * TEST_FRAMES * sizeof(int16_t);
+	uint8_t * data;
+	FILE * f;
+	size_t i;
+	int id;
+
+	if((data = calloc(1, size)) == NULL)
+		return -1;
+
+	memcpy(data, "ESPROM", 6);
+	data[15] = TEST_SAMPLES;
+
+	for(id=0;id<TEST_SAMPLES;id++) {
+
+		size_t start = table_end + id * TEST_FRAMES * sizeof(int16_t);
+
+		_put32(data + 18 + 10 * id + 0, start);
+		_put32(data + 18 + 10 * id + 4, start + TEST_FRAMES * sizeof(int16_t) - 1);
+
+		for(i=0;i<TEST_FRAMES;i++) {
+			int16_t v = (int16_t)lrint(_signal(id, i));
+			memcpy(data + start + i * sizeof(int16_t), &v, sizeof v);
+		}
+	}
+
+	if((f = fopen(prom_path, "wb")) == NULL) {
+		free(data);
+		return -1;
+	}
+
+	i = fwrite(data, 1, size, f);
+	free(data);
+
+	return (fclose(f) == 0) && (i == size) ? 0 : -1;
+}
+
+/*** dot products ***/
+
+static void _test_dot(const char * name, dot_fn dot) {
+
+	static int16_t x[RESAMPLE_TAPS + 1];
+	static int16_t c[RESAMPLE_TAPS] __attribute__((aligned(32)));
+	unsigned seed = 1;
+	int n, k;
+
+	for(n=0;n<100000;n++) {
+
+		for(k=0;k<=RESAMPLE_TAPS;k++) {
+			seed = seed * 1103515245u + 12345u;
+			x[k] = (int16_t)(seed >> 16);
+		}
+
+		// coefficients are Q14, and the taps of a table sum to about 1 << RESAMPLE_SHIFT.
+		for(k=0;k<RESAMPLE_TAPS;k++) {
+			seed = seed * 1103515245u + 12345u;
+			c[k] = (int16_t)((int)((seed >> 16) & 0x1fff) - 0x1000);
+		}
+
+		// the window is read unaligned, the table aligned.
+		if( (dot(x, c) != _dot_c(x, c)) || (dot(x + 1, c) != _dot_c(x + 1, c)) ) {
+			fprintf(stderr, "FAIL dot %s ( %d )\n", name, n);
+			failures++;
+			return;
+		}
+	}
+
+	// the extremes.
+	for(k=0;k<RESAMPLE_TAPS;k++) {
+		x[k] = INT16_MIN;
+		c[k] = (k & 1) ? -(1 << RESAMPLE_SHIFT) / 8 : (1 << RESAMPLE_SHIFT) / 8;
+	}
+	if( dot(x, c) != _dot_c(x, c) ) {
+		fprintf(stderr, "FAIL dot %s ( extremes )\n", name);
+		failures++;
+	}
+}
+
+static void _test_dots(void) {
+
+	_test_dot("c", &_dot_c);
+
+#if defined(RESAMPLE_X86)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse2"))
+		_test_dot("sse2", &_dot_sse2);
+	if(__builtin_cpu_supports("avx2"))
+		_test_dot("avx2", &_dot_avx2);
+#elif defined(RESAMPLE_NEON)
+	_test_dot("neon", &_dot_neon);
+#endif
+}
+
+/*** resampling ***/
+
+// Resample a whole sample at 'ratio'. Returns the frames produced, or -1.
+static ssize_t _resample(esprom_handle prom, int id, esprom_resample_t mode, double ratio, int16_t * out, size_t max) {
+
+	esprom_sample_handle sample;
+	esprom_resampler_t * rs;
+	ssize_t total = 0;
+	ssize_t got;
+
+	if( esprom_sample_alloc(prom, id, &sample) != 0 )
+		return -1;
+
+	if( esprom_resampler_alloc(&rs, sample, mode) != 0 ) {
+		esprom_sample_free(sample);
+		return -1;
+	}
+
+	if( esprom_resampler_set_ratio(rs, ratio) != 0 )
+		total = -1;
+
+	// in odd sized pieces, across the resamplers blocks.
+	while( (total >= 0) && ((size_t)total < max) ) {
+
+		size_t want = max - total < 333 ? max - total : 333;
+
+		if((got = esprom_resampler_read(rs, out + total, want)) < 0)
+			total = -1;
+		else if(got == 0)
+			break;
+		else
+			total += got;
+	}
+
+	esprom_resampler_free(rs);
+	esprom_sample_free(sample);
+
+	return total;
+}
+
+// Worst error against the input signal, ignoring 'edge' frames at each end ( where the filter rings ).
+static double _error(const int16_t * out, ssize_t frames, int id, double ratio, ssize_t edge) {
+
+	double worst = 0.0;
+	ssize_t n;
+
+	for(n=edge;n<frames-edge;n++) {
+		double e = fabs(out[n] - _signal(id, n * ratio));
+		if(e > worst)
+			worst = e;
+	}
+
+	return worst;
+}
+
+static void _test_linear(esprom_handle prom, int16_t * out, size_t max) {
+
+	static const double ratios[] = { 1.0, 0.5, 2.0, 0.37, 3.3 };
+	size_t r;
+
+	for(r=0;r<sizeof ratios / sizeof ratios[0];r++) {
+
+		double ratio = ratios[r];
+		ssize_t expect = (ssize_t)ceil(TEST_FRAMES / ratio);
+		ssize_t got = _resample(prom, TEST_RAMP, ESPROM_RESAMPLE_LINEAR, ratio, out, max);
+		double e;
+
+		if( got != expect ) {
+			_fail("linear length", ratio, got);
+			continue;
+		}
+
+		// frames after the last input frame are interpolated towards silence.
+		if((e = _error(out, (ssize_t)floor((TEST_FRAMES - 1) / ratio) + 1, TEST_RAMP, ratio, 0)) > ((ratio == 1.0) ? 0.0 : 1.0))
+			_fail("linear ramp", ratio, (long)e);
+	}
+}
+
+static void _test_sinc(esprom_handle prom, int16_t * out, size_t max) {
+
+	// on a ladder table, and between two.
+	static const double ratios[] = { 1.0, 0.5, 1.37, 2.0, 3.1 };
+	size_t r;
+
+	for(r=0;r<sizeof ratios / sizeof ratios[0];r++) {
+
+		double ratio = ratios[r];
+		ssize_t expect = (ssize_t)ceil(TEST_FRAMES / ratio);
+		ssize_t got;
+		double e;
+		double power = 0.0;
+		ssize_t n;
+
+		// unity gain at DC, blended or not.
+		if((got = _resample(prom, TEST_DC, ESPROM_RESAMPLE_SINC, ratio, out, max)) != expect)
+			_fail("sinc length", ratio, got);
+		else if((e = _error(out, got, TEST_DC, ratio, RESAMPLE_TAPS)) > 2.0)
+			_fail("sinc dc", ratio, (long)e);
+
+		// a low tone passes, in phase.
+		if((got = _resample(prom, TEST_LOW, ESPROM_RESAMPLE_SINC, ratio, out, max)) != expect)
+			_fail("sinc length", ratio, got);
+		else if((e = _error(out, got, TEST_LOW, ratio, RESAMPLE_TAPS)) > TEST_AMPLITUDE / 100)
+			_fail("sinc passband", ratio, (long)e);
+
+		if( ratio < 2.0 )
+			continue;
+
+		// reading faster, a tone above the output nyquist is filtered out rather than aliased.
+		if((got = _resample(prom, TEST_HIGH, ESPROM_RESAMPLE_SINC, ratio, out, max)) != expect) {
+			_fail("sinc length", ratio, got);
+			continue;
+		}
+
+		for(n=RESAMPLE_TAPS;n<got-RESAMPLE_TAPS;n++)
+			power += (double)out[n] * out[n];
+
+		if((e = sqrt(power / (got - 2 * RESAMPLE_TAPS))) > TEST_AMPLITUDE / 100)
+			_fail("sinc stopband", ratio, (long)e);
+	}
+}
+
+int main(int argc, char ** argv) {
+
+	esprom_handle prom;
+	size_t max = TEST_FRAMES * 4;
+	int16_t * out;
+
+	if(argc != 2) {
+		fprintf(stderr, "usage: %s <scratch directory>\n", argv[0]);
+		return 1;
+	}
+
+	snprintf(prom_path, sizeof prom_path, "%s/resampler.prom", argv[1]);
+
+	_test_dots();
+
+	if( _write_prom() != 0 ) {
+		fprintf(stderr, "can't write %s\n", prom_path);
+		return 1;
+	}
+
+	if( esprom_alloc(prom_path, &prom) != 0 ) {
+		fprintf(stderr, "can't load %s\n", prom_path);
+		return 1;
+	}
+
+	if((out = malloc(max * sizeof(int16_t))) == NULL)
+		return 1;
+
+	_test_linear(prom, out, max);
+	_test_sinc(prom, out, max);
+
+	free(out);
+	esprom_free(prom);
+	unlink(prom_path);
+
+	if(failures) {
+		fprintf(stderr, "%d failures\n", failures);
+		return 1;
+	}
+
+	printf("OK\n");
+	return 0;
+}
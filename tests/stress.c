@@ -0,0 +1,347 @@
+/***
+ * AUTHOR:  Christopher Stones
+ * EMAIL:   chris.stones _AT_ zoho.com / chris.stones _AT_ gmail.com
+ * LICENSE: GPL-v3
+ *
+ * Thread stress test.
+ *	Many threads copying samples out of one lazy prom, through a cache small enough to evict
+ *	under them, and many threads opening, writing, reading and closing files on one shared
+ *	ef_buffer. Every byte read is checked against what was written.
+ *
+ *	usage: esprom-stress <scratch directory>  ( must support O_DIRECT - not tmpfs ).
+ */
+
+#include "libesprom.h"
+#include "embedded_file.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define STRESS_THREADS    8
+#define STRESS_ITERATIONS 400
+#define STRESS_SAMPLES    64
+#define STRESS_CACHE      (64 * 1024) // a handful of chunks - readers evict each other.
+
+#define STRESS_FILE_BYTES (96 * 1024)
+#define STRESS_FILE_ROUNDS 40
+
+static char prom_path[4096];
+static esprom_handle prom;
+static uint32_t sample_start[STRESS_SAMPLES];
+static uint32_t sample_end[STRESS_SAMPLES];
+
+static const char * dir;
+static ef_buffer_t shared;
+
+static int failures;
+
+static void _fail(const char * what, int thread, long detail) {
+
+	fprintf(stderr, "FAIL %s ( thread %d, %ld )\n", what, thread, detail);
+	__sync_fetch_and_add(&failures, 1);
+}
+
+// the byte at 'offset' of file 'seed' - any offset can be checked without a reference copy.
+static uint8_t _pattern(uint32_t seed, size_t offset) {
+
+	uint32_t x = (uint32_t)offset * 2654435761u + seed * 40503u;
+
+	x ^= x >> 15;
+	x *= 2246822519u;
+	x ^= x >> 13;
+
+	return (uint8_t)x;
+}
+
+static unsigned _rand(unsigned * state) {
+
+	*state = *state * 1103515245u + 12345u;
+	return (*state >> 8) & 0xffffff;
+}
+
+static void _put32(uint8_t * p, uint32_t v) {
+
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/*
+ * A prom of STRESS_SAMPLES samples, of all sizes from a byte to several chunks.
+ *	Some alias part of an earlier sample.
+ */
+static int _write_prom(void) {
+
+	size_t table_end = 18 + 10 * STRESS_SAMPLES;
+	size_t size = table_end;
+	uint8_t * data;
+	unsigned seed = 1;
+	FILE * f;
+	size_t i;
+
+	for(i=0;i<STRESS_SAMPLES;i++) {
+
+		static const uint32_t lengths[] = { 1, 2, 511, 4096, 8191, 8192, 20000, 70001 };
+
+		if( i && ((i % 7) == 0) ) {
+			// alias the middle of an earlier sample.
+			size_t j = _rand(&seed) % i;
+			sample_start[i] = sample_start[j] + (sample_end[j] - sample_start[j]) / 2;
+			sample_end[i]   = sample_end[j];
+			continue;
+		}
+
+		size += _rand(&seed) % 600; // gaps, so samples don't line up with the file.
+
+		sample_start[i] = size;
+		sample_end[i]   = size + lengths[i % 8] - 1;
+		size = sample_end[i] + 1;
+	}
+
+	if((data = malloc(size)) == NULL)
+		return -1;
+
+	for(i=table_end;i<size;i++)
+		data[i] = _pattern(0, i);
+
+	memset(data, 0, table_end);
+	memcpy(data, "ESPROM", 6);
+	data[14] = STRESS_SAMPLES >> 8;
+	data[15] = STRESS_SAMPLES & 0xff;
+
+	for(i=0;i<STRESS_SAMPLES;i++) {
+		_put32(data + 18 + 10 * i + 0, sample_start[i]);
+		_put32(data + 18 + 10 * i + 4, sample_end[i]);
+	}
+
+	if((f = fopen(prom_path, "wb")) == NULL) {
+		free(data);
+		return -1;
+	}
+
+	i = fwrite(data, 1, size, f);
+	free(data);
+
+	return (fclose(f) == 0) && (i == size) ? 0 : -1;
+}
+
+static int _check(const uint8_t * buffer, size_t file_offset, size_t len, uint32_t seed) {
+
+	size_t i;
+
+	for(i=0;i<len;i++)
+		if( buffer[i] != _pattern(seed, file_offset + i) )
+			return -1;
+
+	return 0;
+}
+
+/*** concurrent copies out of one lazy prom ***/
+
+static void * _prom_thread(void * arg) {
+
+	int thread = (int)(intptr_t)arg;
+	unsigned seed = 1000 + thread;
+	uint8_t * buffer;
+	int n;
+
+	if((buffer = malloc(80 * 1024)) == NULL) {
+		_fail("malloc", thread, 0);
+		return NULL;
+	}
+
+	for(n=0;n<STRESS_ITERATIONS;n++) {
+
+		int id = _rand(&seed) % STRESS_SAMPLES;
+		size_t len = 1 + sample_end[id] - sample_start[id];
+		esprom_sample_storage_t storage;
+		esprom_sample_handle sample;
+		size_t offset;
+		size_t count;
+		ssize_t got;
+		size_t total;
+
+		// handles from the heap and from the callers memory.
+		if( ((n & 1) ? esprom_sample_init(prom, id, &storage, &sample) : esprom_sample_alloc(prom, id, &sample)) != 0 ) {
+			_fail("sample", thread, id);
+			continue;
+		}
+
+		// random copies.
+		offset = _rand(&seed) % len;
+		count  = 1 + _rand(&seed) % (len - offset);
+
+		if( (esprom_sample_pread(sample, offset, buffer, count) != (ssize_t)count) ||
+			(_check(buffer, sample_start[id] + offset, count, 0) != 0) )
+			_fail("pread", thread, id);
+
+		// the rest of the sample in odd sized frames, from a seek.
+		offset = _rand(&seed) % len;
+		total  = 0;
+
+		if( esprom_sample_seek(sample, offset, SEEK_SET) != 0 )
+			_fail("seek", thread, id);
+
+		while((got = esprom_sample_read_frames(sample, buffer + total, 333, 3)) > 0) {
+
+			total += got * 3;
+			if( got < 333 )
+				break;
+		}
+
+		// a trailing partial frame is dropped.
+		if( (got < 0) || (total != (len - offset) / 3 * 3) ||
+			(_check(buffer, sample_start[id] + offset, (len - offset) / 3 * 3, 0) != 0) )
+			_fail("read_frames", thread, id);
+
+		esprom_sample_free(sample);
+	}
+
+	free(buffer);
+
+	return NULL;
+}
+
+/*** concurrent files on one shared buffer ***/
+
+static void * _file_thread(void * arg) {
+
+	int thread = (int)(intptr_t)arg;
+	unsigned seed = 2000 + thread;
+	char path[4096];
+	uint8_t * buffer;
+	int round;
+
+	if((buffer = malloc(STRESS_FILE_BYTES)) == NULL) {
+		_fail("malloc", thread, 0);
+		return NULL;
+	}
+
+	snprintf(path, sizeof path, "%s/stress-%d.bin", dir, thread);
+
+	for(round=0;round<STRESS_FILE_ROUNDS;round++) {
+
+		uint32_t pattern = 1 + thread * STRESS_FILE_ROUNDS + round;
+		ef_file_t file;
+		size_t offset;
+		size_t count;
+		size_t i;
+
+		// write a fresh file in unaligned pieces, through the shared buffer.
+		if( ef_file_open(&file, shared, path, O_RDWR | O_CREAT | O_TRUNC, 0644) != 0 ) {
+			_fail("open for writing", thread, round);
+			continue;
+		}
+
+		for(i=0;i<STRESS_FILE_BYTES;i++)
+			buffer[i] = _pattern(pattern, i);
+
+		for(i=0;i<STRESS_FILE_BYTES;i+=count) {
+
+			count = 1 + _rand(&seed) % 5000;
+			if( count > (STRESS_FILE_BYTES - i) )
+				count = STRESS_FILE_BYTES - i;
+
+			if( ef_file_write(file, buffer + i, count) != (ssize_t)count ) {
+				_fail("write", thread, round);
+				break;
+			}
+		}
+
+		// read some back before closing ( some of it is still dirty in the buffer ).
+		offset = _rand(&seed) % STRESS_FILE_BYTES;
+		count  = 1 + _rand(&seed) % (STRESS_FILE_BYTES - offset);
+
+		if( (ef_file_pread(file, buffer, count, offset) != (ssize_t)count) ||
+			(_check(buffer, offset, count, pattern) != 0) )
+			_fail("pread before close", thread, round);
+
+		if( ef_file_close(file) != 0 )
+			_fail("close", thread, round);
+
+		// and all of it, through a new handle.
+		if( ef_file_open(&file, shared, path, O_RDONLY, 0) != 0 ) {
+			_fail("open for reading", thread, round);
+			continue;
+		}
+
+		if( (ef_file_read(file, buffer, STRESS_FILE_BYTES) != STRESS_FILE_BYTES) ||
+			(_check(buffer, 0, STRESS_FILE_BYTES, pattern) != 0) )
+			_fail("read", thread, round);
+
+		ef_file_close(file);
+	}
+
+	unlink(path);
+	free(buffer);
+
+	return NULL;
+}
+
+static int _run(void * (*fn)(void *)) {
+
+	pthread_t threads[STRESS_THREADS];
+	int started = 0;
+	int i;
+
+	for(i=0;i<STRESS_THREADS;i++)
+		if( pthread_create(threads + started, NULL, fn, (void *)(intptr_t)i) == 0 )
+			started++;
+
+	for(i=0;i<started;i++)
+		pthread_join(threads[i], NULL);
+
+	return started == STRESS_THREADS ? 0 : -1;
+}
+
+int main(int argc, char ** argv) {
+
+	if(argc != 2) {
+		fprintf(stderr, "usage: %s <scratch directory>\n", argv[0]);
+		return 1;
+	}
+
+	dir = argv[1];
+	snprintf(prom_path, sizeof prom_path, "%s/stress.prom", dir);
+
+	if( _write_prom() != 0 ) {
+		fprintf(stderr, "can't write %s\n", prom_path);
+		return 1;
+	}
+
+	if( esprom_alloc_lazy(prom_path, STRESS_CACHE, &prom) != 0 ) {
+		fprintf(stderr, "can't load %s\n", prom_path);
+		return 1;
+	}
+
+	if( _run(&_prom_thread) != 0 )
+		_fail("threads", -1, 0);
+
+	esprom_free(prom);
+	unlink(prom_path);
+
+	// small enough that files evict each others blocks, with background write-back.
+	if( (ef_buffer_create_cache(&shared, 16) != 0) || (ef_buffer_set_writeback(shared, 4) != 0) ) {
+		fprintf(stderr, "can't create a shared buffer\n");
+		return 1;
+	}
+
+	if( _run(&_file_thread) != 0 )
+		_fail("threads", -1, 0);
+
+	ef_buffer_destroy(shared);
+
+	if(failures) {
+		fprintf(stderr, "%d failures\n", failures);
+		return 1;
+	}
+
+	printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,35 @@
+/***
+ * AUTHOR:  Christopher Stones
+ * EMAIL:   chris.stones _AT_ zoho.com / chris.stones _AT_ gmail.com
+ * LICENSE: GPL-v3
+ *
+ * Compile a prom into a native image for esprom_alloc_image.
+ */
+
+#include "libesprom.h"
+
+#include <stdio.h>
+
+int main(int argc, char ** argv) {
+
+	esprom_handle prom;
+
+	if(argc != 3) {
+		fprintf(stderr, "usage: %s <prom> <image>\n", argv[0]);
+		return 1;
+	}
+
+	if(esprom_compile(argv[1], argv[2]) != 0) {
+		fprintf(stderr, "%s: failed to compile %s\n", argv[0], argv[1]);
+		return 1;
+	}
+
+	// make sure it loads.
+	if(esprom_alloc_image(argv[2], 1, &prom) != 0) {
+		fprintf(stderr, "%s: %s doesn't load\n", argv[0], argv[2]);
+		return 1;
+	}
+	esprom_free(prom);
+
+	return 0;
+}